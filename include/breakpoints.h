@@ -0,0 +1,138 @@
+#ifndef BREAKPOINTS_H_
+#define BREAKPOINTS_H_
+
+#include <stdbool.h>
+
+/**
+ * Most breakpoints and watchpoints that can be set
+ * @since 1.2.0
+ */
+#define MAX_BREAKPOINTS 16
+#define MAX_WATCHPOINTS 16
+
+/**
+ * Most conditions one breakpoint can have
+ * @since 1.2.0
+ */
+#define MAX_CONDITIONS 4
+
+/**
+ * Size of the text `get_break_reason()` returns
+ * @since 1.2.0
+ */
+#define MAX_BREAK_REASON_SIZE 128
+
+/**
+ * Most watched bytes one instruction can write (LD [I], VF)
+ * @since 1.2.0
+ */
+#define MAX_WATCHED_BYTES 16
+
+/**
+ * What the checks remember from one instruction to the next. The machine
+ * the user runs has its own, a run checked on the side (like a replay of
+ * the history) passes another one so it doesn't disturb it.
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned int previous_pc; /**< Waiting in place only breaks once */
+    /** Watched bytes the instruction wrote, and what was there before */
+    unsigned short watched_addrs[MAX_WATCHED_BYTES];
+    unsigned char watched_bytes[MAX_WATCHED_BYTES];
+    int num_watched;
+    char reason[MAX_BREAK_REASON_SIZE]; /**< Why it would stop */
+} BreakCheck;
+
+/**
+ * Adds a breakpoint: conditions separated by commas that all have to hold
+ * before an instruction runs. A condition compares pc, I or V0-VF to a
+ * number (==, !=, <, <=, >, >=), the pc in hex like the disassembler shows
+ * it and the others like C. A bare number is the pc, e.g. "2a4",
+ * "2a4,V3==5" or "I>=0xea0"
+ * @param spec: the breakpoint
+ * @return 0 if everything is ok, 1 if it can't be parsed or there are too
+ * many
+ * @since 1.2.0
+ */
+int add_breakpoint(const char *spec);
+
+/**
+ * Adds a watchpoint on the writes of instructions to memory (LD B, Vx,
+ * LD [I], Vx and CALL)
+ * @param spec: hex address, or range of them like "300-30f"
+ * @return 0 if everything is ok, 1 if it can't be parsed or there are too
+ * many
+ * @since 1.2.0
+ */
+int add_watchpoint(const char *spec);
+
+/**
+ * Also breaks before illegal opcodes and calls that overflow the stack
+ * @since 1.2.0
+ */
+void set_break_on_errors();
+
+/**
+ * Are there any breakpoints or watchpoints. Only then the cycles have to be
+ * checked, otherwise they can run without any checks.
+ * @return true if there are, false otherwise
+ * @since 1.2.0
+ */
+bool has_breakpoints();
+
+/**
+ * Checks the breakpoints before the instruction the machine is about to
+ * execute (its clock is 2)
+ * @return true if the machine should stop before it, false otherwise
+ * @since 1.2.0
+ */
+bool should_break_before();
+
+/**
+ * Checks the watchpoints after the instruction `should_break_before()` let
+ * run
+ * @return true if it wrote to a watched address, false otherwise
+ * @since 1.2.0
+ */
+bool should_break_after();
+
+/**
+ * Starts the checks of a run on the side
+ * @param check: what the checks remember
+ * @since 1.2.0
+ */
+void init_break_check(BreakCheck *check);
+
+/**
+ * Checks the breakpoints like `should_break_before()`, remembering only in
+ * `check` (never skips the instruction)
+ * @param check: what the checks remember, the reason goes to check->reason
+ * @return true if the machine would stop before it, false otherwise
+ * @since 1.2.0
+ */
+bool check_break_before(BreakCheck *check);
+
+/**
+ * Checks the watchpoints like `should_break_after()`, after the instruction
+ * `check_break_before()` let run
+ * @param check: what the checks remember, the reason goes to check->reason
+ * @return true if it wrote to a watched address, false otherwise
+ * @since 1.2.0
+ */
+bool check_break_after(BreakCheck *check);
+
+/**
+ * Lets the next instruction run without checking the breakpoints, to
+ * continue from one
+ * @since 1.2.0
+ */
+void skip_breakpoints_once();
+
+/**
+ * Gets why the machine stopped last
+ * @return the reason, like "breakpoint 2a4"
+ * @since 1.2.0
+ */
+const char *get_break_reason();
+
+#endif
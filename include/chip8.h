@@ -2,6 +2,9 @@
 #define CHIP8_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "inst_trace.h"
 
 /**
  * Memory layout constants
@@ -19,6 +22,15 @@
 #define WIDTH 128
 #define HEIGTH 64
 #define SIZE_VIDEO_MEM (WIDTH * HEIGTH) / 8
+#define SIZE_MEMORY (START_VIDEO_MEM + SIZE_VIDEO_MEM)
+
+/**
+ * Timing constants (in microseconds, the tick speed is the time an
+ * instruction takes)
+ * @since 1.2.0
+ */
+#define FRAME_TIME (1000000 / 60)
+#define DEFAULT_TICK_SPEED 900
 
 /**
  * Macros for manipulating the signal for drawing
@@ -40,21 +52,175 @@ typedef enum {
     CLEAR,       /**< Flag for clearing the screen */
     SCROLL,      /**< Flag for scrolling the screen */
     SOUND,       /**< Flag for FLASHING the screen (not buzzing the buzzer)*/
-    KEYBOARD_BLOCKING, /**< Flag for getting keyboard input. Waits until input.
-                        */
+    KEYBOARD_BLOCKING, /**< Flag for getting keyboard input. Waits until a key
+                          is pressed and released. */
     KEYBOARD_NONBLOCKING, /**< Flag for getting keyboard input. Doesn't wait
                              until input. */
     EXIT,                 /**< Flag for shutdown */
 } Flag;
 
+typedef unsigned int (*instruction)(unsigned short);
+
+/**
+ * Memory below the video buffer is split into pages, which machines share
+ * until they write to them
+ * @since 1.2.0
+ */
+#define MEMORY_PAGE_SIZE 256
+#define NUM_MEMORY_PAGES (START_VIDEO_MEM / MEMORY_PAGE_SIZE)
+
+/**
+ * Font and program laid out in memory, read-only and shared by every machine
+ * running the program. An image is freed when the last machine using it
+ * gets freed or attached to another one.
+ * @since 1.2.0
+ */
+typedef struct RomImage {
+    unsigned char memory[SIZE_MEMORY];
+    unsigned int hash;      /**< Hash of the program */
+    size_t size;            /**< Size of the program */
+    unsigned int refs;      /**< Machines and loaded paths using it */
+    struct RomImage *next;  /**< Next image with the same hash bucket */
+} RomImage;
+
+/**
+ * State of a chip8 machine. Only the video buffer and the pages the program
+ * wrote to are its own, the rest of the memory is read from the image.
+ * Machines must be zeroed before the first `init_chip8()`.
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned char V[16];
+    unsigned short pc;
+    unsigned char sp;
+    unsigned short I;
+    unsigned char dt, st;
+    bool hi_res;
+    bool has_superchip8_quirks;
+    unsigned char flags[16];
+    unsigned char clock;   /**< Step of the fetch-decode-execute cycle */
+    unsigned short opcode; /**< Last fetched opcode */
+    unsigned char skip_reg;       /**< Register saved by SKP and SKNP */
+    bool skip_is_equal;           /**< Is the saved instruction SKP */
+    unsigned char load_reg;       /**< Register saved by LD Vx, K */
+    bool is_waiting;              /**< Is LD Vx, K waiting for a key */
+    unsigned short pressed_keys;  /**< Keys pressed while waiting */
+    unsigned int random[4];       /**< State of the xoshiro128** generator */
+    unsigned long cycles;         /**< Cycles run since `init_chip8()` */
+    unsigned char video_mem[SIZE_VIDEO_MEM];
+    const RomImage *image;        /**< Memory that wasn't written to */
+    unsigned char *pages[NUM_MEMORY_PAGES]; /**< Written pages, or NULL */
+    instruction inst; /**< Last decoded instruction (not saved) */
+    unsigned long illegal_opcodes; /**< Illegal opcodes run (not saved) */
+    bool keeps_pages; /**< Are all pages its own for good (not saved) */
+} Chip8;
+
+/**
+ * Size of a saved state: the registers in a fixed order as little-endian
+ * fields (`cycles` as 8 bytes) followed by the whole memory (video buffer
+ * included), so it doesn't depend on the host's struct layout
+ * @since 1.2.0
+ */
+#define STATE_REGISTERS_SIZE 74
+#define STATE_SIZE (STATE_REGISTERS_SIZE + SIZE_MEMORY)
+#define STATE_VERSION 4
+
+/**
+ * Size of the header of the save state file: "C8ST", then STATE_VERSION, the
+ * header size and STATE_SIZE as little-endian 4 byte fields. The STATE_SIZE
+ * bytes of `export_state()` follow it.
+ * @since 1.2.0
+ */
+#define STATE_HEADER_SIZE 16
+
+/**
+ * Gets the machine the other functions work on (separate for every thread)
+ * @return pointer to the machine
+ * @since 1.2.0
+ */
+Chip8 *get_machine();
+
+/**
+ * Sets the machine the other functions work on, for the calling thread
+ * @param machine: the machine
+ * @since 1.2.0
+ */
+void set_machine(Chip8 *machine);
+
 /**
- * Loads program to memory
+ * Records every instruction the calling thread runs (illegal ones included)
+ * in a trace, and counts its frames with `decrement_timers()`
+ * @param trace: the trace, NULL stops recording
+ * @since 1.2.0
+ */
+void set_inst_trace(InstTrace *trace);
+
+/**
+ * Calls a function before every byte the calling thread's instructions
+ * write to memory (through `write_mem()`), while the old byte is still there
+ * @param hook: gets the address of the byte, NULL stops calling it
+ * @since 1.2.0
+ */
+void set_write_hook(void (*hook)(unsigned short addr));
+
+/**
+ * Loads program to memory, through the image cache. A file loaded before
+ * isn't read again while its inode, size and mtime stay the same, except
+ * files written in the last couple of seconds (their mtime may not change on
+ * the next write yet).
  * @param program_path Path of the program
  * @return 0 if everything is ok, 1 otherwise
  * @since 0.1.0
  */
 int load_program(const char* program_path);
 
+/**
+ * Gets the cached image of a program, creating it if no machine uses it
+ * (thread safe). The caller holds a reference to it until it passes it to
+ * `attach_image()`.
+ * @param program: the program (may be NULL if size is 0)
+ * @param size: size of the program
+ * @return the image, NULL if the program is too large or out of memory
+ * @since 1.2.0
+ */
+const RomImage *get_rom_image(const unsigned char *program, size_t size);
+
+/**
+ * Resets the memory of the machine to an image, without copying it. The
+ * machine takes over the caller's reference, and drops the one to its
+ * previous image.
+ * @param image: the image
+ * @since 1.2.0
+ */
+void attach_image(const RomImage *image);
+
+/**
+ * Makes `dst` a copy of `src`, reusing the pages `dst` already has
+ * @param dst: machine to copy to (zeroed or initialized)
+ * @param src: machine to copy
+ * @return 0 if everything is ok, 1 if a page couldn't be allocated (`dst`
+ * must be copied to again or freed)
+ * @since 1.2.0
+ */
+int copy_machine(Chip8 *dst, const Chip8 *src);
+
+/**
+ * Gives the machine its own copy of every page. Writes don't allocate after
+ * it, and `restore_state()` copies into the pages instead of sharing the
+ * image again, until the machine gets freed or another image attached.
+ * @return 0 if everything is ok, 1 if a page couldn't be allocated
+ * @since 1.2.0
+ */
+int keep_pages();
+
+/**
+ * Frees the pages the machine wrote to and drops its image (the machine
+ * must be initialized again before it gets used)
+ * @param machine: the machine
+ * @since 1.2.0
+ */
+void free_machine(Chip8 *machine);
+
 /**
  * Prints registers, program counter, stack pointer, index, video buffer and
  * some memory
@@ -64,7 +230,8 @@ int load_program(const char* program_path);
 void print_state();
 
 /**
- * Initializes the program counter and stack pointer
+ * Resets the machine, loads the font and initializes the program counter and
+ * stack pointer
  * @since 0.1.0
  */
 void init_chip8();
@@ -88,6 +255,23 @@ unsigned int next_cycle();
  */
 unsigned char* get_video_mem();
 
+/**
+ * Reads a byte of memory (wraps around at SIZE_MEMORY)
+ * @param addr: address of the byte
+ * @return the byte
+ * @since 1.2.0
+ */
+unsigned char read_mem(unsigned short addr);
+
+/**
+ * Gets a byte of memory to write to, the page it's on stops being shared
+ * with the image (wraps around at SIZE_MEMORY)
+ * @param addr: address of the byte
+ * @return pointer to the byte, NULL if the page couldn't be allocated
+ * @since 1.2.0
+ */
+unsigned char *write_mem(unsigned short addr);
+
 /**
  * Decrement the sound and delay timers
  * @return SOUND if the sound delay goes to 0, IDLE otherwise
@@ -97,21 +281,71 @@ Flag decrement_timers();
 
 #define KEYBOARD_UNSET 0xff
 /**
- * Checks the key and performs the SKP or SKNP
- * @param reg MUST SET TO KEYBOARD_UNSET
- * @param is_equal MUST SET TO KEYBOARD_UNSET
- * @param key key to check
+ * Saves the register of SKP or SKNP, then checks the key and performs the skip
+ * @param reg register to save, KEYBOARD_UNSET to perform the skip
+ * @param is_equal true for SKP, false for SKNP (only used when saving)
+ * @param keys state of the keypad, bit n is set if key n is down (only used
+ * when performing the skip)
  * @since 0.1.0
  */
-void skip_key(unsigned char reg, bool is_equal, unsigned char key);
+void skip_key(unsigned char reg, bool is_equal, unsigned short keys);
 
 /**
- * Checks the key and performs the LD K, Vx instruction
- * @param reg MUST SET TO KEYBOARD_UNSET
- * @param key key to check
+ * Saves the register of LD Vx, K, then checks the keys and performs it. If no
+ * key was pressed and released yet, the instruction is executed again.
+ * @param reg register to save, KEYBOARD_UNSET to perform the load
+ * @param keys state of the keypad, bit n is set if key n is down (only used
+ * when performing the load)
  * @since 0.1.0
  */
-void load_key(unsigned char reg, unsigned char key);
+void load_key(unsigned char reg, unsigned short keys);
+
+/**
+ * Runs one cycle headless, keyboard instructions read `keys`
+ * @param keys: state of the keypad, bit n is set if key n is down
+ * @return EXIT if the program exited, IDLE otherwise
+ * @since 1.2.0
+ */
+Flag run_cycle(unsigned short keys);
+
+/**
+ * Runs one frame headless: keyboard instructions read `keys` and drawing only
+ * changes the video buffer, then decrements the timers
+ * @param keys: state of the keypad, bit n is set if key n is down
+ * @param num_cycles: number of `next_cycle()` calls
+ * @return EXIT if the program exited, SOUND if the screen should flash, IDLE
+ * otherwise
+ * @since 1.2.0
+ */
+Flag run_frame(unsigned short keys, long num_cycles);
+
+/**
+ * Gets how many cycles the next frame runs, so that frames average out to the
+ * tick speed
+ * @param tick_speed: microseconds an instruction takes
+ * @param cycle_budget: microseconds left over from the frames before (start
+ * at 0)
+ * @return number of `next_cycle()` calls
+ * @since 1.2.0
+ */
+long next_frame_cycles(int tick_speed, long *cycle_budget);
+
+/**
+ * Seeds the random number generator of the machine (RND), the same seed always
+ * gives the same numbers
+ * @param seed: the seed
+ * @since 1.2.0
+ */
+void seed_random(unsigned long long seed);
+
+/**
+ * Hashes bytes (32 bit FNV-1a)
+ * @param data: bytes to hash
+ * @param size: number of bytes
+ * @return the hash
+ * @since 1.2.0
+ */
+unsigned int hash_bytes(const void *data, size_t size);
 
 /**
  * Sets the system to use super chip8 quirks
@@ -126,4 +360,55 @@ void set_superchip8_quirks();
  */
 bool get_hi_res();
 
+/**
+ * Writes a little-endian field and moves past it
+ * @param bytes: where to write, moved `size` bytes forward
+ * @param value: value of the field
+ * @param size: size of the field in bytes
+ * @since 1.2.0
+ */
+void put_le(unsigned char **bytes, unsigned long long value, int size);
+
+/**
+ * Reads a little-endian field and moves past it
+ * @param bytes: where to read, moved `size` bytes forward
+ * @param size: size of the field in bytes
+ * @return value of the field
+ * @since 1.2.0
+ */
+unsigned long long get_le(const unsigned char **bytes, int size);
+
+/**
+ * Copies the state of the machine into one flat block
+ * @param state: where to store STATE_SIZE bytes
+ * @since 1.2.0
+ */
+void export_state(void *state);
+
+/**
+ * Copies a saved state (STATE_SIZE bytes) into the machine. It's trusted to
+ * come from `export_state()`, `load_state()` checks the ones from files.
+ * @param state: the saved state
+ * @return 0 if everything is ok, 1 if a page couldn't be allocated (the
+ * memory is then only partly restored)
+ * @since 1.2.0
+ */
+int restore_state(const void *state);
+
+/**
+ * Saves the whole state of the machine to a file
+ * @param state_path: path of the file
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int save_state(const char *state_path);
+
+/**
+ * Loads the whole state of the machine from a file saved by `save_state()`
+ * @param state_path: path of the file
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int load_state(const char *state_path);
+
 #endif
@@ -0,0 +1,76 @@
+#ifndef COMPOSITOR_H_
+#define COMPOSITOR_H_
+
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/**
+ * Size of a tile on the screen (without the label line)
+ * Every tile shows 64x32 pixels, two pixels per character (▀ and ▄)
+ * @since 1.2.0
+ */
+#define TILE_WIDTH (WIDTH / 2)
+#define TILE_HEIGHT (HEIGTH / 4)
+#define TILE_LABEL_SIZE 32
+
+/**
+ * One of the framebuffers shown by the compositor
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned char video_mem[SIZE_VIDEO_MEM]; /**< Content of the tile */
+    bool hi_res;                  /**< Was the high resolution mode on */
+    char label[TILE_LABEL_SIZE];  /**< Text shown above the tile */
+    bool is_dirty;                /**< Has it changed since it was drawn */
+} Tile;
+
+/**
+ * Tiles many framebuffers into one screen
+ * @since 1.2.0
+ */
+typedef struct {
+    Tile *tiles;
+    int num_tiles;
+    int max_fps;                /**< Most presents per second, 0 for no cap */
+    unsigned long last_present; /**< Time of the last present (microseconds) */
+    int win_h, win_w;           /**< Window size of the last present */
+} Compositor;
+
+/**
+ * Creates a compositor (graphics must already be initialized)
+ * @param num_tiles: number of framebuffers to show
+ * @param max_fps: most presents per second, 0 for no cap
+ * @return the compositor, NULL if out of memory
+ * @since 1.2.0
+ */
+Compositor *create_compositor(int num_tiles, int max_fps);
+
+/**
+ * Frees the compositor
+ * @param compositor: compositor to free
+ * @since 1.2.0
+ */
+void free_compositor(Compositor *compositor);
+
+/**
+ * Updates the content of a tile, marking it dirty if anything changed
+ * @param compositor: compositor
+ * @param tile: index of the tile
+ * @param video_mem: chip8 video buffer
+ * @param hi_res: is the high resolution mode on
+ * @param label: text shown above the tile (may be NULL)
+ * @since 1.2.0
+ */
+void set_tile(Compositor *compositor, int tile, unsigned char *video_mem,
+              bool hi_res, const char *label);
+
+/**
+ * Draws the dirty tiles, unless the present rate would go over max_fps
+ * @param compositor: compositor
+ * @return true if the screen was updated, false otherwise
+ * @since 1.2.0
+ */
+bool present_tiles(Compositor *compositor);
+
+#endif
@@ -26,4 +26,13 @@ typedef struct {
  */
 AsmStatement *disassemble(FILE *program_file, size_t *num_statements, bool has_quirks);
 
+/**
+ * Decodes one opcode to a statement
+ * @param inst: zeroed statement to fill in
+ * @param opcode: the opcode
+ * @param has_quirks: decode it like the super-chip8 does
+ * @since 1.2.0
+ */
+void decode_dasm(AsmStatement *inst, unsigned short opcode, bool has_quirks);
+
 #endif
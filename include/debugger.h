@@ -51,12 +51,20 @@ void print_stack(unsigned char *stack, unsigned char stack_size,
 void print_memory(unsigned char *memory, unsigned short pc);
 
 /**
- * Set the error message to be printed by `print_error()`
- * @param new_err_msg: error message to print out
+ * Set the error message to be printed by `print_error()` (for the calling
+ * thread)
+ * @param new_err_msg: error message to print out, NULL clears it
  * @since 0.1.0
  */
 void set_error(const char *new_err_msg);
 
+/**
+ * Gets the error message set by `set_error()` on the calling thread
+ * @return the error message, NULL if there wasn't an error
+ * @since 1.2.0
+ */
+const char *get_error();
+
 /**
  * Prints the error message set by `set_error()`
  * @since 0.1.0
@@ -0,0 +1,94 @@
+#ifndef ENV_H_
+#define ENV_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/**
+ * Settings of a batch of environments
+ * @since 1.2.0
+ */
+typedef struct {
+    int num_envs;
+    int num_threads;            /**< Threads stepping them, 0 for all cores */
+    int tick_speed;             /**< 0 for DEFAULT_TICK_SPEED */
+    bool has_superchip8_quirks;
+    unsigned long long seed;    /**< Environment i gets seed + i */
+    unsigned short memory_addr; /**< Start of the memory copied every step */
+    unsigned short memory_size; /**< Its size, 0 for none */
+} EnvConfig;
+
+/**
+ * A batch of machines running the same program, stepped together on a pool
+ * of threads. Every machine owns all its pages, so nothing gets allocated or
+ * freed after `init_env()`.
+ * @since 1.2.0
+ */
+typedef struct {
+    EnvConfig config;
+    Chip8 *machines;
+    long *cycle_budgets;
+    /** Framebuffer of every environment, WIDTH * HEIGTH bits, 8 pixels a
+     * byte (points into the machines, so nothing gets copied) */
+    const unsigned char **observations;
+    /** Memory from memory_addr of every environment, memory_size bytes each,
+     * one after the other */
+    unsigned char *memory;
+    Flag *flags;          /**< Last flag of every environment (EXIT = done) */
+    unsigned char *reset_state; /**< Snapshot environments get reset to */
+
+    // Thread pool
+    pthread_t *threads;
+    int num_workers; /**< Threads started besides the one calling step */
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond, done_cond;
+    unsigned long generation; /**< Incremented for every step */
+    int num_busy;
+    bool is_stopping;
+    int next_env; /**< Next environment to take (under lock) */
+    const unsigned short *actions;
+    int num_frames;
+} Env;
+
+/**
+ * Loads the program into every environment and starts the threads
+ * @param env: the environments
+ * @param program_path: path of the program
+ * @param config: settings
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int init_env(Env *env, const char *program_path, const EnvConfig *config);
+
+/**
+ * Runs frames on every environment that isn't done. Returns when all of them
+ * are finished, their observations, memory and flags are then up to date.
+ * @param env: the environments
+ * @param actions: state of the keypad of every environment (bit n is set if
+ * key n is down), held for all the frames
+ * @param num_frames: frames to run
+ * @since 1.2.0
+ */
+void step_env(Env *env, const unsigned short *actions, int num_frames);
+
+/**
+ * Resets an environment to the snapshot taken after loading the program
+ * @param env: the environments
+ * @param index: the environment
+ * @param seed: new seed of its random number generator
+ * @return 0 if everything is ok, 1 if its memory couldn't be restored (it's
+ * left done). The pages are allocated by `init_env()`, so it doesn't happen.
+ * @since 1.2.0
+ */
+int reset_env(Env *env, int index, unsigned long long seed);
+
+/**
+ * Stops the threads and frees the environments
+ * @param env: the environments
+ * @since 1.2.0
+ */
+void free_env(Env *env);
+
+#endif
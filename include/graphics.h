@@ -2,6 +2,7 @@
 #define GRAPHICS_H_
 
 #include <stdbool.h>
+#include <stdio.h>
 
 /**
  * Runs all the ncurses initialization routines
@@ -9,6 +10,15 @@
  */
 void init_graphics();
 
+/**
+ * Runs all the ncurses initialization routines on a given terminal instead of
+ * stdin/stdout
+ * @param out: the terminal's output stream
+ * @param in: the terminal's input stream
+ * @since 1.2.0
+ */
+void init_graphics_term(FILE *out, FILE *in);
+
 /**
  * Draws the changed part of the video buffer
  * @param video_mem: chip8 video buffer
@@ -49,6 +59,31 @@ void handle_xset_message();
  */
 void draw_all(unsigned char *video_mem, bool hi_res);
 
+/**
+ * Draws only the pixels that differ between two video buffers
+ * @param video_mem: chip8 video buffer to draw
+ * @param prev_video_mem: chip8 video buffer that is currently on the screen
+ * @param hi_res: is the high resolution mode on
+ * @since 1.2.0
+ */
+void draw_diff(unsigned char *video_mem, unsigned char *prev_video_mem,
+               bool hi_res);
+
+/**
+ * Draws a line of text right under the border, if the terminal has room
+ * @param text: text to draw, NULL clears the line
+ * @since 1.2.0
+ */
+void draw_status_line(const char *text);
+
+/**
+ * Gets the current size of the terminal
+ * @param h: where to store the number of rows
+ * @param w: where to store the number of columns
+ * @since 1.2.0
+ */
+void get_win_dimens(int *h, int *w);
+
 /**
  * Displays a message if the screen is too small
  * @param video_mem: chip8 video buffer (used for redrawing)
@@ -0,0 +1,72 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdio.h>
+
+/**
+ * Values below 2^HISTOGRAM_SUB_BITS get a bucket each, every power of two
+ * above them is split into 2^(HISTOGRAM_SUB_BITS - 1) buckets, so a value
+ * read back is off by less than 0.4% (like HdrHistogram)
+ * @since 1.2.0
+ */
+#define HISTOGRAM_SUB_BITS 8
+#define HISTOGRAM_SUB_BUCKETS (1 << (HISTOGRAM_SUB_BITS - 1))
+#define NUM_HISTOGRAM_BUCKETS \
+    ((66 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Log-bucketed histogram, recording a value takes a few instructions
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned long counts[NUM_HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long min, max;
+    double sum;
+} Histogram;
+
+/**
+ * Clears the histogram
+ * @param histogram: the histogram
+ * @since 1.2.0
+ */
+void init_histogram(Histogram *histogram);
+
+/**
+ * Records a value
+ * @param histogram: the histogram
+ * @param value: the value
+ * @since 1.2.0
+ */
+void record_value(Histogram *histogram, unsigned long value);
+
+/**
+ * Gets the value a percentage of the recorded values are at or below
+ * @param histogram: the histogram
+ * @param percentile: percentage, from 0 to 100
+ * @return middle of the bucket it falls in (between min and max), 0 if
+ * nothing was recorded
+ * @since 1.2.0
+ */
+unsigned long get_percentile(const Histogram *histogram, double percentile);
+
+/**
+ * Prints the header of the table `print_histogram()` prints rows of
+ * @param file: where to print
+ * @param unit: unit of the values after scaling (e.g. "us")
+ * @since 1.2.0
+ */
+void print_histogram_header(FILE *file, const char *unit);
+
+/**
+ * Prints the count, min, percentiles (50, 90, 99, 99.9), max and mean
+ * @param file: where to print
+ * @param name: name of the row
+ * @param histogram: the histogram
+ * @param scale: the values are divided by it
+ * @since 1.2.0
+ */
+void print_histogram(FILE *file, const char *name, const Histogram *histogram,
+                     double scale);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+/**
+ * Most checkpoints the history keeps. When it's full every other one of the
+ * older half gets dropped, so it reaches further back the longer it runs.
+ * @since 1.2.0
+ */
+#define MAX_CHECKPOINTS 256
+
+/**
+ * How long going back may take (in nanoseconds): checkpoints are spaced so
+ * that re-running from one to the next takes about this long
+ * @since 1.2.0
+ */
+#define MAX_REPLAY_TIME 5000000
+
+/**
+ * Bounds of the spacing of the checkpoints (in cycles)
+ * @since 1.2.0
+ */
+#define MIN_CHECKPOINT_SPACING 3000
+#define MAX_CHECKPOINT_SPACING 3000000
+
+/**
+ * Allocates the checkpoints, the history starts with the first
+ * `update_history()`
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int init_history();
+
+/**
+ * Frees the checkpoints and the events
+ * @since 1.2.0
+ */
+void stop_history();
+
+/**
+ * Forgets the history, when the machine jumps in time some other way
+ * @since 1.2.0
+ */
+void reset_history();
+
+/**
+ * Takes a checkpoint if the last one is far enough back. Called before
+ * every instruction while the breakpoints are checked (the machine's clock
+ * is 2), the first call starts the history.
+ * @since 1.2.0
+ */
+void update_history();
+
+/**
+ * Notes the keys the instructions see from now on
+ * @param keys: the keys
+ * @since 1.2.0
+ */
+void log_keys(unsigned short keys);
+
+/**
+ * Notes that the timers were decremented now
+ * @since 1.2.0
+ */
+void log_timers();
+
+/**
+ * Goes back one instruction, re-running the machine from the checkpoint
+ * before it with the same keys and timers
+ * @return 0 if everything is ok, 1 if the history doesn't go back that far
+ * (or a checkpoint couldn't be restored, then the error is set and the
+ * machine is broken)
+ * @since 1.2.0
+ */
+int reverse_step();
+
+/**
+ * Goes back to the last time a breakpoint or watchpoint stopped the machine,
+ * or to the start of the history if none did
+ * @return 0 if everything is ok, 1 if there isn't any history (or a
+ * checkpoint couldn't be restored, like `reverse_step()`)
+ * @since 1.2.0
+ */
+int reverse_continue();
+
+/**
+ * Gets where the last reverse step or continue stopped
+ * @return the reason, like "reverse step"
+ * @since 1.2.0
+ */
+const char *get_history_reason();
+
+#endif
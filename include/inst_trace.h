@@ -0,0 +1,67 @@
+#ifndef INST_TRACE_H_
+#define INST_TRACE_H_
+
+#include <stdbool.h>
+
+/**
+ * Number of instructions an instruction trace keeps, the older ones get
+ * overwritten
+ * @since 1.2.0
+ */
+#define INST_TRACE_SIZE (1 << 16)
+
+#define INST_TRACE_MAGIC "C8IT"
+#define INST_TRACE_VERSION 1
+
+/**
+ * An instruction that ran
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned int frame;     /**< Timer decrements before it ran */
+    unsigned short pc;      /**< Where it was */
+    unsigned short opcode;  /**< Illegal ones too */
+    unsigned short I;       /**< I after it ran */
+    unsigned char vf;       /**< VF after it ran */
+    unsigned char padding;
+} InstRecord;
+
+/**
+ * Ring of the last instructions a machine ran. Recording one is a few
+ * stores, so it can stay on at full speed.
+ * @since 1.2.0
+ */
+typedef struct {
+    InstRecord records[INST_TRACE_SIZE];
+    unsigned long count; /**< Instructions recorded, the ring keeps the last */
+    unsigned int frame;  /**< Current frame */
+} InstTrace;
+
+/**
+ * Header of the instruction trace file. It's followed by the records, the
+ * oldest first.
+ * @since 1.2.0
+ */
+typedef struct {
+    char magic[4];              /**< "C8IT" */
+    unsigned int version;       /**< INST_TRACE_VERSION */
+    unsigned int header_size;   /**< sizeof(InstTraceHeader) */
+    unsigned int record_size;   /**< sizeof(InstRecord) */
+    unsigned int num_records;   /**< Records in the file */
+    unsigned int superchip8_quirks;
+    unsigned long count;        /**< Instructions recorded in all */
+} InstTraceHeader;
+
+/**
+ * Writes the trace to a file, only with calls that are safe in a signal
+ * handler
+ * @param trace: the trace
+ * @param path: file to write to
+ * @param has_quirks: the machine had super-chip8 quirks (for decoding)
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int write_inst_trace(const InstTrace *trace, const char *path,
+                     bool has_quirks);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef KEYPAD_H_
+#define KEYPAD_H_
+
+#include <stdbool.h>
+
+/**
+ * Keys that aren't on the chip8 keypad, numbered after the 16 keypad keys
+ * @since 1.2.0
+ */
+typedef enum {
+    HOTKEY_QUIT = 16,        /**< Ctrl+C (when the terminal reports it) */
+    HOTKEY_SAVE_STATE,       /**< F5 */
+    HOTKEY_LOAD_STATE,       /**< F9 */
+    HOTKEY_REWIND,           /**< Backspace (held) */
+    HOTKEY_OVERLAY,          /**< F7 */
+    HOTKEY_CONTINUE,         /**< F8 */
+    HOTKEY_STEP,             /**< F10 */
+    HOTKEY_REVERSE_CONTINUE, /**< Shift+F8 */
+    HOTKEY_REVERSE_STEP,     /**< Shift+F10 */
+    NUM_KEYS,
+} Hotkey;
+
+/**
+ * How the terminal reports keys
+ * @since 1.2.0
+ */
+typedef enum {
+    KEYPAD_UNKNOWN, /**< Still waiting for the terminal to answer */
+    KEYPAD_KITTY,   /**< Kitty keyboard protocol, real press/release events */
+    KEYPAD_LEGACY,  /**< Plain characters, releases are guessed from repeats */
+} KeypadMode;
+
+/**
+ * Asks the terminal for the kitty keyboard protocol (release events)
+ * @since 1.2.0
+ */
+void enable_key_events();
+
+/**
+ * Restores the terminal's keyboard mode
+ * @since 1.2.0
+ */
+void disable_key_events();
+
+/**
+ * Parses a byte read from the terminal and queues the resulting key events
+ * (must only be called from one thread)
+ * @param byte: byte returned by `getch()`
+ * @since 1.2.0
+ */
+void feed_keypad(int byte);
+
+/**
+ * Gets how the terminal reports keys
+ * @return the keypad mode
+ * @since 1.2.0
+ */
+KeypadMode get_keypad_mode();
+
+/**
+ * Applies the queued key events, stopping before the second press or release
+ * of a key so that a quick tap shows up in one drain and ends in the next
+ * (must only be called from one thread)
+ * @return state of the chip8 keypad, bit n is set if key n is down
+ * @since 1.2.0
+ */
+unsigned short drain_keypad();
+
+/**
+ * Checks if a hotkey is held down (as of the last `drain_keypad()`)
+ * @param hotkey: hotkey to check
+ * @return true if it is down, false otherwise
+ * @since 1.2.0
+ */
+bool is_hotkey_down(Hotkey hotkey);
+
+/**
+ * Checks if a hotkey was pressed since the last call
+ * @param hotkey: hotkey to check
+ * @return true if it was pressed, false otherwise
+ * @since 1.2.0
+ */
+bool was_hotkey_pressed(Hotkey hotkey);
+
+#endif
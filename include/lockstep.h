@@ -0,0 +1,74 @@
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/**
+ * Many machines running the same program, stepped together. The registers
+ * are stored lane after lane (V[r * num_lanes + lane]) so instructions that
+ * only touch registers run as one vectorized loop over all lanes while the
+ * lanes agree on the opcode. Everything else runs lane by lane through the
+ * handlers, on the machine of the lane.
+ * @since 1.2.0
+ */
+typedef struct {
+    int num_lanes;
+    Chip8 *machines; /**< Memory, stack and the rest of every lane */
+    unsigned char *V;
+    unsigned short *pc, *I, *opcode;
+    unsigned char *dt, *st;
+    unsigned int *random;          /**< random[w * num_lanes + lane] */
+    unsigned long *cycles;
+    unsigned short *private_pages; /**< Bit n set if page n was written */
+    bool *is_running;              /**< false after the lane exited */
+    int num_running;
+    unsigned char clock; /**< Step of the cycle, the same on every lane */
+    bool has_superchip8_quirks;
+    unsigned long vector_steps; /**< Instructions run on all lanes at once */
+    unsigned long lane_steps;   /**< Instructions run lane by lane */
+} Lockstep;
+
+/**
+ * Starts the lanes on a program, like `init_chip8()` and `load_program()`
+ * @param lockstep: the lanes
+ * @param num_lanes: number of lanes
+ * @param program_path: path of the program
+ * @param has_superchip8_quirks: enable super-chip8 quirks on every lane
+ * @param seeds: seed of the random number generator of every lane
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int init_lockstep(Lockstep *lockstep, int num_lanes, const char *program_path,
+                  bool has_superchip8_quirks, const unsigned long long *seeds);
+
+/**
+ * Runs one frame on every lane that didn't exit, like `run_frame()`
+ * @param lockstep: the lanes
+ * @param keys: state of the keypad of every lane
+ * @param num_cycles: number of cycles every lane runs
+ * @param flags: gets the flag `run_frame()` would return for every lane
+ * (EXIT for lanes that exited before)
+ * @since 1.2.0
+ */
+void run_lockstep_frame(Lockstep *lockstep, const unsigned short *keys,
+                        long num_cycles, Flag *flags);
+
+/**
+ * Gets the machine of a lane, up to date with its registers
+ * @param lockstep: the lanes
+ * @param lane: the lane
+ * @return the machine, valid until the next `run_lockstep_frame()`
+ * @since 1.2.0
+ */
+Chip8 *get_lane_machine(Lockstep *lockstep, int lane);
+
+/**
+ * Frees the lanes
+ * @param lockstep: the lanes
+ * @since 1.2.0
+ */
+void free_lockstep(Lockstep *lockstep);
+
+#endif
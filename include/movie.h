@@ -0,0 +1,108 @@
+#ifndef MOVIE_H_
+#define MOVIE_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define MOVIE_VERSION 3
+
+/**
+ * Header of a movie file, everything needed to start the same run again.
+ * It's stored as little-endian fields in this order (the magic as is, `seed`
+ * as 8 bytes, the others as 4), MOVIE_HEADER_SIZE bytes in all.
+ * @since 1.2.0
+ */
+typedef struct {
+    char magic[4];                  /**< "C8MV" */
+    unsigned int version;           /**< MOVIE_VERSION */
+    unsigned long long seed;        /**< Seed of the random number generator */
+    unsigned int tick_speed;        /**< Microseconds per instruction */
+    unsigned int superchip8_quirks; /**< Were super-chip8 quirks enabled */
+    unsigned int state_hash;        /**< Hash of the state it starts from */
+    unsigned int reserved;
+} MovieHeader;
+
+#define MOVIE_HEADER_SIZE 32
+
+/**
+ * A change of the keypad state, the file is a list of them after the header.
+ * Each is stored as two little-endian 4 byte fields, MOVIE_INPUT_SIZE bytes.
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned int frame; /**< Frame the keys changed on */
+    unsigned int keys;  /**< State of the keypad, bit n is set if key n is down
+                           (MOVIE_END marks the last frame) */
+} MovieInput;
+
+#define MOVIE_INPUT_SIZE 8
+
+#define MOVIE_END 0x10000
+
+/**
+ * A movie being recorded or replayed
+ * @since 1.2.0
+ */
+typedef struct {
+    FILE *file;
+    MovieHeader header;
+    bool is_recording;
+    unsigned short keys; /**< Current state of the keypad */
+    MovieInput next;     /**< Next change (when replaying) */
+    unsigned long last_frame; /**< Last recorded frame, or frame of `next` */
+} Movie;
+
+/**
+ * Creates a movie file to record to
+ * @param movie: the movie
+ * @param movie_path: path of the file
+ * @param header: header of the movie (magic and version get filled in)
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int create_movie(Movie *movie, const char *movie_path, MovieHeader *header);
+
+/**
+ * Opens a movie file to replay
+ * @param movie: the movie
+ * @param movie_path: path of the file
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int open_movie(Movie *movie, const char *movie_path);
+
+/**
+ * Records the keypad state of a frame (only changes get written)
+ * @param movie: the movie
+ * @param frame: emulated frame number
+ * @param keys: state of the keypad, bit n is set if key n is down
+ * @since 1.2.0
+ */
+void record_keys(Movie *movie, unsigned long frame, unsigned short keys);
+
+/**
+ * Gets the keypad state of a frame (frames must go in order)
+ * @param movie: the movie
+ * @param frame: emulated frame number
+ * @return state of the keypad, bit n is set if key n is down
+ * @since 1.2.0
+ */
+unsigned short replay_keys(Movie *movie, unsigned long frame);
+
+/**
+ * Checks if the movie ended before a frame
+ * @param movie: the movie
+ * @param frame: emulated frame number
+ * @return true if the frame isn't in the movie, false otherwise
+ * @since 1.2.0
+ */
+bool is_movie_over(Movie *movie, unsigned long frame);
+
+/**
+ * Closes the movie, marking where it ends if it was recorded
+ * @param movie: the movie
+ * @since 1.2.0
+ */
+void close_movie(Movie *movie);
+
+#endif
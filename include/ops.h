@@ -0,0 +1,134 @@
+#ifndef OPS_H_
+#define OPS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Semantics of the instructions that only work on registers, shared by the
+ * handlers in chip8.c and the lockstep engine. Register r of a machine is at
+ * V[r * stride], so the same code runs on one machine (stride 1) and on one
+ * lane of registers stored lane after lane (stride = number of lanes), where
+ * a loop over the lanes gets vectorized.
+ */
+
+#define FIRST(opcode) (opcode & 0x000f)
+#define SECOND(opcode) ((opcode & 0x00f0) >> 4)
+#define THIRD(opcode) ((opcode & 0x0f00) >> 8)
+#define FOURTH(opcode) ((opcode & 0xf000) >> 12)
+#define IMMEDIATE(opcode) (opcode & 0x00ff)
+#define ADDR(opcode) (opcode & 0x0fff)
+
+/**
+ * Executes 8xy0 to 8xy7 and 8xyE (other 8xy_ opcodes do nothing)
+ * @param V: register V0 of the machine
+ * @param stride: distance between two registers
+ * @param opcode: the instruction
+ * @param has_superchip8_quirks: are super-chip8 quirks enabled
+ * @since 1.2.0
+ */
+static inline void alu_op(unsigned char *V, size_t stride,
+                          unsigned short opcode, bool has_superchip8_quirks) {
+    unsigned char *vx = &V[THIRD(opcode) * stride];
+    unsigned char *vy = &V[SECOND(opcode) * stride];
+    unsigned char *vf = &V[0xf * stride];
+    int result;
+    unsigned char flag;
+    switch (FIRST(opcode)) {
+        case 0:
+            *vx = *vy;
+            break;
+        case 1:
+            *vx |= *vy;
+            if (!has_superchip8_quirks) *vf = 0;
+            break;
+        case 2:
+            *vx &= *vy;
+            if (!has_superchip8_quirks) *vf = 0;
+            break;
+        case 3:
+            *vx ^= *vy;
+            if (!has_superchip8_quirks) *vf = 0;
+            break;
+        case 4:
+            result = *vx + *vy;
+            *vx = result;
+            *vf = result > 0xff;
+            break;
+        case 5:
+            result = *vx - *vy;
+            *vx = result;
+            *vf = result >= 0;
+            break;
+        case 6:
+            flag = *vy & 0x01;
+            if (has_superchip8_quirks)
+                *vy >>= 1;
+            else
+                *vx = *vy >> 1;
+            *vf = flag;
+            break;
+        case 7:
+            result = *vx - *vy;
+            *vx = -result;
+            *vf = result <= 0;
+            break;
+        case 0xe:
+            flag = (*vy & 0x80) >> 7;
+            if (has_superchip8_quirks)
+                *vy <<= 1;
+            else
+                *vx = *vy << 1;
+            *vf = flag;
+            break;
+    }
+}
+
+/**
+ * Checks the condition of 3xkk, 4xkk, 5xy0 and 9xy0
+ * @param V: register V0 of the machine
+ * @param stride: distance between two registers
+ * @param opcode: the instruction
+ * @return how much the program counter moves (2 to skip, 0 otherwise)
+ * @since 1.2.0
+ */
+static inline unsigned short skip_offset(const unsigned char *V,
+                                         size_t stride,
+                                         unsigned short opcode) {
+    unsigned char vx = V[THIRD(opcode) * stride];
+    unsigned char vy = V[SECOND(opcode) * stride];
+    switch (FOURTH(opcode)) {
+        case 3:
+            return (vx == IMMEDIATE(opcode)) ? 2 : 0;
+        case 4:
+            return (vx != IMMEDIATE(opcode)) ? 2 : 0;
+        case 5:
+            return (vx == vy) ? 2 : 0;
+        default:
+            return (vx != vy) ? 2 : 0;
+    }
+}
+
+/**
+ * Steps the xoshiro128** generator behind RND
+ * @param s: first word of the generator state
+ * @param stride: distance between two words of the state
+ * @return the next random number
+ * @since 1.2.0
+ */
+static inline unsigned int next_xoshiro(unsigned int *s, size_t stride) {
+    unsigned int *s0 = &s[0], *s1 = &s[stride];
+    unsigned int *s2 = &s[2 * stride], *s3 = &s[3 * stride];
+    unsigned int x = *s1 * 5;
+    unsigned int result = ((x << 7) | (x >> 25)) * 9;
+    unsigned int t = *s1 << 9;
+    *s2 ^= *s0;
+    *s3 ^= *s1;
+    *s1 ^= *s2;
+    *s0 ^= *s3;
+    *s2 ^= t;
+    *s3 = (*s3 << 11) | (*s3 >> 21);
+    return result;
+}
+
+#endif
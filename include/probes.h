@@ -0,0 +1,45 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/* Static tracepoints (USDT) of the "chip8" provider, for watching a running
+ * emulator with bpftrace or perf, e.g.
+ *     bpftrace -e 'usdt:./chip8_emu:chip8:draw { @n[arg2] = count(); }'
+ *
+ * execute(pc, opcode)           before an instruction gets executed
+ * draw(x, y, n, collision)      after DRW, x and y wrapped to the screen
+ * clear()                       after CLS
+ * scroll(opcode)                after SCD, SCR or SCL
+ * timers(dt, st)                after the timers got decremented
+ * key_read(keys)                after the host read the keypad
+ * frame_present(frames, bytes)  after a frame got presented, with the
+ *                               number of frames and of bytes written to the
+ *                               terminal so far
+ * exit(pc)                      after EXIT
+ * error(message)                when the machine crashes
+ *
+ * Without sys/sdt.h they compile to nothing. With it, every probe is a nop
+ * until a tracer attaches to it, and its arguments are only computed into
+ * registers.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define CHIP8_PROBE(name) DTRACE_PROBE(chip8, name)
+#define CHIP8_PROBE1(name, a) DTRACE_PROBE1(chip8, name, a)
+#define CHIP8_PROBE2(name, a, b) DTRACE_PROBE2(chip8, name, a, b)
+#define CHIP8_PROBE4(name, a, b, c, d) DTRACE_PROBE4(chip8, name, a, b, c, d)
+#else
+#define CHIP8_PROBE(name) \
+    do {                  \
+    } while (0)
+#define CHIP8_PROBE1(name, a) CHIP8_PROBE(name)
+#define CHIP8_PROBE2(name, a, b) CHIP8_PROBE(name)
+#define CHIP8_PROBE4(name, a, b, c, d) CHIP8_PROBE(name)
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/**
+ * Counts of everything a machine ran while it was profiled. Only
+ * `run_profiled_frame()` fills it in, so machines that aren't profiled run
+ * exactly as fast as before.
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned long instructions;
+    unsigned long pc_counts[SIZE_MEMORY];    /**< Instructions run at pc */
+    unsigned short pc_opcodes[SIZE_MEMORY];  /**< Last opcode run at pc */
+    unsigned long opcode_counts[0x10000];
+    unsigned long loop_counts[SIZE_MEMORY];  /**< Jumps back from pc */
+    unsigned short loop_targets[SIZE_MEMORY]; /**< Where they jumped to */
+    unsigned long draws;
+    unsigned long rows_drawn;
+    unsigned long collisions;
+    unsigned long scrolls;
+    unsigned long key_waits; /**< LD Vx, K run again, still waiting */
+} Profile;
+
+/**
+ * Clears the counts
+ * @param profile: the profile
+ * @since 1.2.0
+ */
+void init_profile(Profile *profile);
+
+/**
+ * Runs a frame like `run_frame()`, counting every instruction
+ * @param profile: the profile
+ * @param keys: state of the keypad
+ * @param num_cycles: number of cycles to run
+ * @return flag of the frame, like `run_frame()`
+ * @since 1.2.0
+ */
+Flag run_profiled_frame(Profile *profile, unsigned short keys,
+                        long num_cycles);
+
+/**
+ * Writes the report: the counters, a flat profile by kind of instruction,
+ * the hottest pcs with their disassembly and the hottest loops
+ * @param profile: the profile
+ * @param path: file to write to
+ * @param has_quirks: disassemble like the super-chip8
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int write_profile(const Profile *profile, const char *path, bool has_quirks);
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef RENDERER_H_
+#define RENDERER_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+/**
+ * A complete snapshot of the display, published once per emulated frame
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned char video_mem[SIZE_VIDEO_MEM]; /**< Copy of the video buffer */
+    bool hi_res;          /**< Was the high resolution mode on */
+    bool is_flashing;     /**< Should the outer part of the display be on */
+    unsigned long number; /**< Emulated frame number */
+} Frame;
+
+/**
+ * Lock-free single producer, single consumer triple buffer of frames.
+ * The producer always owns `back`, the consumer always owns `front` and the
+ * two of them swap through `middle` (index and FRESH bit in one atomic)
+ * @since 1.2.0
+ */
+typedef struct {
+    Frame frames[3];
+    atomic_uint middle;
+    unsigned int back;
+    unsigned int front;
+} TripleBuffer;
+
+/**
+ * Frame counters of the renderer
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned long produced;  /**< Frames published by the emulation */
+    unsigned long presented; /**< Frames drawn to the terminal */
+    unsigned long dropped;   /**< Frames overwritten before being drawn */
+    unsigned long render_time; /**< Microseconds spent drawing */
+} RenderStats;
+
+/**
+ * Initializes the triple buffer
+ * @param tb: triple buffer to initialize
+ * @since 1.2.0
+ */
+void tb_init(TripleBuffer *tb);
+
+/**
+ * Gets the frame the producer should write to
+ * @param tb: triple buffer
+ * @return pointer to the back frame
+ * @since 1.2.0
+ */
+Frame *tb_back(TripleBuffer *tb);
+
+/**
+ * Makes the back frame available to the consumer
+ * @param tb: triple buffer
+ * @return true if an unconsumed frame was overwritten (dropped)
+ * @since 1.2.0
+ */
+bool tb_publish(TripleBuffer *tb);
+
+/**
+ * Takes the newest published frame
+ * @param tb: triple buffer
+ * @return pointer to the frame, NULL if nothing new was published
+ * @since 1.2.0
+ */
+Frame *tb_acquire(TripleBuffer *tb);
+
+/**
+ * Draws the frame, only touching the pixels that changed since the last one
+ * @param frame: frame to draw
+ * @param shown: the frame currently on the screen, gets overwritten by `frame`
+ * @param has_shown: is there anything on the screen, gets set to true
+ * @since 1.2.0
+ */
+void present_frame(Frame *frame, Frame *shown, bool *has_shown);
+
+/**
+ * Appends the frame to a frame recording
+ * @param file: recording file
+ * @param frame: frame to append
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int write_frame(FILE *file, Frame *frame);
+
+/**
+ * Reads the next frame from a frame recording
+ * @param file: recording file
+ * @param frame: where to store the frame
+ * @return 0 if everything is ok, 1 otherwise (or at the end of the recording)
+ * @since 1.2.0
+ */
+int read_frame(FILE *file, Frame *frame);
+
+/**
+ * Initializes graphics and starts the renderer
+ * @param is_threaded: if true, the terminal is driven by a dedicated render
+ * thread, otherwise everything is drawn inline by the caller
+ * @since 1.2.0
+ */
+void init_renderer(bool is_threaded);
+
+/**
+ * Stops the render thread (if any) and ends the ncurses session
+ * @since 1.2.0
+ */
+void stop_renderer();
+
+/**
+ * Return whether the renderer runs on its own thread
+ * @return true if the render thread is used, false otherwise
+ * @since 1.2.0
+ */
+bool is_renderer_threaded();
+
+/**
+ * Publishes a snapshot of the display. Never blocks on terminal IO when the
+ * render thread is used.
+ * @param video_mem: chip8 video buffer
+ * @param hi_res: is the high resolution mode on
+ * @param is_flashing: should the outer part of the display be on
+ * @since 1.2.0
+ */
+void publish_frame(unsigned char *video_mem, bool hi_res, bool is_flashing);
+
+/**
+ * Reads the keys typed in the terminal and queues them for `drain_keypad()`.
+ * Does nothing when the render thread is used (it reads them by itself).
+ * @since 1.2.0
+ */
+void poll_inline_keys();
+
+/**
+ * Counts time the caller spent drawing inline (without the render thread)
+ * @param time: microseconds spent drawing
+ * @since 1.2.0
+ */
+void add_render_time(unsigned long time);
+
+/**
+ * Shows a status line under the border, drawn by the render thread if there
+ * is one
+ * @param text: the status line, NULL hides it
+ * @since 1.2.0
+ */
+void show_status_line(const char *text);
+
+/**
+ * Gets the frame counters
+ * @param stats: where to store the counters
+ * @since 1.2.0
+ */
+void get_render_stats(RenderStats *stats);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef REWIND_H_
+#define REWIND_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Default size of the rewind buffer (in megabytes)
+ * @since 1.2.0
+ */
+#define DEFAULT_REWIND_SIZE 16
+
+/**
+ * Every KEYFRAME_INTERVAL snapshots one is stored whole, the others only
+ * store what changed since the snapshot before them
+ * @since 1.2.0
+ */
+#define KEYFRAME_INTERVAL 60
+
+/**
+ * Counters of the rewind buffer
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned long snapshots; /**< Snapshots currently in the buffer */
+    unsigned long keyframes; /**< How many of them are keyframes */
+    size_t bytes;            /**< Bytes used by their encoded data */
+    size_t size;             /**< Size of the buffer */
+} RewindStats;
+
+/**
+ * Allocates the rewind buffer, the oldest snapshots get dropped to stay in it
+ * @param size: size of the buffer (in bytes)
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int init_rewind(size_t size);
+
+/**
+ * Frees the rewind buffer
+ * @since 1.2.0
+ */
+void stop_rewind();
+
+/**
+ * Checks if the rewind buffer is allocated
+ * @return true if it is, false otherwise
+ * @since 1.2.0
+ */
+bool is_rewind_enabled();
+
+/**
+ * Adds a snapshot of the machine state (once per frame)
+ * @param state: STATE_SIZE bytes of the machine state
+ * @since 1.2.0
+ */
+void push_snapshot(const void *state);
+
+/**
+ * Removes the newest snapshot
+ * @return the state of the snapshot before it (valid until the next push or
+ * pop), NULL if there isn't one
+ * @since 1.2.0
+ */
+const void *pop_snapshot();
+
+/**
+ * Gets the counters of the rewind buffer
+ * @param stats: where to store the counters
+ * @since 1.2.0
+ */
+void get_rewind_stats(RewindStats *stats);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef SHARED_FRAME_H_
+#define SHARED_FRAME_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+#define SHARED_FRAME_VERSION 1
+
+/**
+ * Frames kept in the segment. The emulator writes them round robin, so a
+ * reader can take its time with a frame until this many newer ones came.
+ * @since 1.2.0
+ */
+#define NUM_SHARED_FRAMES 4
+
+/**
+ * A frame published by the emulator
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned long frame;  /**< Frames shown since the emulator started */
+    unsigned long cycles; /**< Cycles run by the machine */
+    unsigned char video_mem[SIZE_VIDEO_MEM];
+    bool hi_res;
+    bool is_flashing;
+    unsigned char V[16];
+    unsigned short pc, I;
+    unsigned char sp, dt, st;
+} SharedFrame;
+
+/**
+ * A slot of the ring, guarded by a sequence lock: the sequence is odd while
+ * the emulator writes the frame
+ * @since 1.2.0
+ */
+typedef struct {
+    atomic_ulong sequence;
+    SharedFrame frame;
+} SharedSlot;
+
+/**
+ * Layout of the shared memory segment
+ * @since 1.2.0
+ */
+typedef struct {
+    char magic[4];            /**< "C8FB" */
+    unsigned int version;     /**< SHARED_FRAME_VERSION */
+    unsigned int header_size; /**< offsetof(SharedFrames, slots) */
+    unsigned int slot_size;   /**< sizeof(SharedSlot) */
+    atomic_ulong latest;      /**< Number of frames published */
+    atomic_uint is_running;   /**< 0 once the emulator removed the segment */
+    SharedSlot slots[NUM_SHARED_FRAMES];
+} SharedFrames;
+
+/**
+ * Creates the segment (shm_open name, e.g. "/chip8") for the emulator. A
+ * segment that already exists is left alone, errno is EEXIST then.
+ * @param name: name of the segment
+ * @return the mapped segment, NULL if it couldn't be created
+ * @since 1.2.0
+ */
+SharedFrames *create_shared_frames(const char *name);
+
+/**
+ * Publishes the machine the other functions work on as the next frame, never
+ * waits for readers
+ * @param shared: the segment
+ * @param is_flashing: should the screen flash
+ * @since 1.2.0
+ */
+void publish_shared_frame(SharedFrames *shared, bool is_flashing);
+
+/**
+ * Unmaps and removes the segment, readers keep their mappings
+ * @param shared: the segment
+ * @param name: name of the segment
+ * @since 1.2.0
+ */
+void remove_shared_frames(SharedFrames *shared, const char *name);
+
+/**
+ * Maps the segment of a running emulator, read only
+ * @param name: name of the segment
+ * @return the mapped segment, NULL if it doesn't exist or doesn't match
+ * @since 1.2.0
+ */
+const SharedFrames *open_shared_frames(const char *name);
+
+/**
+ * Gets the newest frame, without copying it. It stays valid while
+ * `end_shared_read()` returns true.
+ * @param shared: the segment
+ * @param sequence: gets what `end_shared_read()` needs
+ * @return the frame, NULL if nothing was published yet
+ * @since 1.2.0
+ */
+const SharedFrame *begin_shared_read(const SharedFrames *shared,
+                                     unsigned long *sequence);
+
+/**
+ * Checks that a frame wasn't overwritten while it was read
+ * @param shared: the segment
+ * @param frame: frame from `begin_shared_read()`
+ * @param sequence: sequence from `begin_shared_read()`
+ * @return true if everything read from the frame is consistent
+ * @since 1.2.0
+ */
+bool end_shared_read(const SharedFrames *shared, const SharedFrame *frame,
+                     unsigned long sequence);
+
+/**
+ * Unmaps a segment opened by `open_shared_frames()`
+ * @param shared: the segment
+ * @since 1.2.0
+ */
+void close_shared_frames(const SharedFrames *shared);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/**
+ * Events every thread can hold before the writer thread writes them, the
+ * ones that don't fit get dropped
+ * @since 1.2.0
+ */
+#define TRACE_RING_SIZE (1 << 16)
+
+/**
+ * Threads that can record events
+ * @since 1.2.0
+ */
+#define MAX_TRACE_THREADS 4
+
+/**
+ * Starts writing a timeline in the Chrome trace-event format (for Perfetto
+ * or chrome://tracing) and registers the calling thread as "main". A thread
+ * of its own writes the events, the traced threads only fill their rings.
+ * @param path: file to write to
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int start_trace(const char *path);
+
+/**
+ * Registers the calling thread, so its events get recorded too. Its ring of
+ * events gets allocated here, not while recording.
+ * @param name: name of the thread in the timeline
+ * @since 1.2.0
+ */
+void register_trace_thread(const char *name);
+
+/**
+ * Gets the start of a span
+ * @return current time in nanoseconds, 0 if nothing is traced
+ * @since 1.2.0
+ */
+unsigned long begin_span();
+
+/**
+ * Records a span from `begin_span()` until now
+ * @param name: name of the span, must outlive the trace
+ * @param start: what `begin_span()` returned
+ * @since 1.2.0
+ */
+void end_span(const char *name, unsigned long start);
+
+/**
+ * Records an instant event
+ * @param name: name of the event, must outlive the trace
+ * @since 1.2.0
+ */
+void trace_instant(const char *name);
+
+/**
+ * Writes the rest of the events and closes the file. The other threads
+ * must have stopped recording.
+ * @return 0 if everything is ok, 1 otherwise
+ * @since 1.2.0
+ */
+int stop_trace();
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef WRITE_COUNTER_H_
+#define WRITE_COUNTER_H_
+
+/**
+ * Counters of the output sent to the terminal
+ * @since 1.2.0
+ */
+typedef struct {
+    unsigned long bytes; /**< Number of bytes written */
+    unsigned long calls; /**< Number of `write()` calls */
+} WriteCounts;
+
+/**
+ * Starts counting every `write()` to the file descriptor (ncurses included)
+ * @param fd: file descriptor of the terminal
+ * @since 1.2.0
+ */
+void count_writes(int fd);
+
+/**
+ * Gets the counters since `count_writes()` was called
+ * @param counts: where to store the counters
+ * @since 1.2.0
+ */
+void get_write_counts(WriteCounts *counts);
+
+#endif
@@ -0,0 +1,413 @@
+#include <config.h>
+#include <dirent.h>
+#include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "compositor.h"
+#include "debugger.h"
+#include "graphics.h"
+
+#define DEFAULT_NUM_FRAMES 600
+#define MAX_THREADS 256
+#define MAX_PATH_SIZE 4096
+// How often -g redraws the tiles
+#define MONITOR_FPS 30
+
+// Files in directories are only run if they end with one of these
+const char *rom_extensions[] = {".ch8", ".c8", ".sc8"};
+
+typedef enum { NOT_RUN, LOAD_FAILED, FINISHED, EXITED, CRASHED } Outcome;
+
+typedef struct {
+    char *path;
+    Outcome outcome;
+    const char *error; /**< Reason of the crash, from `set_error()` */
+    unsigned int hash; /**< Hash of the framebuffer at the end */
+    unsigned long frames;
+    unsigned long instructions;
+    unsigned long illegal_opcodes;
+    double seconds;
+} Result;
+
+/* Roms still to run by a worker, it takes them from the front and the other
+ * workers steal half of what's left from the back when they run out
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned long begin, end;
+} Queue;
+
+/* The screen of the rom a worker runs, copied out after every frame with -g
+ * and shown by the main thread
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned char video_mem[SIZE_VIDEO_MEM];
+    bool hi_res;
+    char label[TILE_LABEL_SIZE];
+} WorkerScreen;
+
+Result *results = NULL;
+unsigned long num_results = 0;
+unsigned long max_results = 0;
+
+Queue queues[MAX_THREADS];
+int num_threads;
+
+int tick_speed = DEFAULT_TICK_SPEED;
+unsigned long num_frames = DEFAULT_NUM_FRAMES;
+unsigned long long seed = 0;
+bool has_quirks = false;
+bool should_show_screens = false;
+
+WorkerScreen screens[MAX_THREADS];
+_Thread_local WorkerScreen *screen = NULL;
+atomic_int num_finished_workers;
+
+unsigned long get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int add_rom(const char *path) {
+    if (num_results == max_results) {
+        unsigned long new_max = (max_results == 0) ? 64 : max_results * 2;
+        Result *new_results = realloc(results, new_max * sizeof(Result));
+        if (new_results == NULL) return 1;
+        results = new_results;
+        max_results = new_max;
+    }
+    Result *result = &results[num_results];
+    memset(result, 0, sizeof(Result));
+    result->path = strdup(path);
+    if (result->path == NULL) return 1;
+    num_results++;
+    return 0;
+}
+
+bool has_rom_extension(const char *name) {
+    const char *extension = strrchr(name, '.');
+    if (extension == NULL) return false;
+    int num_extensions = sizeof(rom_extensions) / sizeof(rom_extensions[0]);
+    for (int i = 0; i < num_extensions; i++) {
+        if (strcasecmp(extension, rom_extensions[i]) == 0) return true;
+    }
+    return false;
+}
+
+// Adds the roms in a directory and the directories under it
+int add_directory(const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        printf("Error opening %s.\n", path);
+        return 1;
+    }
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char entry_path[MAX_PATH_SIZE];
+        snprintf(entry_path, MAX_PATH_SIZE, "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(entry_path, &st) == -1) continue;
+        if (S_ISDIR(st.st_mode)) {
+            ret = add_directory(entry_path);
+        } else if (S_ISREG(st.st_mode) && has_rom_extension(entry->d_name)) {
+            ret = add_rom(entry_path);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+int compare_results(const void *a, const void *b) {
+    return strcmp(((const Result *)a)->path, ((const Result *)b)->path);
+}
+
+// Takes the next rom of a worker, or steals from the fullest other worker
+bool take_rom(int worker, unsigned long *rom) {
+    Queue *own = &queues[worker];
+    pthread_mutex_lock(&own->lock);
+    bool has_rom = own->begin < own->end;
+    if (has_rom) *rom = own->begin++;
+    pthread_mutex_unlock(&own->lock);
+    if (has_rom) return true;
+
+    while (true) {
+        int victim = -1;
+        unsigned long most = 0;
+        for (int i = 0; i < num_threads; i++) {
+            if (i == worker) continue;
+            pthread_mutex_lock(&queues[i].lock);
+            unsigned long left = queues[i].end - queues[i].begin;
+            pthread_mutex_unlock(&queues[i].lock);
+            if (left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim == -1) return false;
+
+        Queue *other = &queues[victim];
+        pthread_mutex_lock(&other->lock);
+        unsigned long stolen = (other->end - other->begin + 1) / 2;
+        other->end -= stolen;
+        unsigned long begin = other->end;
+        pthread_mutex_unlock(&other->lock);
+        // Someone else got there first, look again
+        if (stolen == 0) continue;
+
+        // Run the first stolen rom now, keep the rest for others to steal
+        pthread_mutex_lock(&own->lock);
+        own->begin = begin + 1;
+        own->end = begin + stolen;
+        pthread_mutex_unlock(&own->lock);
+        *rom = begin;
+        return true;
+    }
+}
+
+// Lets the main thread show the frame the worker just ran
+void publish_screen(const char *label) {
+    pthread_mutex_lock(&screen->lock);
+    memcpy(screen->video_mem, get_video_mem(), SIZE_VIDEO_MEM);
+    screen->hi_res = get_hi_res();
+    if (label != NULL) snprintf(screen->label, TILE_LABEL_SIZE, "%s", label);
+    pthread_mutex_unlock(&screen->lock);
+}
+
+void run_rom(Result *result) {
+    init_chip8();
+    set_error(NULL);
+    if (has_quirks) set_superchip8_quirks();
+    seed_random(seed);
+    if (load_program(result->path) == 1) {
+        result->outcome = LOAD_FAILED;
+        return;
+    }
+
+    Chip8 *machine = get_machine();
+    long cycle_budget = 0;
+    Flag flag = IDLE;
+    if (screen != NULL) {
+        const char *name = strrchr(result->path, '/');
+        publish_screen((name != NULL) ? name + 1 : result->path);
+    }
+    unsigned long start = get_time();
+    while (flag != EXIT && result->frames < num_frames) {
+        flag = run_frame(0, next_frame_cycles(tick_speed, &cycle_budget));
+        result->frames++;
+        if (screen != NULL) publish_screen(NULL);
+    }
+    result->seconds = (get_time() - start) / 1000000.0;
+
+    result->error = get_error();
+    if (result->error != NULL)
+        result->outcome = CRASHED;
+    else
+        result->outcome = (flag == EXIT) ? EXITED : FINISHED;
+    result->hash = hash_bytes(get_video_mem(), SIZE_VIDEO_MEM);
+    result->instructions = machine->cycles / 3;
+    result->illegal_opcodes = machine->illegal_opcodes;
+}
+
+void *run_worker(void *arg) {
+    int worker = (int)(long)arg;
+    // Every worker runs its roms on its own machine
+    Chip8 machine = {0};
+    set_machine(&machine);
+    if (should_show_screens) screen = &screens[worker];
+    unsigned long rom;
+    while (take_rom(worker, &rom)) run_rom(&results[rom]);
+    free_machine(&machine);
+    atomic_fetch_add(&num_finished_workers, 1);
+    return NULL;
+}
+
+// Shows one tile per worker with the rom it runs, until they're all done
+int show_screens() {
+    Compositor *compositor = create_compositor(num_threads, MONITOR_FPS);
+    if (compositor == NULL) return 1;
+    init_graphics();
+    bool is_done;
+    do {
+        // Once more after the last worker is done, to show how they ended
+        is_done = atomic_load(&num_finished_workers) == num_threads;
+        for (int i = 0; i < num_threads; i++) {
+            pthread_mutex_lock(&screens[i].lock);
+            set_tile(compositor, i, screens[i].video_mem, screens[i].hi_res,
+                     screens[i].label);
+            pthread_mutex_unlock(&screens[i].lock);
+        }
+        present_tiles(compositor);
+        if (!is_done) usleep(1000000 / MONITOR_FPS);
+    } while (!is_done);
+    endwin();
+    free_compositor(compositor);
+    return 0;
+}
+
+const char *outcome_name(Outcome outcome) {
+    switch (outcome) {
+        case NOT_RUN:
+            return "not run";
+        case LOAD_FAILED:
+            return "error";
+        case FINISHED:
+            return "ok";
+        case EXITED:
+            return "exit";
+        case CRASHED:
+            return "crash";
+    }
+    return "";
+}
+
+void print_report(double seconds) {
+    unsigned long total_instructions = 0;
+    unsigned long num_crashed = 0, num_failed = 0;
+    printf("%-8s %12s %9s %8s %-7s %s\n", "hash", "instructions", "MIPS",
+           "illegal", "result", "rom");
+    for (unsigned long i = 0; i < num_results; i++) {
+        Result *result = &results[i];
+        double mips = (result->seconds > 0)
+                          ? result->instructions / result->seconds / 1000000
+                          : 0;
+        printf("%08x %12lu %9.2f %8lu %-7s %s\n", result->hash,
+               result->instructions, mips, result->illegal_opcodes,
+               outcome_name(result->outcome), result->path);
+        total_instructions += result->instructions;
+        if (result->outcome == CRASHED) num_crashed++;
+        if (result->outcome == LOAD_FAILED) num_failed++;
+    }
+
+    if (num_crashed > 0) printf("\nCrashes:\n");
+    for (unsigned long i = 0; i < num_results; i++) {
+        if (results[i].outcome != CRASHED) continue;
+        printf("%s: %s\n", results[i].path, results[i].error);
+    }
+
+    if (seconds <= 0) seconds = 1e-6;
+    printf("\n%lu roms (%lu crashed, %lu not loaded) on %d threads, "
+           "%lu frames each\n",
+           num_results, num_crashed, num_failed, num_threads, num_frames);
+    printf("%lu instructions in %.3f s, %.2f MIPS\n", total_instructions,
+           seconds, total_instructions / seconds / 1000000);
+}
+
+void print_help() {
+    printf(
+        "Usage: ./chip8_batch [-h] [-j <threads>] [-q <quirks>] "
+        "[-t <tick_speed>] [-f <frames>] [-S <seed>] [-g] "
+        "<rom or directory>...\n\n");
+    printf("Runs every rom without a terminal on all cores and prints a "
+           "report.\n");
+    printf("Options:\n");
+    printf(" -j <threads>       Number of threads (default: one per core)\n");
+    printf(" -q <quirks>        Quirk profile: chip8 (default) or schip\n");
+    printf(" -t <tick_speed>    Set tick speed (default 900)\n");
+    printf(" -f <frames>        Frames every rom runs (default 600)\n");
+    printf(" -S <seed>          Seed the random number generator "
+           "(default 0)\n");
+    printf(" -g                 Show the screen of every running rom, one "
+           "tile per thread\n");
+    printf(" -h                 Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    char c;
+    while ((c = getopt(argc, argv, "j:q:t:f:S:gh")) != -1) {
+        switch (c) {
+            case 'j':
+                num_threads = atoi(optarg);
+                break;
+            case 'q':
+                if (strcmp(optarg, "schip") == 0) {
+                    has_quirks = true;
+                } else if (strcmp(optarg, "chip8") != 0) {
+                    printf("Unknown quirk profile %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                tick_speed = atoi(optarg);
+                if (tick_speed == 0) tick_speed = DEFAULT_TICK_SPEED;
+                break;
+            case 'f':
+                num_frames = strtoul(optarg, NULL, 10);
+                if (num_frames == 0) num_frames = DEFAULT_NUM_FRAMES;
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'g':
+                should_show_screens = true;
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if (optind == argc) {
+        print_help();
+        return 1;
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+
+    for (int i = optind; i < argc; i++) {
+        struct stat st;
+        int ret = (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+                      ? add_directory(argv[i])
+                      : add_rom(argv[i]);
+        if (ret == 1) return 1;
+    }
+    qsort(results, num_results, sizeof(Result), compare_results);
+    if (num_threads > num_results && num_results > 0) {
+        num_threads = num_results;
+    }
+
+    // Hand out the roms evenly at first, stealing evens out the rest
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        pthread_mutex_init(&screens[i].lock, NULL);
+        queues[i].begin = num_results * i / num_threads;
+        queues[i].end = num_results * (i + 1) / num_threads;
+    }
+    pthread_t threads[MAX_THREADS];
+    unsigned long start = get_time();
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, run_worker, (void *)(long)i) !=
+            0) {
+            printf("Error starting threads.\n");
+            return 1;
+        }
+    }
+    if (should_show_screens && show_screens() == 1) {
+        printf("Error creating the tiles.\n");
+    }
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    double seconds = (get_time() - start) / 1000000.0;
+
+    print_report(seconds);
+    for (unsigned long i = 0; i < num_results; i++) free(results[i].path);
+    free(results);
+    return 0;
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <config.h>
+#include <fcntl.h>
+#include <ncurses.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "compositor.h"
+#include "graphics.h"
+#include "renderer.h"
+#include "write_counter.h"
+
+#define DEFAULT_NUM_FRAMES 600
+#define MAX_RECORDINGS 16
+
+#define TERM_ROWS 50
+#define TERM_COLS 160
+
+#define NUM_TILES 4
+
+#define NUM_BYTES_IN_ROW (SIZE_VIDEO_MEM / HEIGTH)
+
+typedef void (*generator)(Frame *, int);
+typedef void (*render_path)(Frame *, Frame *, bool *);
+
+typedef struct {
+    const char *name;
+    generator generate;
+    Frame *frames; /**< Recorded frames, NULL for generated scenarios */
+    int num_frames;
+} Scenario;
+
+typedef struct {
+    const char *name;
+    render_path render;
+} RenderPath;
+
+// Small deterministic PRNG, so every run draws the same frames
+unsigned int bench_rand(unsigned int *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// XORs a sprite (8 pixels wide) into the video buffer, like DRW does
+void put_sprite(unsigned char *video_mem, int x, int y,
+                const unsigned char *sprite, int rows) {
+    for (int i = 0; i < rows && y + i < HEIGTH; i++) {
+        unsigned char *p = &video_mem[(y + i) * NUM_BYTES_IN_ROW + x / 8];
+        p[0] ^= sprite[i] >> (x % 8);
+        if (x % 8 != 0 && x / 8 + 1 < NUM_BYTES_IN_ROW) {
+            p[1] ^= sprite[i] << (8 - x % 8);
+        }
+    }
+}
+
+const unsigned char block[16] = {0xff, 0x81, 0xbd, 0xa5, 0xa5, 0xbd,
+                                 0x81, 0xff, 0xff, 0x81, 0xbd, 0xa5,
+                                 0xa5, 0xbd, 0x81, 0xff};
+
+// A few sprites moving around, like most games
+void gen_sprites(Frame *frame, int i) {
+    frame->hi_res = false;
+    memset(frame->video_mem, 0, SIZE_VIDEO_MEM);
+    for (int j = 0; j < 6; j++) {
+        int x = (i + j * 11) % (WIDTH / 2 - 8);
+        int y = (i / 2 + j * 5) % (HEIGTH / 2 - 8);
+        put_sprite(frame->video_mem, x, y, block, 8);
+    }
+}
+
+// The whole screen scrolling down (SCD) every frame
+void gen_scroll(Frame *frame, int i) {
+    static unsigned int state;
+    frame->hi_res = true;
+    if (i == 0) {
+        state = 0x12345678;
+        for (int j = 0; j < SIZE_VIDEO_MEM; j++) {
+            frame->video_mem[j] = bench_rand(&state);
+        }
+        return;
+    }
+    memmove(frame->video_mem + NUM_BYTES_IN_ROW, frame->video_mem,
+            SIZE_VIDEO_MEM - NUM_BYTES_IN_ROW);
+    for (int j = 0; j < NUM_BYTES_IN_ROW; j++) {
+        frame->video_mem[j] = bench_rand(&state);
+    }
+}
+
+// Clearing the screen and redrawing everything, every other frame is empty
+void gen_cls(Frame *frame, int i) {
+    frame->hi_res = false;
+    memset(frame->video_mem, 0, SIZE_VIDEO_MEM);
+    if (i % 2 == 0) return;
+    for (int j = 0; j < 24; j++) {
+        put_sprite(frame->video_mem, (j % 8) * 8, (j / 8) * 10 + i % 2, block,
+                   8);
+    }
+}
+
+// Big (16x16) sprites in the high resolution mode
+void gen_hires(Frame *frame, int i) {
+    frame->hi_res = true;
+    memset(frame->video_mem, 0, SIZE_VIDEO_MEM);
+    for (int j = 0; j < 8; j++) {
+        int x = (i * 2 + j * 15) % (WIDTH - 16);
+        int y = (i + j * 7) % (HEIGTH - 16);
+        put_sprite(frame->video_mem, x, y, block, 16);
+        put_sprite(frame->video_mem, x + 8, y, block, 16);
+    }
+}
+
+void render_full(Frame *frame, Frame *shown, bool *has_shown) {
+    draw_all(frame->video_mem, frame->hi_res);
+    st_flash(frame->is_flashing);
+    refresh();
+    *has_shown = true;
+}
+
+Compositor *compositor = NULL;
+
+// The same frame in every tile of the compositor
+void render_tiled(Frame *frame, Frame *shown, bool *has_shown) {
+    if (!*has_shown) {
+        // Start from an empty screen, like the other paths
+        if (compositor != NULL) free_compositor(compositor);
+        compositor = create_compositor(NUM_TILES, 0);
+        *has_shown = true;
+    }
+    for (int i = 0; i < NUM_TILES; i++) {
+        set_tile(compositor, i, frame->video_mem, frame->hi_res, "tile");
+    }
+    present_tiles(compositor);
+}
+
+Scenario scenarios[4 + MAX_RECORDINGS] = {
+    {"sprites", gen_sprites, NULL, 0},
+    {"scroll", gen_scroll, NULL, 0},
+    {"cls", gen_cls, NULL, 0},
+    {"hires", gen_hires, NULL, 0},
+};
+int num_scenarios = 4;
+
+const RenderPath render_paths[] = {
+    {"diff", present_frame},
+    {"full", render_full},
+    {"tiled", render_tiled},
+};
+
+int master_fd;
+
+// Keeps reading the terminal's output, so ncurses never blocks on it
+void *drain_terminal(void *arg) {
+    char buf[4096];
+    while (read(master_fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+int open_terminal(FILE **out, FILE **in) {
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd == -1 || grantpt(master_fd) != 0 ||
+        unlockpt(master_fd) != 0) {
+        printf("Couldn't open a pseudo-terminal.\n");
+        return 1;
+    }
+    struct winsize ws = {.ws_row = TERM_ROWS, .ws_col = TERM_COLS};
+    ioctl(master_fd, TIOCSWINSZ, &ws);
+
+    int slave_fd = open(ptsname(master_fd), O_RDWR | O_NOCTTY);
+    if (slave_fd == -1) {
+        printf("Couldn't open %s.\n", ptsname(master_fd));
+        return 1;
+    }
+    *out = fdopen(slave_fd, "w");
+    *in = fdopen(dup(slave_fd), "r");
+    return 0;
+}
+
+int load_recording(const char *path) {
+    if (num_scenarios == sizeof(scenarios) / sizeof(Scenario)) {
+        printf("Too many recordings.\n");
+        return 1;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Error loading %s.\n", path);
+        return 1;
+    }
+    Scenario *scenario = &scenarios[num_scenarios];
+    int capacity = 0;
+    Frame frame;
+    while (read_frame(file, &frame) == 0) {
+        if (scenario->num_frames == capacity) {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            scenario->frames =
+                realloc(scenario->frames, capacity * sizeof(Frame));
+        }
+        scenario->frames[scenario->num_frames++] = frame;
+    }
+    fclose(file);
+    if (scenario->num_frames == 0) {
+        printf("%s has no frames.\n", path);
+        return 1;
+    }
+    scenario->name = path;
+    scenario->generate = NULL;
+    num_scenarios++;
+    return 0;
+}
+
+unsigned long get_nsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void bench(Scenario *scenario, const RenderPath *path, int num_frames) {
+    static Frame frame, shown;
+    bool has_shown = false;
+    memset(&frame, 0, sizeof(Frame));
+    clear_screen();
+
+    if (scenario->frames != NULL) num_frames = scenario->num_frames;
+    WriteCounts before, after;
+    unsigned long total_ns = 0;
+    get_write_counts(&before);
+    for (int i = 0; i < num_frames; i++) {
+        if (scenario->frames != NULL)
+            frame = scenario->frames[i];
+        else
+            scenario->generate(&frame, i);
+        unsigned long start = get_nsecs();
+        path->render(&frame, &shown, &has_shown);
+        total_ns += get_nsecs() - start;
+    }
+    get_write_counts(&after);
+
+    printf("%s,%s,%d,%.2f,%.1f,%.2f\n", scenario->name, path->name,
+           num_frames, total_ns / 1000.0 / num_frames,
+           (double)(after.bytes - before.bytes) / num_frames,
+           (double)(after.calls - before.calls) / num_frames);
+}
+
+void print_help() {
+    printf("Usage: ./chip8_bench [-h] [-f <num_frames>] [-r <record_file>]\n");
+    printf("Options:\n");
+    printf(" -f <num_frames>   Frames per generated scenario (default 600)\n");
+    printf(" -r <record_file>  Also replay a recording made by chip8_emu -R\n");
+    printf(" -h                Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    int num_frames = DEFAULT_NUM_FRAMES;
+
+    char c;
+    while ((c = getopt(argc, argv, "f:r:h")) != -1) {
+        switch (c) {
+            case 'f':
+                num_frames = atoi(optarg);
+                if (num_frames <= 0) num_frames = DEFAULT_NUM_FRAMES;
+                break;
+            case 'r':
+                if (load_recording(optarg) == 1) return 1;
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+
+    FILE *out, *in;
+    if (open_terminal(&out, &in) == 1) return 1;
+    pthread_t drain_thread;
+    pthread_create(&drain_thread, NULL, drain_terminal, NULL);
+
+    setenv("TERM", "xterm-256color", 0);
+    init_graphics_term(out, in);
+    count_writes(fileno(out));
+
+    // Results go to stdout as CSV
+    printf("scenario,path,frames,us_per_frame,bytes_per_frame,"
+           "writes_per_frame\n");
+    for (int i = 0; i < num_scenarios; i++) {
+        for (int j = 0; j < sizeof(render_paths) / sizeof(RenderPath); j++) {
+            bench(&scenarios[i], &render_paths[j], num_frames);
+        }
+    }
+
+    endwin();
+    return 0;
+}
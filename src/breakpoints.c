@@ -0,0 +1,249 @@
+#include "breakpoints.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define MAX_SPEC_SIZE 32
+
+#define REG_I 16
+#define REG_PC 17
+
+typedef enum {
+    EQUAL,
+    NOT_EQUAL,
+    LESS,
+    LESS_EQUAL,
+    GREATER,
+    GREATER_EQUAL
+} Comparison;
+
+typedef struct {
+    int reg; /**< 0-15 for V0-VF, REG_I or REG_PC */
+    Comparison comparison;
+    unsigned long value;
+} Condition;
+
+typedef struct {
+    Condition conditions[MAX_CONDITIONS];
+    int num_conditions;
+    char spec[MAX_SPEC_SIZE];
+} Breakpoint;
+
+typedef struct {
+    unsigned short start, end;
+} Watchpoint;
+
+Breakpoint breakpoints[MAX_BREAKPOINTS];
+int num_breakpoints = 0;
+Watchpoint watchpoints[MAX_WATCHPOINTS];
+int num_watchpoints = 0;
+bool should_break_on_errors = false;
+bool is_skipping_once = false;
+// Checks of the machine the user is running
+BreakCheck live_check = {.previous_pc = SIZE_MEMORY};
+// Gets the watched writes of the instruction a check let run, NULL between
+// instructions
+BreakCheck *watching_check = NULL;
+
+// Operators with two characters first, so "<=" isn't taken for "<"
+const char *operators[] = {"==", "!=", "<=", ">=", "<", ">"};
+const Comparison comparisons[] = {EQUAL,      NOT_EQUAL, LESS_EQUAL,
+                                  GREATER_EQUAL, LESS,   GREATER};
+
+int parse_condition(Condition *condition, const char *text) {
+    char *end;
+    if (strchr(text, '=') == NULL && strchr(text, '<') == NULL &&
+        strchr(text, '>') == NULL) {
+        // A bare number is the pc
+        condition->reg = REG_PC;
+        condition->comparison = EQUAL;
+        condition->value = strtoul(text, &end, 16);
+        return (end == text || *end != '\0') ? 1 : 0;
+    }
+    if (strncmp(text, "pc", 2) == 0) {
+        condition->reg = REG_PC;
+        end = (char *)text + 2;
+    } else if (text[0] == 'I') {
+        condition->reg = REG_I;
+        end = (char *)text + 1;
+    } else if (text[0] == 'V' && text[1] != '\0') {
+        condition->reg = strtol((char[]){text[1], '\0'}, &end, 16);
+        if (*end != '\0') return 1;
+        end = (char *)text + 2;
+    } else {
+        return 1;
+    }
+    int i = 0;
+    while (i < 6 && strncmp(end, operators[i], strlen(operators[i])) != 0) {
+        i++;
+    }
+    if (i == 6) return 1;
+    condition->comparison = comparisons[i];
+    const char *number = end + strlen(operators[i]);
+    // Addresses are hex like the disassembler shows them
+    condition->value =
+        strtoul(number, &end, (condition->reg == REG_PC) ? 16 : 0);
+    return (end == number || *end != '\0') ? 1 : 0;
+}
+
+int add_breakpoint(const char *spec) {
+    if (num_breakpoints == MAX_BREAKPOINTS) return 1;
+    Breakpoint *breakpoint = &breakpoints[num_breakpoints];
+    char text[MAX_SPEC_SIZE];
+    snprintf(text, sizeof(text), "%s", spec);
+    snprintf(breakpoint->spec, sizeof(breakpoint->spec), "%s", spec);
+    breakpoint->num_conditions = 0;
+    for (char *part = strtok(text, ","); part != NULL;
+         part = strtok(NULL, ",")) {
+        if (breakpoint->num_conditions == MAX_CONDITIONS) return 1;
+        Condition *condition =
+            &breakpoint->conditions[breakpoint->num_conditions++];
+        if (parse_condition(condition, part) == 1) return 1;
+    }
+    if (breakpoint->num_conditions == 0) return 1;
+    num_breakpoints++;
+    return 0;
+}
+
+bool is_watched(unsigned short addr) {
+    for (int i = 0; i < num_watchpoints; i++) {
+        if (addr >= watchpoints[i].start && addr <= watchpoints[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called by `write_mem()` before every store, notes the watched bytes the
+// checked instruction writes
+void watch_byte(unsigned short addr) {
+    BreakCheck *check = watching_check;
+    if (check == NULL || !is_watched(addr) ||
+        check->num_watched == MAX_WATCHED_BYTES) {
+        return;
+    }
+    check->watched_addrs[check->num_watched] = addr;
+    check->watched_bytes[check->num_watched++] = read_mem(addr);
+}
+
+int add_watchpoint(const char *spec) {
+    if (num_watchpoints == MAX_WATCHPOINTS) return 1;
+    char *end;
+    unsigned long start = strtoul(spec, &end, 16);
+    if (end == spec) return 1;
+    unsigned long last = start;
+    if (*end == '-') {
+        const char *number = end + 1;
+        last = strtoul(number, &end, 16);
+        if (end == number) return 1;
+    }
+    if (*end != '\0' || last < start || last >= SIZE_MEMORY) return 1;
+    watchpoints[num_watchpoints++] = (Watchpoint){start, last};
+    set_write_hook(watch_byte);
+    return 0;
+}
+
+void set_break_on_errors() { should_break_on_errors = true; }
+
+bool has_breakpoints() {
+    return num_breakpoints > 0 || num_watchpoints > 0 ||
+           should_break_on_errors;
+}
+
+unsigned long get_reg(const Chip8 *machine, int reg) {
+    if (reg == REG_PC) return machine->pc - 2;
+    if (reg == REG_I) return machine->I;
+    return machine->V[reg];
+}
+
+bool holds(const Chip8 *machine, const Condition *condition) {
+    unsigned long value = get_reg(machine, condition->reg);
+    switch (condition->comparison) {
+        case EQUAL:
+            return value == condition->value;
+        case NOT_EQUAL:
+            return value != condition->value;
+        case LESS:
+            return value < condition->value;
+        case LESS_EQUAL:
+            return value <= condition->value;
+        case GREATER:
+            return value > condition->value;
+        case GREATER_EQUAL:
+            return value >= condition->value;
+    }
+    return false;
+}
+
+void init_break_check(BreakCheck *check) {
+    check->previous_pc = SIZE_MEMORY;
+    check->num_watched = 0;
+    check->reason[0] = '\0';
+}
+
+// Checks the breakpoints, or only notes where the machine is if the
+// instruction gets skipped
+bool check_before(BreakCheck *check, bool is_skipped) {
+    const Chip8 *machine = get_machine();
+    unsigned short pc = machine->pc - 2;
+    unsigned short opcode = machine->opcode;
+    bool is_repeated = pc == check->previous_pc;
+    check->previous_pc = pc;
+    check->num_watched = 0;
+    watching_check = NULL;
+    if (!is_skipped && should_break_on_errors && machine->inst == NULL) {
+        snprintf(check->reason, sizeof(check->reason),
+                 "illegal opcode %04x at %03x", opcode, pc);
+        return true;
+    }
+    if (!is_skipped && should_break_on_errors &&
+        (opcode & 0xf000) == 0x2000 &&
+        (unsigned char)(machine->sp + 2) >= STACK_END - STACK_START) {
+        snprintf(check->reason, sizeof(check->reason),
+                 "stack overflow at %03x", pc);
+        return true;
+    }
+    for (int i = 0; i < num_breakpoints && !is_skipped && !is_repeated; i++) {
+        int j = 0;
+        while (j < breakpoints[i].num_conditions &&
+               holds(machine, &breakpoints[i].conditions[j])) {
+            j++;
+        }
+        if (j < breakpoints[i].num_conditions) continue;
+        snprintf(check->reason, sizeof(check->reason), "breakpoint %s",
+                 breakpoints[i].spec);
+        return true;
+    }
+    if (num_watchpoints > 0) watching_check = check;
+    return false;
+}
+
+bool check_break_before(BreakCheck *check) {
+    return check_before(check, false);
+}
+
+bool check_break_after(BreakCheck *check) {
+    watching_check = NULL;
+    if (check->num_watched == 0) return false;
+    // Any write counts, even of the same value
+    snprintf(check->reason, sizeof(check->reason),
+             "write to %03x: %02x -> %02x", check->watched_addrs[0],
+             check->watched_bytes[0], read_mem(check->watched_addrs[0]));
+    check->num_watched = 0;
+    return true;
+}
+
+bool should_break_before() {
+    bool is_skipped = is_skipping_once;
+    is_skipping_once = false;
+    return check_before(&live_check, is_skipped);
+}
+
+bool should_break_after() { return check_break_after(&live_check); }
+
+void skip_breakpoints_once() { is_skipping_once = true; }
+
+const char *get_break_reason() { return live_check.reason; }
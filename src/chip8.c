@@ -1,14 +1,21 @@
 #include "chip8.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "debugger.h"
+#include "ops.h"
+#include "probes.h"
 
-#define SIZE_MEMORY (START_VIDEO_MEM + SIZE_VIDEO_MEM)
-#define GET_FROM_MEM(addr) memory[(addr) % SIZE_MEMORY]
 
 #define FONT_HEIGTH 5
 #define BIG_FONT_HEIGTH 10
@@ -17,24 +24,62 @@
 #define PIXELS_TO_SCROLL_RL 4
 #define NUM_BYTES_IN_ROW (SIZE_VIDEO_MEM / HEIGTH)
 
-#define FIRST(opcode) (opcode & 0x000f)
-#define SECOND(opcode) ((opcode & 0x00f0) >> 4)
-#define THIRD(opcode) ((opcode & 0x0f00) >> 8)
-#define FOURTH(opcode) ((opcode & 0xf000) >> 12)
-#define IMMEDIATE(opcode) (opcode & 0x00ff)
-#define ADDR(opcode) (opcode & 0x0fff)
-
-typedef unsigned int (*instruction)(unsigned short);
-
-unsigned char V[16];
-unsigned short pc;
-unsigned char sp;
-unsigned short I;
-unsigned char dt, st;
-bool hi_res;
-bool has_superchip8_quirks;
-unsigned char flags[16];
-unsigned char memory[SIZE_MEMORY] = {
+#define STATE_MAGIC "C8ST"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+#define NUM_IMAGE_BUCKETS 256
+
+Chip8 default_machine;
+// The machine every other function works on
+_Thread_local Chip8 *m = &default_machine;
+// Off unless the thread sets one, see `set_inst_trace()`
+_Thread_local InstTrace *inst_trace = NULL;
+// Off unless the thread sets one, see `set_write_hook()`
+_Thread_local void (*write_hook)(unsigned short addr) = NULL;
+
+// Every image in use, by hash of the program
+RomImage *image_buckets[NUM_IMAGE_BUCKETS];
+pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Files loaded before and their images, by hash of the path, so loading one
+// again doesn't read it. Guarded by image_lock too.
+typedef struct RomPath {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    const RomImage *image;
+    struct RomPath *next;
+} RomPath;
+
+RomPath *path_buckets[NUM_IMAGE_BUCKETS];
+
+// Drops a reference to an image (under image_lock), the last one frees it
+void unref_image(const RomImage *image) {
+    if (image == NULL || --((RomImage *)image)->refs > 0) return;
+    RomImage **link = &image_buckets[image->hash % NUM_IMAGE_BUCKETS];
+    while (*link != image) link = &(*link)->next;
+    *link = image->next;
+    free((RomImage *)image);
+}
+
+void release_image(const RomImage *image) {
+    pthread_mutex_lock(&image_lock);
+    unref_image(image);
+    pthread_mutex_unlock(&image_lock);
+}
+
+void hold_image(const RomImage *image) {
+    if (image == NULL) return;
+    pthread_mutex_lock(&image_lock);
+    ((RomImage *)image)->refs++;
+    pthread_mutex_unlock(&image_lock);
+}
+
+const unsigned char font[] = {
     0xf0, 0x90, 0x90, 0x90, 0xf0,                                // 0
     0x20, 0x60, 0x20, 0x20, 0x70,                                // 1
     0xf0, 0x10, 0xf0, 0x80, 0xf0,                                // 2
@@ -69,45 +114,328 @@ unsigned char memory[SIZE_MEMORY] = {
     0xfe, 0x80, 0x80, 0x80, 0xf8, 0x80, 0x80, 0x80, 0x80, 0x00,  // big F
 };
 
+void free_machine(Chip8 *machine) {
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        free(machine->pages[i]);
+        machine->pages[i] = NULL;
+    }
+    machine->keeps_pages = false;
+    release_image(machine->image);
+    machine->image = NULL;
+}
+
 void init_chip8() {
-    pc = PROGRAM_START;
-    sp = -2;
+    free_machine(m);
+    memset(m, 0, sizeof(Chip8));
+    attach_image(get_rom_image(NULL, 0));
+    m->pc = PROGRAM_START;
+    m->sp = -2;
+    seed_random(0);
 }
 
-void skip_key(unsigned char reg, bool is_equal, unsigned char key) {
-    unsigned static char saved_reg;
-    static bool saved_is_equal;
-    if (reg != KEYBOARD_UNSET && key == KEYBOARD_UNSET) {
-        saved_reg = reg;
-        saved_is_equal = is_equal;
+const RomImage *get_rom_image(const unsigned char *program, size_t size) {
+    // NOTE: Not sure if program space and display buffer/stack should overlap
+    if (size >= SIZE_MEMORY - PROGRAM_START) return NULL;
+    unsigned int hash = hash_bytes(program, size);
+    RomImage **bucket = &image_buckets[hash % NUM_IMAGE_BUCKETS];
+
+    pthread_mutex_lock(&image_lock);
+    RomImage *image = *bucket;
+    while (image != NULL &&
+           (image->hash != hash || image->size != size ||
+            (size != 0 &&
+             memcmp(image->memory + PROGRAM_START, program, size) != 0))) {
+        image = image->next;
+    }
+    if (image == NULL && (image = calloc(1, sizeof(RomImage))) != NULL) {
+        memcpy(image->memory, font, sizeof(font));
+        if (size != 0) memcpy(image->memory + PROGRAM_START, program, size);
+        image->hash = hash;
+        image->size = size;
+        image->next = *bucket;
+        *bucket = image;
+    }
+    if (image != NULL) image->refs++;
+    pthread_mutex_unlock(&image_lock);
+    return image;
+}
+
+void attach_image(const RomImage *image) {
+    free_machine(m);
+    m->image = image;
+    memcpy(m->video_mem, image->memory + START_VIDEO_MEM, SIZE_VIDEO_MEM);
+}
+
+unsigned char read_mem(unsigned short addr) {
+    addr %= SIZE_MEMORY;
+    if (addr >= START_VIDEO_MEM) return m->video_mem[addr - START_VIDEO_MEM];
+    unsigned char *page = m->pages[addr / MEMORY_PAGE_SIZE];
+    if (page == NULL) return m->image->memory[addr];
+    return page[addr % MEMORY_PAGE_SIZE];
+}
+
+// Gets a byte to write to, the page gets its own copy on the first write
+unsigned char *write_mem(unsigned short addr) {
+    addr %= SIZE_MEMORY;
+    if (write_hook != NULL) write_hook(addr);
+    if (addr >= START_VIDEO_MEM) return &m->video_mem[addr - START_VIDEO_MEM];
+    unsigned char **page = &m->pages[addr / MEMORY_PAGE_SIZE];
+    if (*page == NULL) {
+        *page = malloc(MEMORY_PAGE_SIZE);
+        if (*page == NULL) return NULL;
+        memcpy(*page, m->image->memory + addr / MEMORY_PAGE_SIZE *
+                                             MEMORY_PAGE_SIZE,
+               MEMORY_PAGE_SIZE);
+    }
+    return &(*page)[addr % MEMORY_PAGE_SIZE];
+}
+
+// The stack holds addresses in the byte order of the host
+unsigned short read_word(unsigned short addr) {
+    unsigned char bytes[2] = {read_mem(addr), read_mem(addr + 1)};
+    unsigned short word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Returns 0 if everything is ok, 1 if a page couldn't be allocated
+int write_word(unsigned short addr, unsigned short word) {
+    unsigned char bytes[2];
+    memcpy(bytes, &word, sizeof(word));
+    for (int i = 0; i < 2; i++) {
+        unsigned char *byte = write_mem(addr + i);
+        if (byte == NULL) return 1;
+        *byte = bytes[i];
+    }
+    return 0;
+}
+
+// Copies the whole memory (SIZE_MEMORY bytes)
+void read_memory(unsigned char *memory) {
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        const unsigned char *page = m->pages[i];
+        if (page == NULL) page = m->image->memory + i * MEMORY_PAGE_SIZE;
+        memcpy(memory + i * MEMORY_PAGE_SIZE, page, MEMORY_PAGE_SIZE);
+    }
+    memcpy(memory + START_VIDEO_MEM, m->video_mem, SIZE_VIDEO_MEM);
+}
+
+// Overwrites the whole memory, pages equal to the image get shared again
+// unless the machine keeps its pages. Returns 0 if everything is ok, 1 if a
+// page couldn't be allocated.
+int write_memory(const unsigned char *memory) {
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        const unsigned char *page = memory + i * MEMORY_PAGE_SIZE;
+        if (!m->keeps_pages &&
+            memcmp(page, m->image->memory + i * MEMORY_PAGE_SIZE,
+                   MEMORY_PAGE_SIZE) == 0) {
+            free(m->pages[i]);
+            m->pages[i] = NULL;
+            continue;
+        }
+        if (m->pages[i] == NULL) m->pages[i] = malloc(MEMORY_PAGE_SIZE);
+        if (m->pages[i] == NULL) return 1;
+        memcpy(m->pages[i], page, MEMORY_PAGE_SIZE);
+    }
+    memcpy(m->video_mem, memory + START_VIDEO_MEM, SIZE_VIDEO_MEM);
+    return 0;
+}
+
+int keep_pages() {
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        if (m->pages[i] != NULL) continue;
+        m->pages[i] = malloc(MEMORY_PAGE_SIZE);
+        if (m->pages[i] == NULL) return 1;
+        memcpy(m->pages[i], m->image->memory + i * MEMORY_PAGE_SIZE,
+               MEMORY_PAGE_SIZE);
+    }
+    m->keeps_pages = true;
+    return 0;
+}
+
+int copy_machine(Chip8 *dst, const Chip8 *src) {
+    memcpy(dst, src, offsetof(Chip8, image));
+    hold_image(src->image);
+    release_image(dst->image);
+    dst->image = src->image;
+    dst->inst = src->inst;
+    dst->illegal_opcodes = src->illegal_opcodes;
+    dst->keeps_pages = src->keeps_pages;
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        if (src->pages[i] == NULL) {
+            free(dst->pages[i]);
+            dst->pages[i] = NULL;
+            continue;
+        }
+        if (dst->pages[i] == NULL) dst->pages[i] = malloc(MEMORY_PAGE_SIZE);
+        if (dst->pages[i] == NULL) return 1;
+        memcpy(dst->pages[i], src->pages[i], MEMORY_PAGE_SIZE);
+    }
+    return 0;
+}
+
+// splitmix64, so that similar seeds still give unrelated generator states
+unsigned long long next_seed(unsigned long long *seed) {
+    unsigned long long z = (*seed += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void seed_random(unsigned long long seed) {
+    for (int i = 0; i < 4; i += 2) {
+        unsigned long long z = next_seed(&seed);
+        m->random[i] = z;
+        m->random[i + 1] = z >> 32;
+    }
+}
+
+unsigned int next_random() { return next_xoshiro(m->random, 1); }
+
+unsigned int hash_bytes(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    unsigned int hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+Chip8 *get_machine() { return m; }
+
+void set_machine(Chip8 *machine) { m = machine; }
+
+void set_inst_trace(InstTrace *trace) { inst_trace = trace; }
+
+void set_write_hook(void (*hook)(unsigned short addr)) { write_hook = hook; }
+
+void trace_instruction(unsigned short pc) {
+    unsigned long last = (inst_trace->count - 1) % INST_TRACE_SIZE;
+    // LD Vx, K runs again every cycle while it waits, keep it once
+    if (m->is_waiting && inst_trace->count > 0 &&
+        inst_trace->records[last].pc == pc) {
         return;
     }
-    if (reg == KEYBOARD_UNSET) {
-        unsigned char are_equal = (saved_is_equal) ? 2 : 0;
-        unsigned char are_not_equal = (saved_is_equal) ? 0 : 2;
-        pc += (V[saved_reg] == key) ? are_equal : are_not_equal;
+    InstRecord *record =
+        &inst_trace->records[inst_trace->count++ % INST_TRACE_SIZE];
+    record->frame = inst_trace->frame;
+    record->pc = pc;
+    record->opcode = m->opcode;
+    record->I = m->I;
+    record->vf = m->V[0xf];
+}
+
+void skip_key(unsigned char reg, bool is_equal, unsigned short keys) {
+    if (reg != KEYBOARD_UNSET) {
+        m->skip_reg = reg;
+        m->skip_is_equal = is_equal;
         return;
     }
+    bool is_down = m->V[m->skip_reg] < 16 && (keys >> m->V[m->skip_reg]) & 1;
+    if (is_down == m->skip_is_equal) m->pc += 2;
 }
 
-void load_key(unsigned char reg, unsigned char key) {
-    unsigned static char saved_reg;
-    if (reg != KEYBOARD_UNSET && key == KEYBOARD_UNSET) {
-        saved_reg = reg;
+void load_key(unsigned char reg, unsigned short keys) {
+    if (reg != KEYBOARD_UNSET) {
+        // The instruction gets executed again while waiting, keep the keys
+        if (m->is_waiting) return;
+        m->load_reg = reg;
+        m->pressed_keys = 0;
+        m->is_waiting = true;
         return;
     }
-    if (reg == KEYBOARD_UNSET && key != KEYBOARD_UNSET) {
-        V[saved_reg] = key;
+    // Wait until a key gets pressed and then released
+    m->pressed_keys |= keys;
+    unsigned short released_keys = m->pressed_keys & ~keys;
+    if (released_keys == 0) {
+        m->pc -= 2;
         return;
     }
+    unsigned char key = 0;
+    while (!((released_keys >> key) & 1)) key++;
+    m->V[m->load_reg] = key;
+    m->is_waiting = false;
+}
+
+// Gets the image of a file loaded before with a reference to it, NULL if the
+// file may have changed since
+const RomImage *find_rom_path(const char *path, const struct stat *st) {
+    RomPath **bucket =
+        &path_buckets[hash_bytes(path, strlen(path)) % NUM_IMAGE_BUCKETS];
+    const RomImage *image = NULL;
+    pthread_mutex_lock(&image_lock);
+    for (RomPath *entry = *bucket; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) != 0) continue;
+        if (entry->dev == st->st_dev && entry->ino == st->st_ino &&
+            entry->size == st->st_size &&
+            entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            image = entry->image;
+            ((RomImage *)image)->refs++;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&image_lock);
+    return image;
+}
+
+// Remembers the image of a file, `st` is from before it was read. The entry
+// keeps the image alive until the file changes.
+void add_rom_path(const char *path, const struct stat *st,
+                  const RomImage *image) {
+    // The mtime only changes every few milliseconds, a file written in the
+    // last second could change again without it (like the fuzzer's)
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - st->st_mtim.tv_sec < 2) return;
+
+    RomPath **bucket =
+        &path_buckets[hash_bytes(path, strlen(path)) % NUM_IMAGE_BUCKETS];
+    pthread_mutex_lock(&image_lock);
+    RomPath *entry = *bucket;
+    while (entry != NULL && strcmp(entry->path, path) != 0) {
+        entry = entry->next;
+    }
+    if (entry == NULL && (entry = calloc(1, sizeof(RomPath))) != NULL) {
+        entry->path = strdup(path);
+        if (entry->path == NULL) {
+            free(entry);
+            entry = NULL;
+        } else {
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    if (entry != NULL) {
+        entry->dev = st->st_dev;
+        entry->ino = st->st_ino;
+        entry->size = st->st_size;
+        entry->mtime = st->st_mtim;
+        ((RomImage *)image)->refs++;
+        unref_image(entry->image);
+        entry->image = image;
+    }
+    pthread_mutex_unlock(&image_lock);
 }
 
 int load_program(const char *program_path) {
+    struct stat st;
+    const RomImage *image = NULL;
+    if (stat(program_path, &st) == 0) image = find_rom_path(program_path, &st);
+    if (image != NULL) {
+        attach_image(image);
+        debug_printf("Loaded %s (cached)\n", program_path);
+        return 0;
+    }
+
+    unsigned char buffer[SIZE_MEMORY - PROGRAM_START];
     FILE *program = fopen(program_path, "r");
     if (program == NULL) {
         printf("Error loading %s.\n", program_path);
         return 1;
     }
+    bool has_stat = fstat(fileno(program), &st) == 0;
 
     fseek(program, 0, SEEK_END);
     int filesize = ftell(program);
@@ -123,7 +451,7 @@ int load_program(const char *program_path) {
         return 1;
     }
     fseek(program, 0, SEEK_SET);
-    size_t bytes_read = fread(memory + PROGRAM_START, 1, filesize, program);
+    size_t bytes_read = fread(buffer, 1, filesize, program);
     if (bytes_read != filesize) {
         printf("Error reading file\n");
         fclose(program);
@@ -131,39 +459,49 @@ int load_program(const char *program_path) {
     }
 
     fclose(program);
+    image = get_rom_image(buffer, filesize);
+    if (image == NULL) {
+        printf("Couldn't allocate the program image.\n");
+        return 1;
+    }
+    if (has_stat) add_rom_path(program_path, &st, image);
+    attach_image(image);
     debug_printf("Loaded %s\n", program_path);
     return 0;
 }
 
 void print_state() {
-    print_registers(V);
+    unsigned char memory[SIZE_MEMORY];
+    read_memory(memory);
+    print_registers(m->V);
     printf("\n");
-    print_stack(memory + STACK_START, STACK_END - STACK_START, sp);
+    print_stack(memory + STACK_START, STACK_END - STACK_START, m->sp);
     printf("\n");
-    printf("Stack pointer:   %02x\n", sp);
-    printf("Program counter: %04x\n", pc);
-    printf("Index register:  %04x\n", I);
+    printf("Stack pointer:   %02x\n", m->sp);
+    printf("Program counter: %04x\n", m->pc);
+    printf("Index register:  %04x\n", m->I);
     printf("\n");
-    print_memory(memory, pc);
+    print_memory(memory, m->pc);
 }
 
 unsigned short fetch() {
-    unsigned short opcode = GET_FROM_MEM(pc) << 8;
-    opcode |= GET_FROM_MEM(pc + 1);
-    pc += 2;
+    unsigned short opcode = read_mem(m->pc) << 8;
+    opcode |= read_mem(m->pc + 1);
+    m->pc += 2;
     return opcode;
 }
 
 unsigned int clear_op(unsigned short opcode) {
     memset(get_video_mem(), 0, SIZE_VIDEO_MEM);
+    CHIP8_PROBE(clear);
     debug_printf("EXECUTED: CLS\n");
     return CLEAR;
 }
 
 unsigned int return_op(unsigned short opcode) {
-    if (sp == 0xfe) return IDLE;
-    pc = *(unsigned short *)(memory + STACK_START + sp);
-    sp -= 2;
+    if (m->sp == 0xfe) return IDLE;
+    m->pc = read_word(STACK_START + m->sp);
+    m->sp -= 2;
     debug_printf("EXECUTED: RET\n");
     return IDLE;
 }
@@ -175,6 +513,7 @@ unsigned int scroll_down(unsigned short opcode) {
     memmove(video_mem + n * NUM_BYTES_IN_ROW, video_mem,
             (HEIGTH - n) * NUM_BYTES_IN_ROW);
     memset(video_mem, 0, n * NUM_BYTES_IN_ROW);
+    CHIP8_PROBE1(scroll, opcode);
     debug_printf("EXECUTED: SCD nibble\n");
     return SCROLL;
 }
@@ -191,6 +530,7 @@ unsigned int scroll_right(unsigned short opcode) {
     for (int j = 0; j < HEIGTH; j++) {
         video_mem[j * NUM_BYTES_IN_ROW] >>= PIXELS_TO_SCROLL_RL;
     }
+    CHIP8_PROBE1(scroll, opcode);
     debug_printf("EXECUTED: SCR\n");
     return SCROLL;
 }
@@ -207,199 +547,177 @@ unsigned int scroll_left(unsigned short opcode) {
     for (int j = 1; j <= HEIGTH; j++) {
         video_mem[j * NUM_BYTES_IN_ROW - 1] <<= PIXELS_TO_SCROLL_RL;
     }
+    CHIP8_PROBE1(scroll, opcode);
     debug_printf("EXECUTED: SCL\n");
     return SCROLL;
 }
 
 unsigned int exit_op(unsigned short opcode) {
+    CHIP8_PROBE1(exit, m->pc - 2);
     debug_printf("EXECUTED: EXIT\n");
     return EXIT;
 }
 
 unsigned int low_op(unsigned short opcode) {
-    hi_res = false;
+    m->hi_res = false;
     debug_printf("EXECUTED: LOW\n");
     return IDLE;
 }
 
 unsigned int high_op(unsigned short opcode) {
-    hi_res = true;
+    m->hi_res = true;
     debug_printf("EXECUTED: HIGH\n");
     return IDLE;
 }
 
 unsigned int jump(unsigned short opcode) {
-    pc = ADDR(opcode);
-    debug_printf("EXECUTED: JP %04x\n", pc);
+    m->pc = ADDR(opcode);
+    debug_printf("EXECUTED: JP %04x\n", m->pc);
     return IDLE;
 }
 
 unsigned int call(unsigned short opcode) {
-    sp += 2;
-    if (sp >= STACK_END - STACK_START) {
+    m->sp += 2;
+    if (m->sp >= STACK_END - STACK_START) {
         set_error("Reached end of stack");
         return EXIT;
     }
-    *(unsigned short *)(memory + STACK_START + sp) = pc;
-    pc = ADDR(opcode);
-    debug_printf("EXECUTED: CALL %04x\n", pc);
+    if (write_word(STACK_START + m->sp, m->pc) == 1) {
+        set_error("Out of memory");
+        return EXIT;
+    }
+    m->pc = ADDR(opcode);
+    debug_printf("EXECUTED: CALL %04x\n", m->pc);
     return IDLE;
 }
 
 unsigned int skip_equal_immediate(unsigned short opcode) {
-    if (V[THIRD(opcode)] == IMMEDIATE(opcode)) {
-        pc += 2;
-    }
+    m->pc += skip_offset(m->V, 1, opcode);
     debug_printf("EXECUTED: SE V%x, %x\n", THIRD(opcode), IMMEDIATE(opcode));
     return IDLE;
 }
 
 unsigned int skip_not_equal_immediate(unsigned short opcode) {
-    if (V[THIRD(opcode)] != IMMEDIATE(opcode)) {
-        pc += 2;
-    }
+    m->pc += skip_offset(m->V, 1, opcode);
     debug_printf("EXECUTED: SNE V%x, %x\n", THIRD(opcode), IMMEDIATE(opcode));
     return IDLE;
 }
 
 unsigned int skip_equal_reg(unsigned short opcode) {
-    if (V[THIRD(opcode)] == V[SECOND(opcode)]) {
-        pc += 2;
-    }
+    m->pc += skip_offset(m->V, 1, opcode);
     debug_printf("EXECUTED: SE V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int load_immediate(unsigned short opcode) {
-    V[THIRD(opcode)] = IMMEDIATE(opcode);
+    m->V[THIRD(opcode)] = IMMEDIATE(opcode);
     debug_printf("EXECUTED: LD V%x, %x\n", THIRD(opcode), IMMEDIATE(opcode));
     return IDLE;
 }
 
 unsigned int add_immediate(unsigned short opcode) {
-    V[THIRD(opcode)] += IMMEDIATE(opcode);
+    m->V[THIRD(opcode)] += IMMEDIATE(opcode);
     debug_printf("EXECUTED: ADD V%x, %x\n", THIRD(opcode), IMMEDIATE(opcode));
     return IDLE;
 }
 
 unsigned int load_reg(unsigned short opcode) {
-    V[THIRD(opcode)] = V[SECOND(opcode)];
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: LD V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int or_reg(unsigned short opcode) {
-    V[THIRD(opcode)] |= V[SECOND(opcode)];
-    if (!has_superchip8_quirks) V[0xf] = 0;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: OR V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int and_reg(unsigned short opcode) {
-    V[THIRD(opcode)] &= V[SECOND(opcode)];
-    if (!has_superchip8_quirks) V[0xf] = 0;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: AND V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int xor_reg(unsigned short opcode) {
-    V[THIRD(opcode)] ^= V[SECOND(opcode)];
-    if (!has_superchip8_quirks) V[0xf] = 0;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: XOR V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int add_reg(unsigned short opcode) {
-    int sum = V[THIRD(opcode)] + V[SECOND(opcode)];
-    V[THIRD(opcode)] = sum;
-    V[0xf] = sum > 0xff;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: ADD V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int subtract_reg(unsigned short opcode) {
-    int diff = V[THIRD(opcode)] - V[SECOND(opcode)];
-    V[THIRD(opcode)] = diff;
-    V[0xf] = diff >= 0;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: SUB V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int shift_right_reg(unsigned short opcode) {
-    unsigned char vf = V[SECOND(opcode)] & 0x01;
-    if (has_superchip8_quirks)
-        V[SECOND(opcode)] >>= 1;
-    else
-        V[THIRD(opcode)] = V[SECOND(opcode)] >> 1;
-    V[0xf] = vf;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: SHR V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int subtract_negated_reg(unsigned short opcode) {
-    int diff = V[THIRD(opcode)] - V[SECOND(opcode)];
-    V[THIRD(opcode)] = -diff;
-    V[0xf] = diff <= 0;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: SUBN V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int shift_left_reg(unsigned short opcode) {
-    unsigned char vf = (V[SECOND(opcode)] & 0x80) >> 7;
-    if (has_superchip8_quirks)
-        V[SECOND(opcode)] <<= 1;
-    else
-        V[THIRD(opcode)] = V[SECOND(opcode)] << 1;
-    V[0xf] = vf;
+    alu_op(m->V, 1, opcode, m->has_superchip8_quirks);
     debug_printf("EXECUTED: SHL V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int skip_not_equal_reg(unsigned short opcode) {
-    if (V[THIRD(opcode)] != V[SECOND(opcode)]) {
-        pc += 2;
-    }
+    m->pc += skip_offset(m->V, 1, opcode);
     debug_printf("EXECUTED: SNE V%x, V%x\n", THIRD(opcode), SECOND(opcode));
     return IDLE;
 }
 
 unsigned int load_index(unsigned short opcode) {
-    I = ADDR(opcode);
-    debug_printf("EXECUTED: LD I, %04x\n", I);
+    m->I = ADDR(opcode);
+    debug_printf("EXECUTED: LD I, %04x\n", m->I);
     return IDLE;
 }
 
 unsigned int jump_reg(unsigned short opcode) {
-    int reg = (has_superchip8_quirks) ? THIRD(opcode) : 0;
-    pc = ADDR(opcode) + V[reg];
+    int reg = (m->has_superchip8_quirks) ? THIRD(opcode) : 0;
+    m->pc = ADDR(opcode) + m->V[reg];
     debug_printf("EXECUTED: JP V%x, %04x\n", reg, ADDR(opcode));
     return IDLE;
 }
 
 unsigned int random_reg(unsigned short opcode) {
-    V[THIRD(opcode)] = (rand() % 0x0100) & IMMEDIATE(opcode);
+    m->V[THIRD(opcode)] = (next_random() >> 24) & IMMEDIATE(opcode);
     debug_printf("EXECUTED: RND V%x, %02x\n", THIRD(opcode), IMMEDIATE(opcode));
     return IDLE;
 }
 
 unsigned int draw_op(unsigned short opcode) {
-    unsigned char vx = V[THIRD(opcode)];
+    unsigned char vx = m->V[THIRD(opcode)];
     unsigned char n = FIRST(opcode);
     if (n == 0) n = 32;
     unsigned char *video_mem = get_video_mem();
-    int width = (hi_res) ? WIDTH : WIDTH / 2;
-    int height = (hi_res) ? HEIGTH : HEIGTH / 2;
+    int width = (m->hi_res) ? WIDTH : WIDTH / 2;
+    int height = (m->hi_res) ? HEIGTH : HEIGTH / 2;
     const unsigned short start_y =
-        (V[SECOND(opcode)] % height) * NUM_BYTES_IN_ROW;
+        (m->V[SECOND(opcode)] % height) * NUM_BYTES_IN_ROW;
     const unsigned short start_x = (vx % width) / 8;
     int y = start_y;
-    V[0xf] = 0;
+    m->V[0xf] = 0;
 
     for (int i = 0; i < n && y < height * NUM_BYTES_IN_ROW; i++) {
         // Get a row of a sprite
-        unsigned int sprite_int = GET_FROM_MEM(I + i) << 24;
+        unsigned int sprite_int = read_mem(m->I + i) << 24;
         if (n == 32) {
-            sprite_int |= GET_FROM_MEM(I + i + 1) << 16;
+            sprite_int |= read_mem(m->I + i + 1) << 16;
             i++;
         }
         sprite_int >>= (vx % 8);
@@ -409,7 +727,7 @@ unsigned int draw_op(unsigned short opcode) {
         for (int x = start_x; x < 16; x++) {
             unsigned char curr_byte = sprite_int >> 24;
             if ((video_mem[x + y] & curr_byte) != 0) {
-                V[0xf] = 1;
+                m->V[0xf] = 1;
             }
             sprite_int <<= 8;
             video_mem[x + y] ^= curr_byte;
@@ -417,71 +735,78 @@ unsigned int draw_op(unsigned short opcode) {
         y += NUM_BYTES_IN_ROW;
     }
 
+    CHIP8_PROBE4(draw, vx % width, start_y / NUM_BYTES_IN_ROW, FIRST(opcode),
+                 m->V[0xf]);
     debug_printf("EXECUTED: DRW V%x, V%x, %x\n", THIRD(opcode), SECOND(opcode),
                  FIRST(opcode));
     return SET_XY(start_x + start_y) | SET_N(FIRST(opcode)) |
-           ((hi_res) ? DRAW_HI_RES : DRAW);
+           ((m->hi_res) ? DRAW_HI_RES : DRAW);
 }
 
 unsigned int skip_key_op(unsigned short opcode) {
-    skip_key(THIRD(opcode), true, KEYBOARD_UNSET);
+    skip_key(THIRD(opcode), true, 0);
     debug_printf("EXECUTING: SKP V%x\n", THIRD(opcode));
     return KEYBOARD_NONBLOCKING;
 }
 
 unsigned int skip_not_key_op(unsigned short opcode) {
-    skip_key(THIRD(opcode), false, KEYBOARD_UNSET);
+    skip_key(THIRD(opcode), false, 0);
     debug_printf("EXECUTING: SKNP V%x\n", THIRD(opcode));
     return KEYBOARD_NONBLOCKING;
 }
 
 unsigned int delay_to_reg(unsigned short opcode) {
-    V[THIRD(opcode)] = dt;
+    m->V[THIRD(opcode)] = m->dt;
     debug_printf("EXECUTED: LD V%x, DT\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int key_to_reg(unsigned short opcode) {
-    load_key(THIRD(opcode), KEYBOARD_UNSET);
+    load_key(THIRD(opcode), 0);
     debug_printf("EXECUTING: LD V%x, K\n", THIRD(opcode));
     debug_printf("Waiting for keyboard input!");
     return KEYBOARD_BLOCKING;
 }
 
 unsigned int reg_to_delay(unsigned short opcode) {
-    dt = V[THIRD(opcode)];
+    m->dt = m->V[THIRD(opcode)];
     debug_printf("EXECUTED: LD DT, V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int reg_to_sound(unsigned short opcode) {
-    st = V[THIRD(opcode)];
+    m->st = m->V[THIRD(opcode)];
     debug_printf("EXECUTED: LD ST, V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int add_index_reg(unsigned short opcode) {
-    I += V[THIRD(opcode)];
+    m->I += m->V[THIRD(opcode)];
     debug_printf("EXECUTED: ADD I, V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int load_font(unsigned short opcode) {
-    I = (V[THIRD(opcode)] & 0x0f) * FONT_HEIGTH;
+    m->I = (m->V[THIRD(opcode)] & 0x0f) * FONT_HEIGTH;
     debug_printf("EXECUTED: LD F, V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int load_big_font(unsigned short opcode) {
-    I = BIG_FONT_OFFSET + (V[THIRD(opcode)] & 0x0f) * BIG_FONT_HEIGTH;
+    m->I = BIG_FONT_OFFSET + (m->V[THIRD(opcode)] & 0x0f) * BIG_FONT_HEIGTH;
     debug_printf("EXECUTED: LD HF, V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int to_bcd(unsigned short opcode) {
-    int val = V[THIRD(opcode)];
+    int val = m->V[THIRD(opcode)];
     for (int i = 2; i >= 0; i--) {
-        memory[(I + i) & 0x0fff] = val % 10;
+        unsigned char *byte = write_mem((m->I + i) & 0x0fff);
+        if (byte == NULL) {
+            set_error("Out of memory");
+            return EXIT;
+        }
+        *byte = val % 10;
         val /= 10;
     }
     debug_printf("EXECUTED: BCD V%x\n", THIRD(opcode));
@@ -489,27 +814,36 @@ unsigned int to_bcd(unsigned short opcode) {
 }
 
 unsigned int regs_to_memory(unsigned short opcode) {
-    memcpy(memory + I % SIZE_MEMORY, V, THIRD(opcode) + 1);
-    if (!has_superchip8_quirks) I += THIRD(opcode) + 1;
+    for (int i = 0; i <= THIRD(opcode); i++) {
+        unsigned char *byte = write_mem(m->I % SIZE_MEMORY + i);
+        if (byte == NULL) {
+            set_error("Out of memory");
+            return EXIT;
+        }
+        *byte = m->V[i];
+    }
+    if (!m->has_superchip8_quirks) m->I += THIRD(opcode) + 1;
     debug_printf("EXECUTED: LD [I], V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int memory_to_regs(unsigned short opcode) {
-    memcpy(V, memory + I % SIZE_MEMORY, THIRD(opcode) + 1);
-    if (!has_superchip8_quirks) I += (THIRD(opcode)) + 1;
+    for (int i = 0; i <= THIRD(opcode); i++) {
+        m->V[i] = read_mem(m->I % SIZE_MEMORY + i);
+    }
+    if (!m->has_superchip8_quirks) m->I += (THIRD(opcode)) + 1;
     debug_printf("EXECUTED: LD V%x, [I]\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int regs_to_flags(unsigned short opcode) {
-    memcpy(flags, V, THIRD(opcode) + 1);
+    memcpy(m->flags, m->V, THIRD(opcode) + 1);
     debug_printf("DECODED:  LD R, V%x\n", THIRD(opcode));
     return IDLE;
 }
 
 unsigned int flags_to_regs(unsigned short opcode) {
-    memcpy(V, flags, THIRD(opcode) + 1);
+    memcpy(m->V, m->flags, THIRD(opcode) + 1);
     debug_printf("DECODED:  LD V%x, R\n", THIRD(opcode));
     return IDLE;
 }
@@ -691,42 +1025,203 @@ instruction decode(unsigned short opcode) {
 }
 
 unsigned int next_cycle() {
-    unsigned static clock = 0;
-    unsigned static short opcode;
-    instruction static inst;
     unsigned int flag = IDLE;
-    if (inst == NULL && clock == 2) {
+    unsigned short pc;
+    m->cycles++;
+    if (m->inst == NULL && m->clock == 2) {
         debug_printf("EXECUTED: Illegal opcode\n");
-        clock++;
-        clock %= 3;
+        if (inst_trace != NULL) trace_instruction(m->pc - 2);
+        m->illegal_opcodes++;
+        m->clock++;
+        m->clock %= 3;
         return flag;
     }
-    switch (clock) {
+    switch (m->clock) {
         case 0:
-            opcode = fetch();
-            debug_printf("FETCHED:  %04x\n", opcode);
+            m->opcode = fetch();
+            debug_printf("FETCHED:  %04x\n", m->opcode);
             break;
         case 1:
-            inst = decode(opcode);
+            m->inst = decode(m->opcode);
             break;
         case 2:
-            flag = inst(opcode);
+            CHIP8_PROBE2(execute, m->pc - 2, m->opcode);
+            pc = m->pc - 2;
+            flag = m->inst(m->opcode);
+            if (inst_trace != NULL) trace_instruction(pc);
             break;
     }
-    clock++;
-    clock %= 3;
+    m->clock++;
+    m->clock %= 3;
     return flag;
 }
 
-unsigned char *get_video_mem() { return memory + START_VIDEO_MEM; }
+unsigned char *get_video_mem() { return m->video_mem; }
 
 Flag decrement_timers() {
-    dt -= (dt != 0) ? 1 : 0;
-    st -= (st != 0) ? 1 : 0;
-    if (st != 0) return SOUND;
+    m->dt -= (m->dt != 0) ? 1 : 0;
+    m->st -= (m->st != 0) ? 1 : 0;
+    CHIP8_PROBE2(timers, m->dt, m->st);
+    if (inst_trace != NULL) inst_trace->frame++;
+    if (m->st != 0) return SOUND;
     return IDLE;
 }
 
-void set_superchip8_quirks() { has_superchip8_quirks = true; }
+Flag run_cycle(unsigned short keys) {
+    switch ((Flag)(next_cycle() & 0xf)) {
+        case KEYBOARD_BLOCKING:
+            load_key(KEYBOARD_UNSET, keys);
+            break;
+        case KEYBOARD_NONBLOCKING:
+            skip_key(KEYBOARD_UNSET, false, keys);
+            break;
+        case EXIT:
+            return EXIT;
+        default:
+            break;
+    }
+    return IDLE;
+}
+
+Flag run_frame(unsigned short keys, long num_cycles) {
+    for (long i = 0; i < num_cycles; i++) {
+        if (run_cycle(keys) == EXIT) return EXIT;
+    }
+    return decrement_timers();
+}
+
+long next_frame_cycles(int tick_speed, long *cycle_budget) {
+    // divide by 3 because fetch-decode and then execute
+    long cycle_time = (tick_speed / 3 > 0) ? tick_speed / 3 : 1;
+    *cycle_budget += FRAME_TIME;
+    long num_cycles = *cycle_budget / cycle_time;
+    *cycle_budget -= num_cycles * cycle_time;
+    return num_cycles;
+}
+
+void set_superchip8_quirks() { m->has_superchip8_quirks = true; }
+
+bool get_hi_res() { return m->hi_res; }
+
+// Fields of the saved states are little-endian whatever the host is
+void put_le(unsigned char **bytes, unsigned long long value, int size) {
+    for (int i = 0; i < size; i++) *(*bytes)++ = value >> (8 * i);
+}
+
+unsigned long long get_le(const unsigned char **bytes, int size) {
+    unsigned long long value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (unsigned long long)*(*bytes)++ << (8 * i);
+    }
+    return value;
+}
+
+void export_state(void *state) {
+    unsigned char *p = state;
+    for (int i = 0; i < 16; i++) put_le(&p, m->V[i], 1);
+    put_le(&p, m->pc, 2);
+    put_le(&p, m->sp, 1);
+    put_le(&p, m->I, 2);
+    put_le(&p, m->dt, 1);
+    put_le(&p, m->st, 1);
+    put_le(&p, m->hi_res, 1);
+    put_le(&p, m->has_superchip8_quirks, 1);
+    for (int i = 0; i < 16; i++) put_le(&p, m->flags[i], 1);
+    put_le(&p, m->clock, 1);
+    put_le(&p, m->opcode, 2);
+    put_le(&p, m->skip_reg, 1);
+    put_le(&p, m->skip_is_equal, 1);
+    put_le(&p, m->load_reg, 1);
+    put_le(&p, m->is_waiting, 1);
+    put_le(&p, m->pressed_keys, 2);
+    for (int i = 0; i < 4; i++) put_le(&p, m->random[i], 4);
+    put_le(&p, m->cycles, 8);
+    read_memory(p);
+}
+
+// Reads a bool field, only 0 and 1 are valid
+bool get_bool(const unsigned char **bytes, bool *is_valid) {
+    unsigned long long value = get_le(bytes, 1);
+    if (value > 1) *is_valid = false;
+    return value;
+}
+
+// Reads the registers of a saved state into `machine`
+// Returns 0 if they're all in range, 1 otherwise
+int read_registers(Chip8 *machine, const unsigned char *state) {
+    const unsigned char *p = state;
+    bool is_valid = true;
+    for (int i = 0; i < 16; i++) machine->V[i] = get_le(&p, 1);
+    machine->pc = get_le(&p, 2);
+    machine->sp = get_le(&p, 1);
+    machine->I = get_le(&p, 2);
+    machine->dt = get_le(&p, 1);
+    machine->st = get_le(&p, 1);
+    machine->hi_res = get_bool(&p, &is_valid);
+    machine->has_superchip8_quirks = get_bool(&p, &is_valid);
+    for (int i = 0; i < 16; i++) machine->flags[i] = get_le(&p, 1);
+    machine->clock = get_le(&p, 1);
+    machine->opcode = get_le(&p, 2);
+    machine->skip_reg = get_le(&p, 1);
+    machine->skip_is_equal = get_bool(&p, &is_valid);
+    machine->load_reg = get_le(&p, 1);
+    machine->is_waiting = get_bool(&p, &is_valid);
+    machine->pressed_keys = get_le(&p, 2);
+    for (int i = 0; i < 4; i++) machine->random[i] = get_le(&p, 4);
+    machine->cycles = get_le(&p, 8);
+    // The stack pointer is even and inside the stack, or empty (-2)
+    bool is_sp_valid = machine->sp == 0xfe ||
+                       (machine->sp % 2 == 0 &&
+                        machine->sp < STACK_END - STACK_START);
+    is_valid = is_valid && machine->clock < 3 && is_sp_valid &&
+               machine->skip_reg < 16 && machine->load_reg < 16;
+    return (is_valid) ? 0 : 1;
+}
 
-bool get_hi_res() { return hi_res; }
+int restore_state(const void *state) {
+    read_registers(m, state);
+    // The decoded instruction isn't saved, it's only needed before executing
+    m->inst = (m->clock == 2) ? decode(m->opcode) : NULL;
+    return write_memory((const unsigned char *)state + STATE_REGISTERS_SIZE);
+}
+
+int save_state(const char *state_path) {
+    unsigned char data[STATE_HEADER_SIZE + STATE_SIZE];
+    unsigned char *p = data;
+    memcpy(p, STATE_MAGIC, 4);
+    p += 4;
+    put_le(&p, STATE_VERSION, 4);
+    put_le(&p, STATE_HEADER_SIZE, 4);
+    put_le(&p, STATE_SIZE, 4);
+    export_state(p);
+    FILE *file = fopen(state_path, "w");
+    if (file == NULL) return 1;
+    bool is_ok = fwrite(data, sizeof(data), 1, file) == 1;
+    fclose(file);
+    return (is_ok) ? 0 : 1;
+}
+
+int load_state(const char *state_path) {
+    int fd = open(state_path, O_RDONLY);
+    if (fd == -1) return 1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != STATE_HEADER_SIZE + STATE_SIZE) {
+        close(fd);
+        return 1;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 1;
+
+    const unsigned char *p = data + 4;
+    bool is_ok = memcmp(data, STATE_MAGIC, 4) == 0 &&
+                 get_le(&p, 4) == STATE_VERSION &&
+                 get_le(&p, 4) == STATE_HEADER_SIZE &&
+                 get_le(&p, 4) == STATE_SIZE;
+    // Checked on a scratch machine first, so a bad file changes nothing
+    Chip8 scratch;
+    if (is_ok) is_ok = read_registers(&scratch, p) == 0;
+    if (is_ok) is_ok = restore_state(p) == 0;
+    munmap(data, st.st_size);
+    return (is_ok) ? 0 : 1;
+}
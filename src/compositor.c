@@ -0,0 +1,148 @@
+#include "compositor.h"
+
+#include <ncurses.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "chip8.h"
+#include "graphics.h"
+
+#define SECONDS 1000000
+#define NUM_BYTES_IN_ROW (SIZE_VIDEO_MEM / HEIGTH)
+
+/* utf8 encoded block element characters
+ * ▀: {0xe2, 0x96, 0x80}
+ * ▄: {0xe2, 0x96, 0x84}
+ * █: {0xe2, 0x96, 0x88}
+ */
+#define UPPER_HALF "\xe2\x96\x80"
+#define LOWER_HALF "\xe2\x96\x84"
+#define FULL_BLOCK "\xe2\x96\x88"
+
+unsigned long get_usecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * SECONDS + ts.tv_nsec / 1000;
+}
+
+Compositor *create_compositor(int num_tiles, int max_fps) {
+    Compositor *compositor = malloc(sizeof(Compositor));
+    if (compositor == NULL) return NULL;
+    compositor->tiles = calloc(num_tiles, sizeof(Tile));
+    if (compositor->tiles == NULL) {
+        free(compositor);
+        return NULL;
+    }
+    for (int i = 0; i < num_tiles; i++) {
+        compositor->tiles[i].is_dirty = true;
+    }
+    compositor->num_tiles = num_tiles;
+    compositor->max_fps = max_fps;
+    compositor->last_present = 0;
+    compositor->win_h = 0;
+    compositor->win_w = 0;
+    return compositor;
+}
+
+void free_compositor(Compositor *compositor) {
+    free(compositor->tiles);
+    free(compositor);
+}
+
+void set_tile(Compositor *compositor, int tile, unsigned char *video_mem,
+              bool hi_res, const char *label) {
+    Tile *t = &compositor->tiles[tile];
+    if (t->hi_res != hi_res ||
+        memcmp(t->video_mem, video_mem, SIZE_VIDEO_MEM) != 0) {
+        memcpy(t->video_mem, video_mem, SIZE_VIDEO_MEM);
+        t->hi_res = hi_res;
+        t->is_dirty = true;
+    }
+    if (label != NULL && strncmp(t->label, label, TILE_LABEL_SIZE - 1) != 0) {
+        snprintf(t->label, TILE_LABEL_SIZE, "%s", label);
+        t->is_dirty = true;
+    }
+}
+
+bool get_bit(unsigned char *video_mem, int x, int y) {
+    return (video_mem[y * NUM_BYTES_IN_ROW + x / 8] >> (7 - x % 8)) & 1;
+}
+
+// Gets a pixel of the 64x32 tile, high resolution gets scaled down by half
+bool get_tile_pixel(Tile *tile, int x, int y) {
+    if (!tile->hi_res) return get_bit(tile->video_mem, x, y);
+    return get_bit(tile->video_mem, 2 * x, 2 * y) ||
+           get_bit(tile->video_mem, 2 * x + 1, 2 * y) ||
+           get_bit(tile->video_mem, 2 * x, 2 * y + 1) ||
+           get_bit(tile->video_mem, 2 * x + 1, 2 * y + 1);
+}
+
+void draw_tile(Tile *tile, int start_y, int start_x) {
+    // Label (the whole line, so the old one gets overwritten)
+    char label[TILE_WIDTH + 1];
+    snprintf(label, sizeof(label), "%-*s", TILE_WIDTH, tile->label);
+    attron(A_REVERSE);
+    mvaddstr(start_y, start_x, label);
+    attroff(A_REVERSE);
+
+    // Pixels, two rows of them per line
+    char line[TILE_WIDTH * 3 + 1];
+    for (int y = 0; y < TILE_HEIGHT; y++) {
+        char *p = line;
+        for (int x = 0; x < TILE_WIDTH; x++) {
+            bool is_top_on = get_tile_pixel(tile, x, 2 * y);
+            bool is_bottom_on = get_tile_pixel(tile, x, 2 * y + 1);
+            const char *pixel = " ";
+            if (is_top_on && is_bottom_on)
+                pixel = FULL_BLOCK;
+            else if (is_top_on)
+                pixel = UPPER_HALF;
+            else if (is_bottom_on)
+                pixel = LOWER_HALF;
+            size_t len = strlen(pixel);
+            memcpy(p, pixel, len);
+            p += len;
+        }
+        *p = '\0';
+        mvaddstr(start_y + 1 + y, start_x, line);
+    }
+    tile->is_dirty = false;
+}
+
+bool present_tiles(Compositor *compositor) {
+    unsigned long now = get_usecs();
+    if (compositor->max_fps != 0 &&
+        now - compositor->last_present < SECONDS / compositor->max_fps) {
+        return false;
+    }
+
+    int win_h, win_w;
+    get_win_dimens(&win_h, &win_w);
+    if (win_h != compositor->win_h || win_w != compositor->win_w) {
+        // Tiles move around, so everything gets redrawn
+        clear();
+        for (int i = 0; i < compositor->num_tiles; i++) {
+            compositor->tiles[i].is_dirty = true;
+        }
+        compositor->win_h = win_h;
+        compositor->win_w = win_w;
+    }
+
+    int num_cols = (win_w + 1) / (TILE_WIDTH + 1);
+    if (num_cols == 0) num_cols = 1;
+    for (int i = 0; i < compositor->num_tiles; i++) {
+        Tile *tile = &compositor->tiles[i];
+        if (!tile->is_dirty) continue;
+        int y = (i / num_cols) * (TILE_HEIGHT + 2);
+        int x = (i % num_cols) * (TILE_WIDTH + 1);
+        // Tiles that don't fit in the window aren't shown
+        if (y + TILE_HEIGHT + 1 > win_h || x + TILE_WIDTH > win_w) continue;
+        draw_tile(tile, y, x);
+    }
+    refresh();
+    compositor->last_present = now;
+    return true;
+}
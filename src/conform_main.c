@@ -0,0 +1,320 @@
+#include <config.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "debugger.h"
+
+#define MAX_LINE_SIZE 512
+#define MAX_PATH_SIZE 4096
+#define MAX_KEY_CHANGES 32
+#define MAX_THREADS 256
+#define NO_HASH "-"
+
+typedef enum { PASSED, FAILED, NO_GOLDEN, MISSING_ROM, BAD_ROM } Status;
+
+typedef struct {
+    unsigned long frame;
+    unsigned short keys;
+} KeyChange;
+
+typedef struct {
+    int line;          /**< Line of the manifest (from 0) */
+    char rom[MAX_LINE_SIZE];
+    bool has_superchip8_quirks;
+    unsigned long num_frames;
+    bool has_poke;
+    unsigned short poke_addr;
+    unsigned char poke_value;
+    KeyChange keys[MAX_KEY_CHANGES];
+    int num_keys;
+    char known[MAX_LINE_SIZE]; /**< Known failure it shows, or "-" */
+    char golden[MAX_LINE_SIZE];
+    Status status;
+    unsigned int hash;
+    const char *error;
+} Run;
+
+char **lines = NULL;
+int num_lines = 0;
+Run *runs = NULL;
+int num_runs = 0;
+const char *rom_dir = ".";
+
+int next_run = 0;
+pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parses "frame=keys,frame=keys" (keys in hex)
+int parse_keys(Run *run, char *script) {
+    if (strcmp(script, "-") == 0) return 0;
+    for (char *item = strtok(script, ","); item != NULL;
+         item = strtok(NULL, ",")) {
+        unsigned long frame;
+        unsigned int keys;
+        if (run->num_keys == MAX_KEY_CHANGES ||
+            sscanf(item, "%lu=%x", &frame, &keys) != 2 || keys > 0xffff) {
+            return 1;
+        }
+        run->keys[run->num_keys].frame = frame;
+        run->keys[run->num_keys].keys = keys;
+        run->num_keys++;
+    }
+    return 0;
+}
+
+int parse_run(Run *run, const char *line) {
+    char profile[MAX_LINE_SIZE], poke[MAX_LINE_SIZE], keys[MAX_LINE_SIZE];
+    if (sscanf(line, "%s %s %lu %s %s %s %s", run->rom, profile,
+               &run->num_frames, poke, keys, run->known, run->golden) != 7) {
+        return 1;
+    }
+    if (strcmp(profile, "schip") == 0)
+        run->has_superchip8_quirks = true;
+    else if (strcmp(profile, "chip8") != 0)
+        return 1;
+
+    unsigned int addr, value;
+    if (strcmp(poke, "-") != 0) {
+        if (sscanf(poke, "%x=%x", &addr, &value) != 2 ||
+            addr >= SIZE_MEMORY || value > 0xff) {
+            return 1;
+        }
+        run->has_poke = true;
+        run->poke_addr = addr;
+        run->poke_value = value;
+    }
+    return parse_keys(run, keys);
+}
+
+int read_manifest(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Error opening %s.\n", path);
+        return 1;
+    }
+    char line[MAX_LINE_SIZE];
+    int ret = 0;
+    while (ret == 0 && fgets(line, MAX_LINE_SIZE, file) != NULL) {
+        lines = realloc(lines, (num_lines + 1) * sizeof(char *));
+        runs = realloc(runs, (num_runs + 1) * sizeof(Run));
+        if (lines == NULL || runs == NULL) {
+            ret = 1;
+            break;
+        }
+        lines[num_lines] = strdup(line);
+        char *start = line + strspn(line, " \t");
+        if (*start != '#' && *start != '\n' && *start != '\0') {
+            Run *run = &runs[num_runs];
+            memset(run, 0, sizeof(Run));
+            run->line = num_lines;
+            if (parse_run(run, start) == 1) {
+                printf("%s:%d: bad line\n", path, num_lines + 1);
+                ret = 1;
+            }
+            num_runs++;
+        }
+        num_lines++;
+    }
+    fclose(file);
+    return ret;
+}
+
+// Runs a test rom headless, with the keys of its script
+void conform(Run *run) {
+    char path[MAX_PATH_SIZE];
+    snprintf(path, MAX_PATH_SIZE, "%s/%s", rom_dir, run->rom);
+    if (access(path, R_OK) == -1) {
+        run->status = MISSING_ROM;
+        return;
+    }
+    init_chip8();
+    set_error(NULL);
+    if (run->has_superchip8_quirks) set_superchip8_quirks();
+    if (load_program(path) == 1) {
+        run->status = BAD_ROM;
+        return;
+    }
+    if (run->has_poke) {
+        unsigned char *byte = write_mem(run->poke_addr);
+        if (byte == NULL) {
+            run->status = BAD_ROM;
+            return;
+        }
+        *byte = run->poke_value;
+    }
+
+    long cycle_budget = 0;
+    unsigned short keys = 0;
+    int next_keys = 0;
+    Flag flag = IDLE;
+    for (unsigned long i = 0; i < run->num_frames && flag != EXIT; i++) {
+        while (next_keys < run->num_keys && run->keys[next_keys].frame <= i) {
+            keys = run->keys[next_keys++].keys;
+        }
+        flag = run_frame(keys, next_frame_cycles(DEFAULT_TICK_SPEED,
+                                                 &cycle_budget));
+    }
+    run->error = get_error();
+    run->hash = hash_bytes(get_video_mem(), SIZE_VIDEO_MEM);
+
+    char hash[16];
+    snprintf(hash, sizeof(hash), "%08x", run->hash);
+    if (strcmp(run->golden, NO_HASH) == 0)
+        run->status = NO_GOLDEN;
+    else
+        run->status = (strcmp(run->golden, hash) == 0) ? PASSED : FAILED;
+}
+
+void *run_worker(void *arg) {
+    Chip8 machine = {0};
+    set_machine(&machine);
+    while (true) {
+        pthread_mutex_lock(&run_lock);
+        int i = next_run++;
+        pthread_mutex_unlock(&run_lock);
+        if (i >= num_runs) break;
+        conform(&runs[i]);
+    }
+    free_machine(&machine);
+    return NULL;
+}
+
+// Prints the results in the Test Anything Protocol. Only the runs that match
+// their golden hash pass, a missing rom or hash doesn't check anything. Runs of
+// a known failure are TODO tests, they only count if their rom didn't load.
+int print_results() {
+    int num_failed = 0;
+    printf("1..%d\n", num_runs);
+    for (int i = 0; i < num_runs; i++) {
+        Run *run = &runs[i];
+        const char *profile = (run->has_superchip8_quirks) ? "schip" : "chip8";
+        bool is_ok = run->status == PASSED;
+        bool is_known = strcmp(run->known, "-") != 0;
+        printf("%s %d - %s %s line %d # ", is_ok ? "ok" : "not ok", i + 1,
+               run->rom, profile, run->line + 1);
+        if (is_known) printf("TODO known failure %s, ", run->known);
+        switch (run->status) {
+            case PASSED:
+                printf("%08x\n", run->hash);
+                break;
+            case FAILED:
+                printf("expected %s, got %08x%s%s\n", run->golden, run->hash,
+                       (run->error != NULL) ? ", crashed: " : "",
+                       (run->error != NULL) ? run->error : "");
+                break;
+            case NO_GOLDEN:
+                printf("no golden hash, got %08x\n", run->hash);
+                break;
+            case MISSING_ROM:
+                printf("%s not found in %s\n", run->rom, rom_dir);
+                break;
+            case BAD_ROM:
+                printf("couldn't load the rom\n");
+                break;
+        }
+        bool has_run = run->status != MISSING_ROM && run->status != BAD_ROM;
+        if (!is_ok && !(is_known && has_run)) num_failed++;
+    }
+    return num_failed;
+}
+
+// Writes the hash of every run that ran into the manifest
+int update_manifest(const char *path) {
+    for (int i = 0; i < num_runs; i++) {
+        Run *run = &runs[i];
+        if (run->status != PASSED && run->status != FAILED &&
+            run->status != NO_GOLDEN) {
+            continue;
+        }
+        char *line = lines[run->line];
+        // The hash is the last field, so it's the last match on the line
+        char *golden = NULL;
+        for (char *p = line; (p = strstr(p, run->golden)) != NULL; p++) {
+            golden = p;
+        }
+        char updated[MAX_LINE_SIZE];
+        snprintf(updated, MAX_LINE_SIZE, "%.*s%08x%s", (int)(golden - line),
+                 line, run->hash, golden + strlen(run->golden));
+        free(line);
+        lines[run->line] = strdup(updated);
+    }
+
+    char tmp_path[MAX_PATH_SIZE];
+    snprintf(tmp_path, MAX_PATH_SIZE, "%s.tmp", path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) return 1;
+    for (int i = 0; i < num_lines; i++) fputs(lines[i], file);
+    if (fclose(file) != 0 || rename(tmp_path, path) == -1) return 1;
+    return 0;
+}
+
+void print_help() {
+    printf("Usage: ./chip8_conform [-hu] [-j <threads>] [-d <rom_dir>] "
+           "<manifest>\n\n");
+    printf("Runs the test roms of a manifest and compares their final "
+           "framebuffers\nwith its golden hashes (output in TAP).\n");
+    printf("Options:\n");
+    printf(" -d <rom_dir>  Directory of the test roms (default .)\n");
+    printf(" -j <threads>  Number of threads (default: one per core)\n");
+    printf(" -u            Record the hashes of this build in the manifest\n");
+    printf(" -h            Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool should_update = false;
+
+    char c;
+    while ((c = getopt(argc, argv, "d:j:uh")) != -1) {
+        switch (c) {
+            case 'd':
+                rom_dir = optarg;
+                break;
+            case 'j':
+                num_threads = atoi(optarg);
+                break;
+            case 'u':
+                should_update = true;
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if (argc - 1 != optind) {
+        print_help();
+        return 1;
+    }
+    const char *manifest_path = argv[optind];
+    if (read_manifest(manifest_path) == 1) return 1;
+
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    if (num_threads > num_runs) num_threads = (num_runs > 0) ? num_runs : 1;
+    pthread_t threads[MAX_THREADS];
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, run_worker, NULL) != 0) {
+            printf("Error starting threads.\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+
+    int num_failed = print_results();
+    if (should_update) {
+        if (update_manifest(manifest_path) == 1) {
+            printf("Error updating %s.\n", manifest_path);
+            return 1;
+        }
+        return 0;
+    }
+    return (num_failed > 0) ? 1 : 0;
+}
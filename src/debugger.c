@@ -4,12 +4,14 @@
 #include <stdio.h>
 
 #include "chip8.h"
+#include "probes.h"
 
 #define ANSI_COLOR_RED "\x1b[31m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
 bool debug = false;
-const char *err_msg = NULL;
+// Separate for every thread, like the machine that crashed
+_Thread_local const char *err_msg = NULL;
 
 void set_debug() { debug = true; }
 
@@ -75,8 +77,11 @@ void print_memory(unsigned char *memory, unsigned short pc) {
 
 void set_error(const char *new_err_msg) {
     err_msg = new_err_msg;
+    CHIP8_PROBE1(error, new_err_msg);
 }
 
+const char *get_error() { return err_msg; }
+
 void print_error() {
     if (err_msg == NULL) return;
     printf("[CRASH] %s\n", err_msg);
@@ -0,0 +1,525 @@
+#include <config.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "dasm.h"
+#include "debugger.h"
+#include "lockstep.h"
+
+#define DEFAULT_NUM_FRAMES 600
+#define DEFAULT_FUZZ_PATH "chip8_diff.ch8"
+#define MAX_MEMORY_DIFFS 16
+// Frames a random key stays down (or up), long enough for LD Vx, K
+#define KEY_HOLD_FRAMES 8
+
+/**
+ * An engine checked against the interpreter. It runs the same program on
+ * every lane, lane i seeded with seeds[i], and must end every frame in the
+ * state `run_frame()` leaves a machine in.
+ */
+typedef struct {
+    const char *name;
+    int (*init)(const char *program_path, bool has_quirks, int num_lanes,
+                const unsigned long long *seeds);
+    void (*run_frame)(const unsigned short *keys, long num_cycles,
+                      Flag *flags);
+    Chip8 *(*get_lane)(int lane);
+    void (*free)();
+} Engine;
+
+Lockstep lanes;
+
+int init_lockstep_engine(const char *program_path, bool has_quirks,
+                         int num_lanes, const unsigned long long *seeds) {
+    return init_lockstep(&lanes, num_lanes, program_path, has_quirks, seeds);
+}
+
+void run_lockstep_engine(const unsigned short *keys, long num_cycles,
+                         Flag *flags) {
+    run_lockstep_frame(&lanes, keys, num_cycles, flags);
+}
+
+Chip8 *get_lockstep_lane(int lane) { return get_lane_machine(&lanes, lane); }
+
+void free_lockstep_engine() { free_lockstep(&lanes); }
+
+const Engine engines[] = {
+    {"lockstep", init_lockstep_engine, run_lockstep_engine, get_lockstep_lane,
+     free_lockstep_engine},
+};
+#define NUM_ENGINES (sizeof(engines) / sizeof(Engine))
+
+const Engine *engine = &engines[0];
+bool has_quirks = false;
+int tick_speed = DEFAULT_TICK_SPEED;
+unsigned long max_frames = DEFAULT_NUM_FRAMES;
+unsigned long long seed = 0;
+int num_lanes = 1;
+bool has_random_keys = false;
+unsigned long long key_seed = 0;
+
+// Reference machines, one per lane
+Chip8 *machines = NULL;
+unsigned long long *seeds = NULL;
+unsigned short *keys = NULL;
+Flag *flags = NULL;
+
+unsigned long long next_fuzz_random(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Keys of every lane in a frame, held for KEY_HOLD_FRAMES frames
+unsigned short get_frame_keys(unsigned long frame) {
+    if (!has_random_keys) return 0;
+    unsigned long long state[2] = {key_seed, frame / KEY_HOLD_FRAMES};
+    unsigned long long random = hash_bytes(state, sizeof(state)) | 1;
+    random = next_fuzz_random(&random);
+    return (random % 4 == 0) ? 1 << (random >> 8) % 16 : 0;
+}
+
+int start_machines(const char *program_path) {
+    for (int i = 0; i < num_lanes; i++) {
+        set_machine(&machines[i]);
+        init_chip8();
+        if (has_quirks) set_superchip8_quirks();
+        seed_random(seeds[i]);
+        if (load_program(program_path) == 1) return 1;
+        flags[i] = IDLE;
+    }
+    if (engine->init(program_path, has_quirks, num_lanes, seeds) == 1) {
+        printf("Error starting %s on %s.\n", engine->name, program_path);
+        return 1;
+    }
+    return 0;
+}
+
+void free_machines() {
+    for (int i = 0; i < num_lanes; i++) free_machine(&machines[i]);
+    engine->free();
+}
+
+// Runs a frame of every reference machine and of the engine, is_running[i]
+// gets false after lane i exited
+void run_both_frames(unsigned long frame, long num_cycles, bool *is_running,
+                     Flag *engine_flags) {
+    for (int i = 0; i < num_lanes; i++) keys[i] = get_frame_keys(frame);
+    for (int i = 0; i < num_lanes; i++) {
+        if (!is_running[i]) continue;
+        set_machine(&machines[i]);
+        flags[i] = run_frame(keys[i], num_cycles);
+        if (flags[i] == EXIT) is_running[i] = false;
+    }
+    engine->run_frame(keys, num_cycles, engine_flags);
+}
+
+#define DIFF_FIELD(field, format)                                      \
+    if (a->field != b->field) {                                        \
+        if (should_print)                                              \
+            printf("%-12s " format "  " format "\n", #field, a->field, \
+                   b->field);                                          \
+        num_diffs++;                                                   \
+    }
+
+// Compares two machines, printing the fields that differ
+int diff_machines(Chip8 *a, Chip8 *b, bool should_print) {
+    int num_diffs = 0;
+    char name[16];
+    for (int i = 0; i < 16; i++) {
+        sprintf(name, "V%X", i);
+        if (a->V[i] != b->V[i]) {
+            if (should_print)
+                printf("%-12s %02x  %02x\n", name, a->V[i], b->V[i]);
+            num_diffs++;
+        }
+    }
+    for (int i = 0; i < 16; i++) {
+        sprintf(name, "flags[%d]", i);
+        if (a->flags[i] != b->flags[i]) {
+            if (should_print)
+                printf("%-12s %02x  %02x\n", name, a->flags[i], b->flags[i]);
+            num_diffs++;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        sprintf(name, "random[%d]", i);
+        if (a->random[i] != b->random[i]) {
+            if (should_print)
+                printf("%-12s %08x  %08x\n", name, a->random[i],
+                       b->random[i]);
+            num_diffs++;
+        }
+    }
+    DIFF_FIELD(pc, "%04x");
+    DIFF_FIELD(I, "%04x");
+    DIFF_FIELD(sp, "%02x");
+    DIFF_FIELD(dt, "%02x");
+    DIFF_FIELD(st, "%02x");
+    DIFF_FIELD(hi_res, "%d");
+    DIFF_FIELD(clock, "%d");
+    DIFF_FIELD(opcode, "%04x");
+    DIFF_FIELD(skip_reg, "%x");
+    DIFF_FIELD(skip_is_equal, "%d");
+    DIFF_FIELD(load_reg, "%x");
+    DIFF_FIELD(is_waiting, "%d");
+    DIFF_FIELD(pressed_keys, "%04x");
+    DIFF_FIELD(cycles, "%lu");
+
+    // The video buffer is compared as part of the memory
+    static unsigned char state_a[STATE_SIZE], state_b[STATE_SIZE];
+    Chip8 *previous = get_machine();
+    set_machine(a);
+    export_state(state_a);
+    set_machine(b);
+    export_state(state_b);
+    set_machine(previous);
+    const unsigned char *memory_a = state_a + STATE_REGISTERS_SIZE;
+    const unsigned char *memory_b = state_b + STATE_REGISTERS_SIZE;
+    int num_memory_diffs = 0;
+    for (int i = 0; i < SIZE_MEMORY; i++) {
+        if (memory_a[i] == memory_b[i]) continue;
+        if (should_print && num_memory_diffs < MAX_MEMORY_DIFFS)
+            printf("mem[%03x]     %02x  %02x\n", i, memory_a[i], memory_b[i]);
+        num_memory_diffs++;
+    }
+    if (should_print && num_memory_diffs > MAX_MEMORY_DIFFS)
+        printf("... %d more bytes of memory\n",
+               num_memory_diffs - MAX_MEMORY_DIFFS);
+    return num_diffs + num_memory_diffs;
+}
+
+// Runs everything again up to the frame that diverged, then that frame for
+// only num_cycles cycles, and compares the lane (reference gets a copy of
+// its interpreter machine)
+int diff_after_cycles(const char *program_path, int lane,
+                      unsigned long frame, long num_cycles, Chip8 *reference) {
+    bool *is_running = malloc(num_lanes * sizeof(bool));
+    Flag *engine_flags = malloc(num_lanes * sizeof(Flag));
+    int num_diffs = -1;
+    free_machines();
+    if (is_running == NULL || engine_flags == NULL ||
+        start_machines(program_path) == 1) {
+        free(is_running);
+        free(engine_flags);
+        return num_diffs;
+    }
+    for (int i = 0; i < num_lanes; i++) is_running[i] = true;
+
+    long cycle_budget = 0;
+    for (unsigned long i = 0; i < frame; i++) {
+        run_both_frames(i, next_frame_cycles(tick_speed, &cycle_budget),
+                        is_running, engine_flags);
+    }
+    for (int i = 0; i < num_lanes; i++) keys[i] = get_frame_keys(frame);
+    set_machine(&machines[lane]);
+    run_frame(keys[lane], num_cycles);
+    engine->run_frame(keys, num_cycles, engine_flags);
+    if (copy_machine(reference, &machines[lane]) == 0) {
+        num_diffs =
+            diff_machines(&machines[lane], engine->get_lane(lane), false);
+    }
+    free(is_running);
+    free(engine_flags);
+    return num_diffs;
+}
+
+void print_instruction(const char *label, Chip8 *machine) {
+    // In the middle of an instruction, the opcode was fetched already
+    unsigned short pc = machine->pc;
+    unsigned short opcode = machine->opcode;
+    if (machine->clock == 0) {
+        Chip8 *previous = get_machine();
+        set_machine(machine);
+        opcode = read_mem(pc) << 8 | read_mem(pc + 1);
+        set_machine(previous);
+    } else {
+        pc -= 2;
+    }
+    AsmStatement statement = {0};
+    decode_dasm(&statement, opcode, has_quirks);
+    printf("%s %03x: %04x  %s", label, pc, opcode, statement.name);
+    for (int i = 0; i < statement.num_args; i++) {
+        printf("%s %s", (i == 0) ? "" : ",", statement.args[i]);
+    }
+    printf(" (cycle %d of 3)\n", machine->clock + 1);
+}
+
+// Narrows a divergence down to the cycle and prints what differs there
+void report_divergence(const char *program_path, int lane,
+                       unsigned long frame, long frame_cycles) {
+    // Bisects the frame: the lane is the same after lo cycles, but not
+    // after hi cycles
+    long lo = 0, hi = frame_cycles;
+    Chip8 reference = {0};
+    while (hi - lo > 1) {
+        long mid = lo + (hi - lo) / 2;
+        int num_diffs =
+            diff_after_cycles(program_path, lane, frame, mid, &reference);
+        if (num_diffs < 0) {
+            printf("Error running %s again.\n", program_path);
+            return;
+        }
+        if (num_diffs == 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (diff_after_cycles(program_path, lane, frame, lo, &reference) < 0) {
+        printf("Error running %s again.\n", program_path);
+        return;
+    }
+
+    printf("%s diverged from the interpreter on lane %d (seed %llu)\n",
+           engine->name, lane, seeds[lane]);
+    printf("frame %lu, cycle %ld of %ld in the frame\n", frame, hi,
+           frame_cycles);
+    print_instruction("instruction", &reference);
+    diff_after_cycles(program_path, lane, frame, hi, &reference);
+    printf("%-12s %-4s  %s\n", "", "interpreter", engine->name);
+    diff_machines(&machines[lane], engine->get_lane(lane), true);
+    free_machine(&reference);
+}
+
+// Runs the program on the interpreter and the engine, returns 1 if they
+// diverged
+int diff_program(const char *program_path, bool should_report) {
+    bool *is_running = malloc(num_lanes * sizeof(bool));
+    Flag *engine_flags = malloc(num_lanes * sizeof(Flag));
+    if (is_running == NULL || engine_flags == NULL) return 1;
+    for (int i = 0; i < num_lanes; i++) is_running[i] = true;
+    if (start_machines(program_path) == 1) {
+        free(is_running);
+        free(engine_flags);
+        return 1;
+    }
+
+    int diverged_lane = -1;
+    unsigned long frame = 0;
+    long num_cycles = 0;
+    long cycle_budget = 0;
+    int num_running = num_lanes;
+    for (; frame < max_frames && num_running > 0; frame++) {
+        num_cycles = next_frame_cycles(tick_speed, &cycle_budget);
+        run_both_frames(frame, num_cycles, is_running, engine_flags);
+        num_running = 0;
+        for (int i = 0; i < num_lanes && diverged_lane == -1; i++) {
+            if (is_running[i]) num_running++;
+            if ((flags[i] == EXIT) != (engine_flags[i] == EXIT) ||
+                diff_machines(&machines[i], engine->get_lane(i), false) !=
+                    0) {
+                diverged_lane = i;
+            }
+        }
+        if (diverged_lane != -1) break;
+    }
+
+    if (diverged_lane != -1 && should_report) {
+        if (flags[diverged_lane] == EXIT ||
+            engine_flags[diverged_lane] == EXIT) {
+            printf("%s exited on lane %d in frame %lu\n",
+                   (flags[diverged_lane] == EXIT) ? "interpreter"
+                                                  : engine->name,
+                   diverged_lane, frame);
+        }
+        report_divergence(program_path, diverged_lane, frame, num_cycles);
+    } else if (diverged_lane == -1 && should_report) {
+        unsigned long instructions = 0;
+        for (int i = 0; i < num_lanes; i++) {
+            instructions += machines[i].cycles / 3;
+        }
+        printf("%s matches the interpreter: %d lanes, %lu frames, %lu "
+               "instructions\n",
+               engine->name, num_lanes, frame, instructions);
+    }
+    free_machines();
+    free(is_running);
+    free(engine_flags);
+    return (diverged_lane != -1) ? 1 : 0;
+}
+
+// Writes a random program that mostly runs valid instructions, with jumps
+// and calls into itself
+int write_random_program(const char *path, unsigned long long *state) {
+    static const unsigned char zero_ops[] = {0xe0, 0xee, 0xfb, 0xfc,
+                                             0xfe, 0xff, 0xc1, 0xc4};
+    static const unsigned char eight_ops[] = {0, 1, 2, 3, 4, 5, 6, 7, 0xe};
+    static const unsigned char f_ops[] = {0x07, 0x0a, 0x15, 0x18,
+                                          0x1e, 0x29, 0x30, 0x33,
+                                          0x55, 0x65, 0x75, 0x85};
+    size_t size = 64 + next_fuzz_random(state) % 448;
+    size -= size % 2;
+    unsigned char program[512];
+    for (size_t i = 0; i < size; i += 2) {
+        unsigned long long r = next_fuzz_random(state);
+        unsigned short addr = PROGRAM_START + (r >> 16) % size;
+        unsigned short opcode = r & 0xffff;
+        switch (opcode >> 12) {
+            case 0:
+                opcode = zero_ops[(r >> 32) % sizeof(zero_ops)];
+                break;
+            case 1:
+            case 2:
+            case 0xa:
+            case 0xb:
+                opcode = (opcode & 0xf000) | (addr & 0x0ffe);
+                break;
+            case 5:
+            case 9:
+                opcode &= 0xfff0;
+                break;
+            case 8:
+                opcode = (opcode & 0xfff0) |
+                         eight_ops[(r >> 32) % sizeof(eight_ops)];
+                break;
+            case 0xe:
+                opcode = (opcode & 0xff00) | (((r >> 32) % 2) ? 0x9e : 0xa1);
+                break;
+            case 0xf:
+                opcode = (opcode & 0xff00) | f_ops[(r >> 32) % sizeof(f_ops)];
+                break;
+        }
+        program[i] = opcode >> 8;
+        program[i + 1] = opcode & 0xff;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return 1;
+    size_t written = fwrite(program, 1, size, file);
+    if (fclose(file) != 0 || written != size) return 1;
+    return 0;
+}
+
+// Checks random programs until one diverges, that one is kept at path
+int fuzz(unsigned long num_programs, const char *path) {
+    unsigned long long state = seed * 2 + 1;
+    unsigned long long first_seed = seed;
+    for (unsigned long i = 0; i < num_programs; i++) {
+        if (write_random_program(path, &state) == 1) {
+            printf("Error writing %s.\n", path);
+            return 1;
+        }
+        for (int j = 0; j < num_lanes; j++) seeds[j] = first_seed + i + j;
+        key_seed = first_seed + i;
+        if (diff_program(path, false) == 1) {
+            printf("program %lu diverged, kept in %s\n", i, path);
+            diff_program(path, true);
+            return 1;
+        }
+    }
+    printf("%s matches the interpreter on %lu random programs\n",
+           engine->name, num_programs);
+    remove(path);
+    return 0;
+}
+
+void print_help() {
+    printf("Usage: ./chip8_diff [-hk] [-e <engine>] [-q <quirks>] "
+           "[-t <tick_speed>] [-f <frames>] [-S <seed>] [-L <lanes>] "
+           "<program_path>\n"
+           "       ./chip8_diff -z <programs> [-o <program_path>] [options]"
+           "\n\n");
+    printf("Runs a program on the interpreter and on a faster engine, and "
+           "stops at the\nfirst frame where their machines differ.\n");
+    printf("Options:\n");
+    printf(" -e <engine>        Engine to check (default lockstep)\n");
+    printf(" -q <quirks>        Quirk profile: chip8 (default) or schip\n");
+    printf(" -t <tick_speed>    Set tick speed (default 900)\n");
+    printf(" -f <frames>        Stop after this many frames (default 600)\n");
+    printf(" -S <seed>          Seed of the first lane (default 0)\n");
+    printf(" -L <lanes>         Number of lanes, seeded <seed>, <seed> + 1, "
+           "...\n");
+    printf(" -k                 Press random keys (seeded with <seed>)\n");
+    printf(" -z <programs>      Check this many random programs, with random "
+           "keys\n");
+    printf(" -o <program_path>  Where the random program is written (default "
+           DEFAULT_FUZZ_PATH ")\n");
+    printf(" -h                 Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long num_programs = 0;
+    const char *fuzz_path = DEFAULT_FUZZ_PATH;
+
+    char c;
+    while ((c = getopt(argc, argv, "e:q:t:f:S:L:kz:o:h")) != -1) {
+        switch (c) {
+            case 'e':
+                engine = NULL;
+                for (int i = 0; i < NUM_ENGINES; i++) {
+                    if (strcmp(engines[i].name, optarg) == 0)
+                        engine = &engines[i];
+                }
+                if (engine == NULL) {
+                    printf("Unknown engine %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'q':
+                if (strcmp(optarg, "schip") == 0) {
+                    has_quirks = true;
+                } else if (strcmp(optarg, "chip8") != 0) {
+                    printf("Unknown quirk profile %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                tick_speed = atoi(optarg);
+                if (tick_speed == 0) tick_speed = DEFAULT_TICK_SPEED;
+                break;
+            case 'f':
+                max_frames = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'L':
+                num_lanes = atoi(optarg);
+                if (num_lanes < 1) {
+                    printf("Bad number of lanes %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                has_random_keys = true;
+                break;
+            case 'z':
+                num_programs = strtoul(optarg, NULL, 10);
+                has_random_keys = true;
+                break;
+            case 'o':
+                fuzz_path = optarg;
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if ((num_programs == 0) == (argc - 1 != optind)) {
+        print_help();
+        return 1;
+    }
+
+    machines = calloc(num_lanes, sizeof(Chip8));
+    seeds = malloc(num_lanes * sizeof(*seeds));
+    keys = calloc(num_lanes, sizeof(*keys));
+    flags = malloc(num_lanes * sizeof(*flags));
+    if (machines == NULL || seeds == NULL || keys == NULL || flags == NULL) {
+        printf("Error allocating %d lanes.\n", num_lanes);
+        return 1;
+    }
+    if (num_programs > 0) return fuzz(num_programs, fuzz_path);
+
+    for (int i = 0; i < num_lanes; i++) seeds[i] = seed + i;
+    key_seed = seed;
+    return diff_program(argv[optind], true);
+}
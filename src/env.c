@@ -0,0 +1,192 @@
+#include "env.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+// Environments a thread takes at once, per thread
+#define CHUNKS_PER_THREAD 8
+
+void copy_env_memory(Env *env, int index) {
+    unsigned short size = env->config.memory_size;
+    unsigned char *memory = env->memory + (size_t)index * size;
+    for (int i = 0; i < size; i++) {
+        memory[i] = read_mem(env->config.memory_addr + i);
+    }
+}
+
+void step_one_env(Env *env, int index) {
+    if (env->flags[index] == EXIT) return;
+    set_machine(&env->machines[index]);
+    Flag flag = IDLE;
+    for (int i = 0; i < env->num_frames && flag != EXIT; i++) {
+        long num_cycles = next_frame_cycles(env->config.tick_speed,
+                                            &env->cycle_budgets[index]);
+        flag = run_frame(env->actions[index], num_cycles);
+    }
+    env->flags[index] = flag;
+    copy_env_memory(env, index);
+}
+
+// Takes chunks of environments until every one of them got stepped
+void run_env_chunks(Env *env) {
+    int num_envs = env->config.num_envs;
+    int chunk = num_envs / (env->config.num_threads * CHUNKS_PER_THREAD);
+    if (chunk < 1) chunk = 1;
+    while (true) {
+        pthread_mutex_lock(&env->lock);
+        int first = env->next_env;
+        env->next_env += chunk;
+        pthread_mutex_unlock(&env->lock);
+        if (first >= num_envs) return;
+        int last = (first + chunk < num_envs) ? first + chunk : num_envs;
+        for (int i = first; i < last; i++) step_one_env(env, i);
+    }
+}
+
+void *run_env_thread(void *arg) {
+    Env *env = arg;
+    unsigned long generation = 0;
+    while (true) {
+        pthread_mutex_lock(&env->lock);
+        while (env->generation == generation && !env->is_stopping) {
+            pthread_cond_wait(&env->start_cond, &env->lock);
+        }
+        generation = env->generation;
+        bool is_stopping = env->is_stopping;
+        pthread_mutex_unlock(&env->lock);
+        if (is_stopping) return NULL;
+
+        run_env_chunks(env);
+        pthread_mutex_lock(&env->lock);
+        if (--env->num_busy == 0) pthread_cond_signal(&env->done_cond);
+        pthread_mutex_unlock(&env->lock);
+    }
+}
+
+int init_env(Env *env, const char *program_path, const EnvConfig *config) {
+    memset(env, 0, sizeof(Env));
+    pthread_mutex_init(&env->lock, NULL);
+    pthread_cond_init(&env->start_cond, NULL);
+    pthread_cond_init(&env->done_cond, NULL);
+    env->config = *config;
+    EnvConfig *c = &env->config;
+    if (c->num_envs < 1) {
+        free_env(env);
+        return 1;
+    }
+    if (c->num_threads < 1) c->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (c->num_threads > c->num_envs) c->num_threads = c->num_envs;
+    if (c->num_threads < 1) c->num_threads = 1;
+    if (c->tick_speed == 0) c->tick_speed = DEFAULT_TICK_SPEED;
+
+    int n = c->num_envs;
+    env->machines = calloc(n, sizeof(Chip8));
+    env->cycle_budgets = calloc(n, sizeof(long));
+    env->observations = calloc(n, sizeof(unsigned char *));
+    env->memory = calloc((size_t)n * c->memory_size + 1, 1);
+    env->flags = calloc(n, sizeof(Flag));
+    env->reset_state = malloc(STATE_SIZE);
+    env->threads = calloc(c->num_threads, sizeof(pthread_t));
+    if (env->machines == NULL || env->cycle_budgets == NULL ||
+        env->observations == NULL || env->memory == NULL ||
+        env->flags == NULL || env->reset_state == NULL ||
+        env->threads == NULL) {
+        free_env(env);
+        return 1;
+    }
+
+    // The program gets loaded once, the other environments share its image
+    Chip8 *previous = get_machine();
+    set_machine(&env->machines[0]);
+    init_chip8();
+    if (c->has_superchip8_quirks) set_superchip8_quirks();
+    int ret = load_program(program_path);
+    if (ret == 0) export_state(env->reset_state);
+    for (int i = 0; i < n && ret == 0; i++) {
+        if (i != 0) ret = copy_machine(&env->machines[i], &env->machines[0]);
+        set_machine(&env->machines[i]);
+        // So that stepping and resetting never allocate or free a page
+        if (ret == 0) ret = keep_pages();
+        seed_random(c->seed + i);
+        env->observations[i] = env->machines[i].video_mem;
+        env->flags[i] = IDLE;
+        copy_env_memory(env, i);
+    }
+    set_machine(previous);
+    if (ret == 1) {
+        free_env(env);
+        return 1;
+    }
+
+    // The calling thread is the first thread of the pool
+    for (int i = 1; i < c->num_threads; i++) {
+        if (pthread_create(&env->threads[i], NULL, run_env_thread, env) !=
+            0) {
+            free_env(env);
+            return 1;
+        }
+        env->num_workers++;
+    }
+    return 0;
+}
+
+void step_env(Env *env, const unsigned short *actions, int num_frames) {
+    Chip8 *previous = get_machine();
+    pthread_mutex_lock(&env->lock);
+    env->actions = actions;
+    env->num_frames = num_frames;
+    env->next_env = 0;
+    env->num_busy = env->config.num_threads - 1;
+    env->generation++;
+    pthread_cond_broadcast(&env->start_cond);
+    pthread_mutex_unlock(&env->lock);
+
+    run_env_chunks(env);
+    pthread_mutex_lock(&env->lock);
+    while (env->num_busy > 0) pthread_cond_wait(&env->done_cond, &env->lock);
+    pthread_mutex_unlock(&env->lock);
+    set_machine(previous);
+}
+
+int reset_env(Env *env, int index, unsigned long long seed) {
+    Chip8 *previous = get_machine();
+    set_machine(&env->machines[index]);
+    int ret = restore_state(env->reset_state);
+    seed_random(seed);
+    env->cycle_budgets[index] = 0;
+    env->flags[index] = (ret == 0) ? IDLE : EXIT;
+    copy_env_memory(env, index);
+    set_machine(previous);
+    return ret;
+}
+
+void free_env(Env *env) {
+    pthread_mutex_lock(&env->lock);
+    env->is_stopping = true;
+    pthread_cond_broadcast(&env->start_cond);
+    pthread_mutex_unlock(&env->lock);
+    for (int i = 1; i <= env->num_workers; i++) {
+        pthread_join(env->threads[i], NULL);
+    }
+    if (env->machines != NULL) {
+        for (int i = 0; i < env->config.num_envs; i++) {
+            free_machine(&env->machines[i]);
+        }
+    }
+    free(env->machines);
+    free(env->cycle_budgets);
+    free(env->observations);
+    free(env->memory);
+    free(env->flags);
+    free(env->reset_state);
+    free(env->threads);
+    pthread_mutex_destroy(&env->lock);
+    pthread_cond_destroy(&env->start_cond);
+    pthread_cond_destroy(&env->done_cond);
+    memset(env, 0, sizeof(Env));
+}
@@ -0,0 +1,144 @@
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "env.h"
+
+#define DEFAULT_NUM_ENVS 256
+#define DEFAULT_NUM_STEPS 600
+#define MAX_THREAD_COUNTS 16
+
+unsigned long get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Small deterministic PRNG, so every run presses the same keys
+unsigned int bench_rand(unsigned int *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Steps the environments with random keys, resetting the ones that are done
+int bench_env(const char *program_path, EnvConfig *config, int num_steps,
+              int frames_per_step) {
+    Env env;
+    if (init_env(&env, program_path, config) == 1) {
+        printf("Error starting the environments.\n");
+        return 1;
+    }
+    unsigned short *actions = calloc(config->num_envs, sizeof(*actions));
+    if (actions == NULL) {
+        free_env(&env);
+        return 1;
+    }
+
+    unsigned int state = 2463534242u;
+    unsigned long num_resets = 0;
+    unsigned long start = get_time();
+    for (int i = 0; i < num_steps; i++) {
+        for (int j = 0; j < config->num_envs; j++) {
+            actions[j] = 1 << (bench_rand(&state) % 16);
+        }
+        step_env(&env, actions, frames_per_step);
+        for (int j = 0; j < config->num_envs; j++) {
+            if (env.flags[j] != EXIT) continue;
+            if (reset_env(&env, j, config->seed + j + num_resets++) == 1) {
+                printf("Error resetting environment %d.\n", j);
+                free(actions);
+                free_env(&env);
+                return 1;
+            }
+        }
+    }
+    double seconds = (get_time() - start) / 1000000.0;
+    if (seconds <= 0) seconds = 1e-6;
+
+    printf("%d,%d,%d,%.1f,%.0f,%lu\n", env.config.num_threads,
+           config->num_envs, frames_per_step, num_steps / seconds,
+           num_steps * config->num_envs / seconds, num_resets);
+    free(actions);
+    free_env(&env);
+    return 0;
+}
+
+void print_help() {
+    printf(
+        "Usage: ./chip8_env_bench [-h] [-n <envs>] [-j <threads>] "
+        "[-s <steps>] [-f <frames>] [-q <quirks>] <program_path>\n");
+    printf("Options:\n");
+    printf(" -n <envs>     Number of environments (default 256)\n");
+    printf(" -j <threads>  Comma separated thread counts (default 1 and all "
+           "cores)\n");
+    printf(" -s <steps>    Steps to run (default 600)\n");
+    printf(" -f <frames>   Frames every step (default 1)\n");
+    printf(" -q <quirks>   Quirk profile: chip8 (default) or schip\n");
+    printf(" -h            Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    EnvConfig config = {0};
+    config.num_envs = DEFAULT_NUM_ENVS;
+    int num_steps = DEFAULT_NUM_STEPS;
+    int frames_per_step = 1;
+    int thread_counts[MAX_THREAD_COUNTS] = {1, 0};
+    int num_thread_counts = 2;
+
+    char c;
+    while ((c = getopt(argc, argv, "n:j:s:f:q:h")) != -1) {
+        switch (c) {
+            case 'n':
+                config.num_envs = atoi(optarg);
+                break;
+            case 'j':
+                num_thread_counts = 0;
+                for (char *item = strtok(optarg, ",");
+                     item != NULL && num_thread_counts < MAX_THREAD_COUNTS;
+                     item = strtok(NULL, ",")) {
+                    thread_counts[num_thread_counts++] = atoi(item);
+                }
+                break;
+            case 's':
+                num_steps = atoi(optarg);
+                break;
+            case 'f':
+                frames_per_step = atoi(optarg);
+                break;
+            case 'q':
+                if (strcmp(optarg, "schip") == 0) {
+                    config.has_superchip8_quirks = true;
+                } else if (strcmp(optarg, "chip8") != 0) {
+                    printf("Unknown quirk profile %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if (argc - 1 != optind || config.num_envs < 1) {
+        print_help();
+        return 1;
+    }
+
+    printf("threads,envs,frames_per_step,steps_per_s,env_steps_per_s,"
+           "resets\n");
+    for (int i = 0; i < num_thread_counts; i++) {
+        config.num_threads = thread_counts[i];
+        if (bench_env(argv[optind], &config, num_steps, frames_per_step) == 1)
+            return 1;
+    }
+    return 0;
+}
@@ -26,6 +26,8 @@
 #define DRAW_BORDER() draw_centered_border(REAL_HEIGHT + 2, REAL_WIDTH + 2)
 
 int win_h, win_w;
+// File descriptor of the terminal used for getting its size
+int term_fd = 0;
 
 void draw_border(int y, int x, int h, int w) {
     mvhline(y, x, 0, w);
@@ -103,11 +105,17 @@ void display_small_window_message() {
 
 void set_win_dimens() {
     struct winsize ws;
-    ioctl(0, TIOCGWINSZ, &ws);
+    ioctl(term_fd, TIOCGWINSZ, &ws);
     win_w = ws.ws_col;
     win_h = ws.ws_row;
 }
 
+void get_win_dimens(int *h, int *w) {
+    set_win_dimens();
+    *h = win_h;
+    *w = win_w;
+}
+
 void handle_win_size(unsigned char *video_mem, bool hi_res) {
     static int last_win_h, last_win_w;
     set_win_dimens();
@@ -128,9 +136,7 @@ void handle_win_size(unsigned char *video_mem, bool hi_res) {
     }
 }
 
-void init_graphics() {
-    setlocale(LC_CTYPE, "");
-    initscr();
+void setup_screen() {
     cbreak();
     noecho();
     nodelay(stdscr, true);
@@ -140,6 +146,19 @@ void init_graphics() {
     refresh();
 }
 
+void init_graphics() {
+    setlocale(LC_CTYPE, "");
+    initscr();
+    setup_screen();
+}
+
+void init_graphics_term(FILE *out, FILE *in) {
+    setlocale(LC_CTYPE, "");
+    newterm(NULL, out, in);
+    term_fd = fileno(out);
+    setup_screen();
+}
+
 void clear_screen() {
     clear();
     DRAW_BORDER();
@@ -175,6 +194,41 @@ void draw(unsigned char *video_mem, unsigned int video_signal, bool hi_res) {
     refresh();
 }
 
+void draw_diff(unsigned char *video_mem, unsigned char *prev_video_mem,
+               bool hi_res) {
+    int height = (hi_res) ? HEIGTH : HEIGTH / 2;
+    int num_bytes = (hi_res) ? NUM_BYTES_IN_ROW : NUM_BYTES_IN_ROW / 2;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < num_bytes; x++) {
+            int num_byte = y * NUM_BYTES_IN_ROW + x;
+            unsigned char changed =
+                video_mem[num_byte] ^ prev_video_mem[num_byte];
+            if (changed == 0) continue;
+            unsigned char curr_byte = video_mem[num_byte];
+            for (int i = 0; i < 8; i++) {
+                bool is_on = (curr_byte << i) & 0x80;
+                if (((changed << i) & 0x80) == 0) continue;
+                if (hi_res)
+                    draw_pixel_hi_res(y, x * 8 + i, is_on);
+                else
+                    draw_pixel(y, x * 8 + i, is_on);
+            }
+        }
+    }
+    refresh();
+}
+
+void draw_status_line(const char *text) {
+    int y = (win_h - (REAL_HEIGHT + 2)) / 2 + REAL_HEIGHT + 2;
+    if (y >= win_h) return;
+    move(y, 0);
+    clrtoeol();
+    if (text != NULL) {
+        mvaddnstr(y, (win_w - (REAL_WIDTH + 2)) / 2, text, REAL_WIDTH + 2);
+    }
+    refresh();
+}
+
 void draw_all(unsigned char *video_mem, bool hi_res) {
     clear_screen();
     for (int num_byte = 0; num_byte < SIZE_VIDEO_MEM; num_byte++) {
@@ -0,0 +1,72 @@
+#include "histogram.h"
+
+#include <string.h>
+
+void init_histogram(Histogram *histogram) {
+    memset(histogram, 0, sizeof(Histogram));
+}
+
+// Index of the highest bit set, value isn't 0
+int get_magnitude(unsigned long value) {
+    return 8 * sizeof(unsigned long) - 1 - __builtin_clzl(value);
+}
+
+int get_bucket(unsigned long value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) return value;
+    // The top HISTOGRAM_SUB_BITS bits of the value pick the bucket
+    int shift = get_magnitude(value) - HISTOGRAM_SUB_BITS + 1;
+    return shift * HISTOGRAM_SUB_BUCKETS + (value >> shift);
+}
+
+// Middle of the values that fall in the bucket
+unsigned long get_bucket_middle(int bucket) {
+    if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) return bucket;
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long top = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return (top << shift) + (1UL << (shift - 1));
+}
+
+void record_value(Histogram *histogram, unsigned long value) {
+    histogram->counts[get_bucket(value)]++;
+    if (histogram->count == 0 || value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+unsigned long get_percentile(const Histogram *histogram, double percentile) {
+    if (histogram->count == 0) return 0;
+    // Rank of the value, rounded up so that p100 is the last one
+    double rank = percentile / 100 * histogram->count;
+    unsigned long needed = (rank < 1) ? 1 : (unsigned long)rank;
+    if (needed < rank) needed++;
+    unsigned long seen = 0;
+    for (int i = 0; i < NUM_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen < needed) continue;
+        unsigned long middle = get_bucket_middle(i);
+        if (middle < histogram->min) return histogram->min;
+        return (middle < histogram->max) ? middle : histogram->max;
+    }
+    return histogram->max;
+}
+
+void print_histogram_header(FILE *file, const char *unit) {
+    char name[32];
+    snprintf(name, sizeof(name), "(%s)", unit);
+    fprintf(file, "%-18s %8s %9s %9s %9s %9s %9s %9s %9s\n", name, "count",
+            "min", "p50", "p90", "p99", "p99.9", "max", "mean");
+}
+
+void print_histogram(FILE *file, const char *name, const Histogram *histogram,
+                     double scale) {
+    double mean =
+        (histogram->count == 0) ? 0 : histogram->sum / histogram->count;
+    fprintf(file, "%-18s %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            name, histogram->count, histogram->min / scale,
+            get_percentile(histogram, 50) / scale,
+            get_percentile(histogram, 90) / scale,
+            get_percentile(histogram, 99) / scale,
+            get_percentile(histogram, 99.9) / scale, histogram->max / scale,
+            mean / scale);
+}
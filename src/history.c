@@ -0,0 +1,279 @@
+#include "history.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "breakpoints.h"
+#include "chip8.h"
+#include "debugger.h"
+
+#define MIN_HISTORY_EVENTS 1024
+
+typedef struct {
+    unsigned long cycles;      /**< Cycles of the machine when it was taken */
+    unsigned short keys;       /**< Keys the machine saw then */
+    unsigned long first_event; /**< First event it doesn't include */
+    unsigned char *state;      /**< STATE_SIZE bytes of `export_state()` */
+} Checkpoint;
+
+// Everything that came from outside the machine, so re-running it from a
+// checkpoint gives the same run
+typedef struct {
+    unsigned long cycles;
+    bool is_timers; /**< Timers decremented, otherwise the keys changed */
+    unsigned short keys;
+} HistoryEvent;
+
+// Sorted by cycles. Every entry owns a state buffer, the unused ones past
+// num_checkpoints too, so dropping and inserting only moves entries around
+Checkpoint checkpoints[MAX_CHECKPOINTS];
+int num_checkpoints = 0;
+unsigned char *checkpoint_states = NULL;
+// Until a replay is timed, about a millisecond
+unsigned long checkpoint_spacing = 10 * MIN_CHECKPOINT_SPACING;
+
+HistoryEvent *history_events = NULL;
+unsigned long num_events = 0;
+unsigned long max_events = 0;
+unsigned short current_keys = 0;
+char history_reason[MAX_BREAK_REASON_SIZE];
+
+unsigned long get_history_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int init_history() {
+    checkpoint_states = malloc((size_t)MAX_CHECKPOINTS * STATE_SIZE);
+    if (checkpoint_states == NULL) return 1;
+    for (int i = 0; i < MAX_CHECKPOINTS; i++) {
+        checkpoints[i].state = checkpoint_states + (size_t)i * STATE_SIZE;
+    }
+    return 0;
+}
+
+void stop_history() {
+    free(checkpoint_states);
+    checkpoint_states = NULL;
+    free(history_events);
+    history_events = NULL;
+    max_events = 0;
+    reset_history();
+}
+
+void reset_history() {
+    num_checkpoints = 0;
+    num_events = 0;
+}
+
+// Drops every other checkpoint of the older half to make room
+void thin_checkpoints() {
+    unsigned char *dropped[MAX_CHECKPOINTS / 4];
+    int num_dropped = 0;
+    int num_kept = 0;
+    for (int i = 0; i < num_checkpoints; i++) {
+        if (i < MAX_CHECKPOINTS / 2 && i % 2 == 1) {
+            dropped[num_dropped++] = checkpoints[i].state;
+        } else {
+            checkpoints[num_kept++] = checkpoints[i];
+        }
+    }
+    for (int i = 0; i < num_dropped; i++) {
+        checkpoints[num_kept + i].state = dropped[i];
+    }
+    num_checkpoints = num_kept;
+}
+
+void take_checkpoint(unsigned short keys, unsigned long first_event) {
+    if (num_checkpoints == MAX_CHECKPOINTS) thin_checkpoints();
+    unsigned long cycles = get_machine()->cycles;
+    Checkpoint spare = checkpoints[num_checkpoints];
+    int i = num_checkpoints;
+    while (i > 0 && checkpoints[i - 1].cycles > cycles) {
+        checkpoints[i] = checkpoints[i - 1];
+        i--;
+    }
+    spare.cycles = cycles;
+    spare.keys = keys;
+    spare.first_event = first_event;
+    export_state(spare.state);
+    checkpoints[i] = spare;
+    num_checkpoints++;
+}
+
+void update_history() {
+    if (checkpoint_states == NULL) return;
+    unsigned long cycles = get_machine()->cycles;
+    if (num_checkpoints > 0 &&
+        cycles - checkpoints[num_checkpoints - 1].cycles < checkpoint_spacing) {
+        return;
+    }
+    take_checkpoint(current_keys, num_events);
+}
+
+void log_event(bool is_timers, unsigned short keys) {
+    // Before the first checkpoint there's nothing to re-run them from
+    if (num_checkpoints == 0) return;
+    if (num_events == max_events) {
+        unsigned long size =
+            (max_events > 0) ? 2 * max_events : MIN_HISTORY_EVENTS;
+        HistoryEvent *events =
+            realloc(history_events, size * sizeof(HistoryEvent));
+        if (events == NULL) {
+            // Without the event the history can't be re-run past it
+            reset_history();
+            return;
+        }
+        history_events = events;
+        max_events = size;
+    }
+    history_events[num_events++] =
+        (HistoryEvent){get_machine()->cycles, is_timers, keys};
+}
+
+void log_keys(unsigned short keys) {
+    if (keys == current_keys) return;
+    current_keys = keys;
+    log_event(false, keys);
+}
+
+void log_timers() { log_event(true, 0); }
+
+// Index of the last checkpoint at or before `cycles`, -1 if there's none
+int find_checkpoint(unsigned long cycles) {
+    int i = num_checkpoints - 1;
+    while (i >= 0 && checkpoints[i].cycles > cycles) i--;
+    return i;
+}
+
+// Re-runs the machine from checkpoint `from` until its cycles reach `end`,
+// filling gaps between the checkpoints on the way. With `hit`, it checks the
+// breakpoints and stores where the last one before `limit` stopped it.
+// Stores the keys the machine sees at `end` in `end_keys`, returns 1 if the
+// checkpoint couldn't be restored.
+int rerun_history(int from, unsigned long end, unsigned long limit,
+                  unsigned long *hit, unsigned short *end_keys) {
+    Chip8 *machine = get_machine();
+    if (restore_state(checkpoints[from].state) == 1) {
+        set_error("Out of memory");
+        return 1;
+    }
+    unsigned short keys = checkpoints[from].keys;
+    unsigned long event = checkpoints[from].first_event;
+    unsigned long start_cycles = checkpoints[from].cycles;
+    unsigned long last_checkpoint = start_cycles;
+    unsigned long next_checkpoint = (from + 1 < num_checkpoints)
+                                        ? checkpoints[from + 1].cycles
+                                        : ULONG_MAX;
+    // The breakpoints are checked on the side, the live checks stay as the
+    // user left them
+    BreakCheck check;
+    init_break_check(&check);
+    unsigned long start = get_history_time();
+    while (true) {
+        while (event < num_events &&
+               history_events[event].cycles == machine->cycles) {
+            if (history_events[event].is_timers)
+                decrement_timers();
+            else
+                keys = history_events[event].keys;
+            event++;
+        }
+        if (machine->cycles >= end) break;
+
+        unsigned long cycles = machine->cycles;
+        bool is_executing = machine->clock == 2;
+        if (is_executing && cycles - last_checkpoint >= checkpoint_spacing &&
+            next_checkpoint - cycles >= checkpoint_spacing) {
+            take_checkpoint(keys, event);
+            last_checkpoint = cycles;
+        }
+        if (hit != NULL && is_executing && check_break_before(&check)) {
+            *hit = cycles;
+            snprintf(history_reason, sizeof(history_reason), "%s",
+                     check.reason);
+        }
+        Flag flag = run_cycle(keys);
+        // Watchpoints stop before the next instruction
+        if (hit != NULL && is_executing && check_break_after(&check) &&
+            cycles + 3 < limit) {
+            *hit = cycles + 3;
+            snprintf(history_reason, sizeof(history_reason), "%s",
+                     check.reason);
+        }
+        if (flag == EXIT) break;
+    }
+
+    // Space the checkpoints so that re-running between two takes about
+    // MAX_REPLAY_TIME
+    unsigned long num_cycles = machine->cycles - start_cycles;
+    if (num_cycles >= MIN_CHECKPOINT_SPACING) {
+        double cycle_time =
+            (double)(get_history_time() - start) / num_cycles;
+        double spacing =
+            MAX_REPLAY_TIME / ((cycle_time > 0) ? cycle_time : 1);
+        if (spacing < MIN_CHECKPOINT_SPACING) spacing = MIN_CHECKPOINT_SPACING;
+        if (spacing > MAX_CHECKPOINT_SPACING) spacing = MAX_CHECKPOINT_SPACING;
+        checkpoint_spacing = spacing;
+    }
+    *end_keys = keys;
+    return 0;
+}
+
+// Goes to `target` cycles and forgets what came after, it runs differently
+// from there
+int travel_to(unsigned long target) {
+    int from = find_checkpoint(target);
+    if (from < 0) return 1;
+    if (rerun_history(from, target, 0, NULL, &current_keys) == 1) {
+        // The machine is somewhere in between, the history doesn't fit it
+        reset_history();
+        return 1;
+    }
+    while (num_checkpoints > 0 &&
+           checkpoints[num_checkpoints - 1].cycles > target) {
+        num_checkpoints--;
+    }
+    while (num_events > 0 && history_events[num_events - 1].cycles > target) {
+        num_events--;
+    }
+    return 0;
+}
+
+int reverse_step() {
+    unsigned long cycles = get_machine()->cycles;
+    // One instruction is 3 cycles: fetch, decode and execute
+    if (num_checkpoints == 0 || cycles < checkpoints[0].cycles + 3) return 1;
+    snprintf(history_reason, sizeof(history_reason), "reverse step");
+    return travel_to(cycles - 3);
+}
+
+int reverse_continue() {
+    if (num_checkpoints == 0) return 1;
+    unsigned long now = get_machine()->cycles;
+    unsigned long hit = 0;
+    // From the newest part of the history back, until one has a hit
+    unsigned long end = now;
+    int from;
+    while (hit == 0 && end > 0 && (from = find_checkpoint(end - 1)) >= 0) {
+        unsigned long start = checkpoints[from].cycles;
+        unsigned short keys;
+        if (rerun_history(from, end, now, &hit, &keys) == 1) {
+            reset_history();
+            return 1;
+        }
+        end = start;
+    }
+    if (hit == 0) {
+        snprintf(history_reason, sizeof(history_reason),
+                 "start of history");
+        hit = checkpoints[0].cycles;
+    }
+    return travel_to(hit);
+}
+
+const char *get_history_reason() { return history_reason; }
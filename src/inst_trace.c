@@ -0,0 +1,46 @@
+#include "inst_trace.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+// write() can be interrupted or write less, keep going
+int write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0) return 1;
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int write_inst_trace(const InstTrace *trace, const char *path,
+                     bool has_quirks) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return 1;
+    unsigned long count = trace->count;
+    unsigned int num_records =
+        (count < INST_TRACE_SIZE) ? count : INST_TRACE_SIZE;
+    InstTraceHeader header = {
+        .version = INST_TRACE_VERSION,
+        .header_size = sizeof(InstTraceHeader),
+        .record_size = sizeof(InstRecord),
+        .num_records = num_records,
+        .superchip8_quirks = has_quirks,
+        .count = count,
+    };
+    memcpy(header.magic, INST_TRACE_MAGIC, sizeof(header.magic));
+
+    // Oldest first: from the next one to overwrite to the end, then the start
+    unsigned int oldest =
+        (count < INST_TRACE_SIZE) ? 0 : count % INST_TRACE_SIZE;
+    unsigned int num_first = num_records - oldest;
+    bool is_ok =
+        write_all(fd, &header, sizeof(header)) == 0 &&
+        write_all(fd, trace->records + oldest,
+                  num_first * sizeof(InstRecord)) == 0 &&
+        write_all(fd, trace->records, oldest * sizeof(InstRecord)) == 0;
+    return (close(fd) == 0 && is_ok) ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+#include <config.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dasm.h"
+#include "inst_trace.h"
+
+void print_help() {
+    printf("Usage: ./chip8_itrace [-h] [-n <count>] <trace_file>\n\n");
+    printf("Disassembles the last instructions chip8_emu dumped on a crash "
+           "or SIGUSR1.\n");
+    printf("Options:\n");
+    printf(" -n <count>  Only print the last count instructions\n");
+    printf(" -h          Displays this message and version number\n");
+}
+
+void print_record(const InstRecord *record, bool has_quirks) {
+    AsmStatement statement = {0};
+    decode_dasm(&statement, record->opcode, has_quirks);
+    char instruction[32];
+    int length = snprintf(instruction, sizeof(instruction), "%s",
+                          statement.name);
+    for (int i = 0; i < statement.num_args; i++) {
+        length += snprintf(instruction + length, sizeof(instruction) - length,
+                           "%s %s", (i == 0) ? "" : ",", statement.args[i]);
+    }
+    printf("%8u  %03x  %04x    %-22s%03x  %02x\n", record->frame, record->pc,
+           record->opcode, instruction, record->I, record->vf);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long max_records = 0;
+
+    char c;
+    while ((c = getopt(argc, argv, "n:h")) != -1) {
+        switch (c) {
+            case 'n':
+                max_records = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if (argc - 1 != optind) {
+        print_help();
+        return 1;
+    }
+    const char *path = argv[optind];
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Error opening %s.\n", path);
+        return 1;
+    }
+    InstTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, INST_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INST_TRACE_VERSION ||
+        header.header_size != sizeof(InstTraceHeader) ||
+        header.record_size != sizeof(InstRecord) ||
+        header.num_records > INST_TRACE_SIZE) {
+        printf("Error: %s isn't an instruction trace of this version.\n",
+               path);
+        fclose(file);
+        return 1;
+    }
+    InstRecord *records = malloc(header.num_records * sizeof(InstRecord));
+    if (records == NULL ||
+        fread(records, sizeof(InstRecord), header.num_records, file) !=
+            header.num_records) {
+        printf("Error reading %s.\n", path);
+        free(records);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    unsigned long first = 0;
+    if (max_records != 0 && max_records < header.num_records) {
+        first = header.num_records - max_records;
+    }
+    printf("Last %u of %lu instructions\n", header.num_records,
+           header.count);
+    printf("%8s  %-3s  %-6s  %-22s%-3s  %s\n", "frame", "pc", "opcode",
+           "instruction", "I", "VF");
+    for (unsigned long i = first; i < header.num_records; i++) {
+        print_record(&records[i], header.superchip8_quirks);
+    }
+    free(records);
+    return 0;
+}
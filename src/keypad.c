@@ -0,0 +1,284 @@
+#include "keypad.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define EVENT_RING_SIZE 256
+#define MAX_CSI_SIZE 32
+
+#define KITTY_FLAGS 11 /* disambiguate | event types | all keys as escapes */
+#define KITTY_CTRL 4
+#define KEY_BACKSPACE_CODE 127
+
+// Timings of the release heuristic (in microseconds)
+#define TAP_TIME 50000
+#define MAX_REPEAT_DELAY 700000
+#define MAX_REPEAT_INTERVAL 100000
+#define REPEAT_SLACK 30000
+
+#define KEY_BIT(key) (1u << (key))
+
+typedef enum { KEY_PRESS = 1, KEY_REPEAT, KEY_RELEASE } KeyEventType;
+
+typedef struct {
+    unsigned char key;
+    unsigned char type;
+    unsigned long time;
+} KeyEvent;
+
+typedef enum { PARSE_TEXT, PARSE_ESC, PARSE_CSI } ParseState;
+
+atomic_int keypad_mode = KEYPAD_UNKNOWN;
+
+// Events go from the thread reading the terminal to the emulation thread
+KeyEvent event_ring[EVENT_RING_SIZE];
+atomic_uint event_head, event_tail;
+
+// Parser state (producer side)
+ParseState parse_state = PARSE_TEXT;
+char csi[MAX_CSI_SIZE];
+int csi_len;
+
+// Keypad state (consumer side)
+unsigned int keys_down;
+unsigned int hotkeys_pressed;
+unsigned long last_seen[NUM_KEYS];
+unsigned int num_repeats[NUM_KEYS];
+bool was_expired[NUM_KEYS];
+unsigned long candidate_delay[NUM_KEYS];
+unsigned long repeat_delay = TAP_TIME;
+unsigned long repeat_interval = TAP_TIME;
+
+unsigned long get_event_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int translate(int codepoint) {
+    static const unsigned char lookup_table[128] = {
+        ['1'] = 0x1, ['2'] = 0x2, ['3'] = 0x3, ['4'] = 0xc,
+        ['q'] = 0x4, ['w'] = 0x5, ['e'] = 0x6, ['r'] = 0xd,
+        ['a'] = 0x7, ['s'] = 0x8, ['d'] = 0x9, ['f'] = 0xe,
+        ['z'] = 0xa, ['x'] = 0x0, ['c'] = 0xb, ['v'] = 0xf};
+    if (codepoint == 'x') return 0;
+    if (codepoint < 0 || codepoint >= 128) return -1;
+    return lookup_table[codepoint] ? lookup_table[codepoint] : -1;
+}
+
+void push_event(int key, KeyEventType type) {
+    if (key < 0) return;
+    unsigned int head = atomic_load_explicit(&event_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&event_tail, memory_order_acquire);
+    // Drop the event if the emulation doesn't keep up
+    if (head - tail == EVENT_RING_SIZE) return;
+    KeyEvent *event = &event_ring[head % EVENT_RING_SIZE];
+    event->key = key;
+    event->type = type;
+    event->time = get_event_time();
+    atomic_store_explicit(&event_head, head + 1, memory_order_release);
+}
+
+void enable_key_events() {
+    // Push the kitty flags, query them, then ask for the device attributes.
+    // Every terminal answers the last one, so if the kitty answer doesn't come
+    // before it, the protocol isn't supported.
+    printf("\e[>%du\e[?u\e[c", KITTY_FLAGS);
+    fflush(stdout);
+}
+
+void disable_key_events() {
+    printf("\e[<u");
+    fflush(stdout);
+}
+
+// Handles "CSI key-code:alternates ; modifiers:event-type u"
+void handle_kitty_key(const char *params) {
+    char *end;
+    int codepoint = strtol(params, &end, 10);
+    while (*end == ':' || (*end >= '0' && *end <= '9')) end++;
+    int modifiers = 1;
+    int type = KEY_PRESS;
+    if (*end == ';') {
+        modifiers = strtol(end + 1, &end, 10);
+        if (*end == ':') type = strtol(end + 1, &end, 10);
+    }
+    if (modifiers < 1) modifiers = 1;
+
+    if ((modifiers - 1) & KITTY_CTRL) {
+        if (codepoint == 'c' && type == KEY_PRESS) {
+            push_event(HOTKEY_QUIT, KEY_PRESS);
+        }
+        return;
+    }
+    if (codepoint == KEY_BACKSPACE_CODE) {
+        push_event(HOTKEY_REWIND, type);
+        return;
+    }
+    push_event(translate(codepoint), type);
+}
+
+// Handles "CSI number ; modifiers:event-type ~" (F5 and above)
+void handle_function_key(const char *params) {
+    char *end;
+    int number = strtol(params, &end, 10);
+    int type = KEY_PRESS;
+    // 1 + the modifier bits, Shift is the first
+    int modifiers = 1;
+    if (*end == ';') {
+        modifiers = strtol(end + 1, &end, 10);
+        if (*end == ':') type = strtol(end + 1, &end, 10);
+    }
+    bool is_shifted = (modifiers - 1) & 1;
+    if (number == 15) push_event(HOTKEY_SAVE_STATE, type);
+    if (number == 18) push_event(HOTKEY_OVERLAY, type);
+    if (number == 19) {
+        push_event((is_shifted) ? HOTKEY_REVERSE_CONTINUE : HOTKEY_CONTINUE,
+                   type);
+    }
+    if (number == 20) push_event(HOTKEY_LOAD_STATE, type);
+    if (number == 21) {
+        push_event((is_shifted) ? HOTKEY_REVERSE_STEP : HOTKEY_STEP, type);
+    }
+}
+
+void handle_csi(char final) {
+    csi[csi_len] = '\0';
+    if (csi[0] == '?') {
+        if (final == 'u') atomic_store(&keypad_mode, KEYPAD_KITTY);
+        if (final == 'c') {
+            // The device attributes came, the kitty answer would be here by now
+            int unknown = KEYPAD_UNKNOWN;
+            atomic_compare_exchange_strong(&keypad_mode, &unknown,
+                                           KEYPAD_LEGACY);
+        }
+        return;
+    }
+    if (final == 'u') handle_kitty_key(csi);
+    if (final == '~') handle_function_key(csi);
+}
+
+void feed_keypad(int byte) {
+    switch (parse_state) {
+        case PARSE_TEXT:
+            if (byte == '\e') {
+                parse_state = PARSE_ESC;
+                break;
+            }
+            // Terminals only repeat characters, releases must be guessed
+            if (byte == KEY_BACKSPACE_CODE || byte == '\b') {
+                push_event(HOTKEY_REWIND, KEY_PRESS);
+                break;
+            }
+            push_event(translate(byte), KEY_PRESS);
+            break;
+        case PARSE_ESC:
+            if (byte == '[') {
+                parse_state = PARSE_CSI;
+                csi_len = 0;
+                break;
+            }
+            parse_state = PARSE_TEXT;
+            feed_keypad(byte);
+            break;
+        case PARSE_CSI:
+            if (byte >= 0x40 && byte <= 0x7e) {
+                handle_csi(byte);
+                parse_state = PARSE_TEXT;
+                break;
+            }
+            if (csi_len == MAX_CSI_SIZE - 1) {
+                parse_state = PARSE_TEXT;
+                break;
+            }
+            csi[csi_len++] = byte;
+            break;
+    }
+}
+
+KeypadMode get_keypad_mode() { return atomic_load(&keypad_mode); }
+
+void apply_event(KeyEvent *event) {
+    int key = event->key;
+    if (event->type == KEY_RELEASE) {
+        keys_down &= ~KEY_BIT(key);
+        return;
+    }
+
+    unsigned long gap = event->time - last_seen[key];
+    if (keys_down & KEY_BIT(key)) {
+        // Still held, so this is the terminal's key repeat
+        if (num_repeats[key] != 0) {
+            repeat_interval = gap;
+        } else if (candidate_delay[key] == 0) {
+            repeat_delay = gap;
+        } else if (gap < MAX_REPEAT_INTERVAL) {
+            // The press before was the first repeat, coming later than
+            // expected (a second tap wouldn't be followed by fast repeats)
+            repeat_delay = candidate_delay[key];
+        }
+        candidate_delay[key] = 0;
+        num_repeats[key]++;
+    } else {
+        // A press soon after the key was let go by the timeout might be the
+        // first repeat, if the next one comes fast enough
+        bool might_be_repeat = was_expired[key] && num_repeats[key] == 0 &&
+                               gap < MAX_REPEAT_DELAY && gap > repeat_delay;
+        candidate_delay[key] = (might_be_repeat) ? gap : 0;
+        if (key >= 16) hotkeys_pressed |= KEY_BIT(key);
+        num_repeats[key] = 0;
+    }
+    keys_down |= KEY_BIT(key);
+    was_expired[key] = false;
+    last_seen[key] = event->time;
+}
+
+// Releases the keys that stopped repeating (without the kitty protocol)
+void expire_keys(unsigned long now) {
+    for (int key = 0; key < NUM_KEYS; key++) {
+        if (!(keys_down & KEY_BIT(key))) continue;
+        unsigned long timeout = (num_repeats[key] == 0)
+                                    ? repeat_delay + REPEAT_SLACK
+                                    : repeat_interval * 2 + REPEAT_SLACK;
+        if (now - last_seen[key] > timeout) {
+            keys_down &= ~KEY_BIT(key);
+            was_expired[key] = true;
+        }
+    }
+}
+
+// Checks if an event presses or releases its key (repeats don't)
+bool is_transition(const KeyEvent *event) {
+    bool is_down = keys_down & KEY_BIT(event->key);
+    return (event->type == KEY_RELEASE) == is_down;
+}
+
+unsigned short drain_keypad() {
+    unsigned int tail = atomic_load_explicit(&event_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&event_head, memory_order_acquire);
+    unsigned int changed_keys = 0;
+    for (; tail != head; tail++) {
+        KeyEvent *event = &event_ring[tail % EVENT_RING_SIZE];
+        if (is_transition(event)) {
+            // A tap would cancel out, leave its release for the next drain
+            if (changed_keys & KEY_BIT(event->key)) break;
+            changed_keys |= KEY_BIT(event->key);
+        }
+        apply_event(event);
+    }
+    atomic_store_explicit(&event_tail, tail, memory_order_release);
+
+    if (get_keypad_mode() != KEYPAD_KITTY) expire_keys(get_event_time());
+    return keys_down & 0xffff;
+}
+
+bool is_hotkey_down(Hotkey hotkey) { return keys_down & KEY_BIT(hotkey); }
+
+bool was_hotkey_pressed(Hotkey hotkey) {
+    bool was_pressed = hotkeys_pressed & KEY_BIT(hotkey);
+    hotkeys_pressed &= ~KEY_BIT(hotkey);
+    return was_pressed;
+}
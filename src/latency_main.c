@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include <config.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_NUM_TRIALS 50
+#define MAX_CONFIGS 16
+#define MAX_ARGS 32
+
+#define TERM_ROWS 50
+#define TERM_COLS 160
+
+// Timings (in microseconds)
+#define STARTUP_TIME 1000000
+#define QUIET_TIME 50000
+#define TRIAL_TIMEOUT 2000000
+#define RELEASE_TIME 300000
+
+// 'w' is key 5 on the chip8 keypad
+#define KEY_PRESS "w"
+#define KITTY_KEY_PRESS "\e[119u"
+#define KITTY_KEY_RELEASE "\e[119;1:3u"
+#define KITTY_QUIT "\e[99;5u"
+#define KITTY_ANSWER "\e[?11u"
+#define DEVICE_ATTRIBUTES_ANSWER "\e[?62c"
+
+/* Inverts the whole screen every time key 5 gets pressed
+ *          LD V0, 0 ... LD V7, 56   x positions of the sprites
+ *          LD VA, 0; LD VB, 15; LD VC, 30   y positions of the sprites
+ *          LD VD, 5
+ *          LD I, sprite
+ * press:   SKP VD
+ *          JP press
+ *          DRW V0, VA, 15 ... DRW V7, VC, 2
+ * release: SKNP VD
+ *          JP release
+ *          JP press
+ * sprite:  .db 0xFF (15 times)
+ */
+#define PRESS_ADDR 0x21a
+#define RELEASE_ADDR 0x24e
+#define SPRITE_ADDR 0x254
+
+typedef struct {
+    const char *args;
+    int num_trials;
+    int num_missed;
+    unsigned long *first_byte; /**< Latency to the first byte of the frame */
+    unsigned long *last_byte;  /**< Latency to the whole frame being written */
+} Config;
+
+int build_rom(unsigned char *rom) {
+    int len = 0;
+#define EMIT(op)                  \
+    {                             \
+        rom[len++] = (op) >> 8;   \
+        rom[len++] = (op) & 0xff; \
+    }
+    for (int i = 0; i < 8; i++) EMIT(0x6000 | i << 8 | i * 8);
+    EMIT(0x6a00);
+    EMIT(0x6b0f);
+    EMIT(0x6c1e);
+    EMIT(0x6d05);
+    EMIT(0xa000 | SPRITE_ADDR);
+    EMIT(0xed9e);
+    EMIT(0x1000 | PRESS_ADDR);
+    const unsigned char rows[] = {0xa, 0xb, 0xc};
+    const unsigned char heights[] = {15, 15, 2};
+    for (int j = 0; j < 3; j++) {
+        for (int i = 0; i < 8; i++) {
+            EMIT(0xd000 | i << 8 | rows[j] << 4 | heights[j]);
+        }
+    }
+    EMIT(0xeda1);
+    EMIT(0x1000 | RELEASE_ADDR);
+    EMIT(0x1000 | PRESS_ADDR);
+    for (int i = 0; i < 15; i++) rom[len++] = 0xff;
+#undef EMIT
+    return len;
+}
+
+unsigned long get_usecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool use_kitty = false;
+
+// Reads the emulator's output for some time, answering its terminal queries
+// Returns the number of bytes read, first and last set to when they came
+long read_output(int fd, unsigned long timeout, unsigned long quiet,
+                 unsigned long *first, unsigned long *last) {
+    char buf[65536];
+    long total = 0;
+    unsigned long start = get_usecs();
+    unsigned long last_read = start;
+    while (true) {
+        unsigned long now = get_usecs();
+        if (total == 0 && now - start >= timeout) break;
+        if (total != 0 && now - last_read >= quiet) break;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, 5) <= 0) continue;
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) break;
+        last_read = get_usecs();
+        if (total == 0 && first != NULL) *first = last_read;
+        if (last != NULL) *last = last_read;
+        total += len;
+        if (memmem(buf, len, "\e[c", 3) != NULL) {
+            if (use_kitty) write(fd, KITTY_ANSWER, strlen(KITTY_ANSWER));
+            write(fd, DEVICE_ATTRIBUTES_ANSWER,
+                  strlen(DEVICE_ATTRIBUTES_ANSWER));
+        }
+    }
+    return total;
+}
+
+pid_t spawn(const char *emu_path, const char *args, const char *rom_path,
+            int *fd) {
+    struct winsize ws = {.ws_row = TERM_ROWS, .ws_col = TERM_COLS};
+    pid_t pid = forkpty(fd, NULL, NULL, &ws);
+    if (pid != 0) return pid;
+
+    char *argv[MAX_ARGS];
+    char *args_copy = strdup(args);
+    int argc = 0;
+    argv[argc++] = (char *)emu_path;
+    for (char *arg = strtok(args_copy, " "); arg != NULL && argc < MAX_ARGS - 2;
+         arg = strtok(NULL, " ")) {
+        argv[argc++] = arg;
+    }
+    argv[argc++] = (char *)rom_path;
+    argv[argc] = NULL;
+    setenv("TERM", "xterm-256color", 1);
+    execv(emu_path, argv);
+    perror("execv");
+    _exit(127);
+}
+
+void run_config(Config *config, const char *emu_path, const char *rom_path) {
+    int fd;
+    pid_t pid = spawn(emu_path, config->args, rom_path, &fd);
+    if (pid == -1) {
+        printf("Couldn't start %s.\n", emu_path);
+        return;
+    }
+    read_output(fd, STARTUP_TIME, STARTUP_TIME, NULL, NULL);
+
+    const char *press = (use_kitty) ? KITTY_KEY_PRESS : KEY_PRESS;
+    for (int i = 0; i < config->num_trials; i++) {
+        // Let the screen settle
+        read_output(fd, QUIET_TIME, QUIET_TIME, NULL, NULL);
+
+        unsigned long start = get_usecs(), first, last;
+        write(fd, press, strlen(press));
+        long len = read_output(fd, TRIAL_TIMEOUT, QUIET_TIME, &first, &last);
+        if (len == 0) {
+            config->num_missed++;
+        } else {
+            config->first_byte[i - config->num_missed] = first - start;
+            config->last_byte[i - config->num_missed] = last - start;
+        }
+
+        if (use_kitty) {
+            write(fd, KITTY_KEY_RELEASE, strlen(KITTY_KEY_RELEASE));
+        }
+        // Without release events the emulator releases the key by itself
+        read_output(fd, RELEASE_TIME, RELEASE_TIME, NULL, NULL);
+    }
+
+    if (use_kitty) write(fd, KITTY_QUIT, strlen(KITTY_QUIT));
+    kill(pid, SIGTERM);
+    usleep(200000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(fd);
+}
+
+int compare_ulong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+unsigned long percentile(unsigned long *sorted, int len, int p) {
+    if (len == 0) return 0;
+    int index = (len * p + 99) / 100 - 1;
+    if (index < 0) index = 0;
+    return sorted[index];
+}
+
+void print_config(Config *config) {
+    int len = config->num_trials - config->num_missed;
+    qsort(config->first_byte, len, sizeof(unsigned long), compare_ulong);
+    qsort(config->last_byte, len, sizeof(unsigned long), compare_ulong);
+    printf("\"%s\",%d,%d,%lu,%lu,%lu,%lu,%lu,%lu\n", config->args,
+           config->num_trials, config->num_missed,
+           percentile(config->first_byte, len, 50),
+           percentile(config->first_byte, len, 99),
+           percentile(config->first_byte, len, 100),
+           percentile(config->last_byte, len, 50),
+           percentile(config->last_byte, len, 99),
+           percentile(config->last_byte, len, 100));
+}
+
+void print_help() {
+    printf(
+        "Usage: ./chip8_latency [-kh] [-e <emulator>] [-n <num_trials>] "
+        "[-a <emulator_args>]...\n");
+    printf("Options:\n");
+    printf(" -e <emulator>       Path of chip8_emu (default ./chip8_emu)\n");
+    printf(" -n <num_trials>     Key presses per configuration (default 50)\n");
+    printf(" -a <emulator_args>  Add a configuration (default \"\" and \"-i\")\n");
+    printf(" -k                  Act like a kitty keyboard protocol terminal\n");
+    printf(" -h                  Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *emu_path = "./chip8_emu";
+    int num_trials = DEFAULT_NUM_TRIALS;
+    const char *configs[MAX_CONFIGS];
+    int num_configs = 0;
+
+    char c;
+    while ((c = getopt(argc, argv, "e:n:a:kh")) != -1) {
+        switch (c) {
+            case 'e':
+                emu_path = optarg;
+                break;
+            case 'n':
+                num_trials = atoi(optarg);
+                if (num_trials <= 0) num_trials = DEFAULT_NUM_TRIALS;
+                break;
+            case 'a':
+                if (num_configs < MAX_CONFIGS) configs[num_configs++] = optarg;
+                break;
+            case 'k':
+                use_kitty = true;
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if (num_configs == 0) {
+        configs[num_configs++] = "";
+        configs[num_configs++] = "-i";
+    }
+
+    char rom_path[] = "/tmp/chip8_latency_XXXXXX";
+    int rom_fd = mkstemp(rom_path);
+    if (rom_fd == -1) {
+        printf("Couldn't create the test ROM.\n");
+        return 1;
+    }
+    unsigned char rom[128];
+    int rom_len = build_rom(rom);
+    write(rom_fd, rom, rom_len);
+    close(rom_fd);
+
+    // Results go to stdout as CSV
+    printf("args,trials,missed,first_p50_us,first_p99_us,first_max_us,"
+           "frame_p50_us,frame_p99_us,frame_max_us\n");
+    for (int i = 0; i < num_configs; i++) {
+        Config config = {configs[i], num_trials, 0,
+                         calloc(num_trials, sizeof(unsigned long)),
+                         calloc(num_trials, sizeof(unsigned long))};
+        run_config(&config, emu_path, rom_path);
+        print_config(&config);
+        fflush(stdout);
+        free(config.first_byte);
+        free(config.last_byte);
+    }
+
+    unlink(rom_path);
+    return 0;
+}
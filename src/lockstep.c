@@ -0,0 +1,365 @@
+#include "lockstep.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "ops.h"
+
+// Copies the registers of a lane to its machine
+void store_lane(Lockstep *ls, int lane) {
+    Chip8 *machine = &ls->machines[lane];
+    int n = ls->num_lanes;
+    for (int i = 0; i < 16; i++) machine->V[i] = ls->V[i * n + lane];
+    for (int i = 0; i < 4; i++) {
+        machine->random[i] = ls->random[i * n + lane];
+    }
+    machine->pc = ls->pc[lane];
+    machine->I = ls->I[lane];
+    machine->opcode = ls->opcode[lane];
+    machine->dt = ls->dt[lane];
+    machine->st = ls->st[lane];
+    machine->cycles = ls->cycles[lane];
+}
+
+// Copies the registers of a lane back from its machine
+void load_lane(Lockstep *ls, int lane) {
+    const Chip8 *machine = &ls->machines[lane];
+    int n = ls->num_lanes;
+    for (int i = 0; i < 16; i++) ls->V[i * n + lane] = machine->V[i];
+    for (int i = 0; i < 4; i++) {
+        ls->random[i * n + lane] = machine->random[i];
+    }
+    ls->pc[lane] = machine->pc;
+    ls->I[lane] = machine->I;
+    ls->opcode[lane] = machine->opcode;
+    ls->dt[lane] = machine->dt;
+    ls->st[lane] = machine->st;
+    ls->cycles[lane] = machine->cycles;
+    ls->private_pages[lane] = 0;
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        if (machine->pages[i] != NULL) ls->private_pages[lane] |= 1 << i;
+    }
+}
+
+int init_lockstep(Lockstep *ls, int num_lanes, const char *program_path,
+                  bool has_superchip8_quirks,
+                  const unsigned long long *seeds) {
+    memset(ls, 0, sizeof(Lockstep));
+    if (num_lanes < 1) return 1;
+    int n = num_lanes;
+    ls->num_lanes = n;
+    ls->machines = calloc(n, sizeof(Chip8));
+    ls->V = calloc(16 * n, sizeof(unsigned char));
+    ls->pc = calloc(n, sizeof(unsigned short));
+    ls->I = calloc(n, sizeof(unsigned short));
+    ls->opcode = calloc(n, sizeof(unsigned short));
+    ls->dt = calloc(n, sizeof(unsigned char));
+    ls->st = calloc(n, sizeof(unsigned char));
+    ls->random = calloc(4 * n, sizeof(unsigned int));
+    ls->cycles = calloc(n, sizeof(unsigned long));
+    ls->private_pages = calloc(n, sizeof(unsigned short));
+    ls->is_running = calloc(n, sizeof(bool));
+    if (ls->machines == NULL || ls->V == NULL || ls->pc == NULL ||
+        ls->I == NULL || ls->opcode == NULL || ls->dt == NULL ||
+        ls->st == NULL || ls->random == NULL || ls->cycles == NULL ||
+        ls->private_pages == NULL || ls->is_running == NULL) {
+        free_lockstep(ls);
+        return 1;
+    }
+
+    // The program gets loaded once, the other lanes share its image
+    Chip8 *previous = get_machine();
+    set_machine(&ls->machines[0]);
+    init_chip8();
+    if (has_superchip8_quirks) set_superchip8_quirks();
+    int ret = load_program(program_path);
+    for (int i = 0; i < n && ret == 0; i++) {
+        if (i != 0) ret = copy_machine(&ls->machines[i], &ls->machines[0]);
+        if (ret == 1) break;
+        set_machine(&ls->machines[i]);
+        seed_random(seeds[i]);
+        load_lane(ls, i);
+        ls->is_running[i] = true;
+    }
+    set_machine(previous);
+    if (ret == 1) {
+        free_lockstep(ls);
+        return 1;
+    }
+    ls->num_running = n;
+    ls->has_superchip8_quirks = has_superchip8_quirks;
+    return 0;
+}
+
+void free_lockstep(Lockstep *ls) {
+    if (ls->machines != NULL) {
+        for (int i = 0; i < ls->num_lanes; i++) {
+            free_machine(&ls->machines[i]);
+        }
+    }
+    free(ls->machines);
+    free(ls->V);
+    free(ls->pc);
+    free(ls->I);
+    free(ls->opcode);
+    free(ls->dt);
+    free(ls->st);
+    free(ls->random);
+    free(ls->cycles);
+    free(ls->private_pages);
+    free(ls->is_running);
+    memset(ls, 0, sizeof(Lockstep));
+}
+
+Chip8 *get_lane_machine(Lockstep *ls, int lane) {
+    store_lane(ls, lane);
+    return &ls->machines[lane];
+}
+
+// Runs cycles of a lane through the handlers
+void run_lane_cycles(Lockstep *ls, int lane, unsigned short keys,
+                     long num_cycles) {
+    Chip8 *previous = get_machine();
+    set_machine(get_lane_machine(ls, lane));
+    for (long i = 0; i < num_cycles; i++) {
+        if (run_cycle(keys) == EXIT) {
+            ls->is_running[lane] = false;
+            ls->num_running--;
+            break;
+        }
+    }
+    set_machine(previous);
+    load_lane(ls, lane);
+}
+
+// Can the instruction run on the registers of the lanes alone
+bool is_lockstep_op(unsigned short opcode) {
+    switch (FOURTH(opcode)) {
+        case 1:
+        case 3:
+        case 4:
+        case 6:
+        case 7:
+        case 0xa:
+        case 0xb:
+        case 0xc:
+            return true;
+        case 5:
+        case 9:
+            return FIRST(opcode) == 0;
+        case 8:
+            return FIRST(opcode) <= 7 || FIRST(opcode) == 0xe;
+        case 0xf:
+            switch (IMMEDIATE(opcode)) {
+                case 0x07:
+                case 0x15:
+                case 0x18:
+                case 0x1e:
+                    return true;
+            }
+            return false;
+    }
+    return false;
+}
+
+// The operation is a constant in every loop, so each one gets vectorized
+#define ALU_LANES(operation)                                        \
+    for (int i = first; i < last; i++) {                            \
+        alu_op(V + i, n, (opcode & 0xfff0) | operation, has_quirks); \
+    }
+
+/* Executes a fetched instruction accepted by `is_lockstep_op()` on the lanes
+ * from first to last (not included), the same way the handlers would
+ */
+void execute_lanes(Lockstep *ls, unsigned short opcode, int first,
+                   int last) {
+    int n = ls->num_lanes;
+    unsigned char *V = ls->V;
+    unsigned char *vx = V + THIRD(opcode) * n;
+    bool has_quirks = ls->has_superchip8_quirks;
+    switch (FOURTH(opcode)) {
+        case 1:
+            for (int i = first; i < last; i++) ls->pc[i] = ADDR(opcode);
+            break;
+        case 3:
+        case 4:
+        case 5:
+        case 9:
+            for (int i = first; i < last; i++) {
+                ls->pc[i] += skip_offset(V + i, n, opcode);
+            }
+            break;
+        case 6:
+            for (int i = first; i < last; i++) vx[i] = IMMEDIATE(opcode);
+            break;
+        case 7:
+            for (int i = first; i < last; i++) vx[i] += IMMEDIATE(opcode);
+            break;
+        case 8:
+            switch (FIRST(opcode)) {
+                case 0:
+                    ALU_LANES(0);
+                    break;
+                case 1:
+                    ALU_LANES(1);
+                    break;
+                case 2:
+                    ALU_LANES(2);
+                    break;
+                case 3:
+                    ALU_LANES(3);
+                    break;
+                case 4:
+                    ALU_LANES(4);
+                    break;
+                case 5:
+                    ALU_LANES(5);
+                    break;
+                case 6:
+                    ALU_LANES(6);
+                    break;
+                case 7:
+                    ALU_LANES(7);
+                    break;
+                case 0xe:
+                    ALU_LANES(0xe);
+                    break;
+            }
+            break;
+        case 0xa:
+            for (int i = first; i < last; i++) ls->I[i] = ADDR(opcode);
+            break;
+        case 0xb: {
+            unsigned char *reg = (has_quirks) ? vx : V;
+            for (int i = first; i < last; i++) {
+                ls->pc[i] = ADDR(opcode) + reg[i];
+            }
+            break;
+        }
+        case 0xc:
+            for (int i = first; i < last; i++) {
+                vx[i] = (next_xoshiro(ls->random + i, n) >> 24) &
+                        IMMEDIATE(opcode);
+            }
+            break;
+        case 0xf:
+            switch (IMMEDIATE(opcode)) {
+                case 0x07:
+                    for (int i = first; i < last; i++) vx[i] = ls->dt[i];
+                    break;
+                case 0x15:
+                    for (int i = first; i < last; i++) ls->dt[i] = vx[i];
+                    break;
+                case 0x18:
+                    for (int i = first; i < last; i++) ls->st[i] = vx[i];
+                    break;
+                case 0x1e:
+                    for (int i = first; i < last; i++) ls->I[i] += vx[i];
+                    break;
+            }
+            break;
+    }
+}
+
+/* Fetches the opcode of every running lane (the first cycle of an
+ * instruction)
+ * @return true if every lane is running and got the same opcode
+ */
+bool fetch_lanes(Lockstep *ls) {
+    int n = ls->num_lanes;
+    if (ls->num_running == n) {
+        // Lanes at the same address of memory they didn't write to all read
+        // the same opcode from the image
+        unsigned short pc = ls->pc[0], pc_bits = 0, pages = 0;
+        for (int i = 0; i < n; i++) {
+            pc_bits |= ls->pc[i] ^ pc;
+            pages |= ls->private_pages[i];
+        }
+        unsigned short addr = pc % SIZE_MEMORY;
+        bool is_shared = addr + 1 < START_VIDEO_MEM &&
+                         !((pages >> (addr / MEMORY_PAGE_SIZE)) & 1) &&
+                         !((pages >> ((addr + 1) / MEMORY_PAGE_SIZE)) & 1);
+        if (pc_bits == 0 && is_shared) {
+            const unsigned char *memory = ls->machines[0].image->memory;
+            unsigned short opcode = memory[addr] << 8 | memory[addr + 1];
+            for (int i = 0; i < n; i++) {
+                ls->opcode[i] = opcode;
+                ls->pc[i] += 2;
+                ls->cycles[i]++;
+            }
+            return true;
+        }
+    }
+
+    Chip8 *previous = get_machine();
+    bool is_same = ls->num_running == n;
+    for (int i = 0; i < n; i++) {
+        if (!ls->is_running[i]) continue;
+        set_machine(&ls->machines[i]);
+        ls->opcode[i] = read_mem(ls->pc[i]) << 8 | read_mem(ls->pc[i] + 1);
+        ls->pc[i] += 2;
+        ls->cycles[i]++;
+        is_same = is_same && ls->opcode[i] == ls->opcode[0];
+    }
+    set_machine(previous);
+    return is_same;
+}
+
+// Runs one whole instruction on every running lane
+void step_lanes(Lockstep *ls, const unsigned short *keys) {
+    int n = ls->num_lanes;
+    if (fetch_lanes(ls) && is_lockstep_op(ls->opcode[0])) {
+        execute_lanes(ls, ls->opcode[0], 0, n);
+        for (int i = 0; i < n; i++) ls->cycles[i] += 2;
+        ls->vector_steps++;
+        return;
+    }
+
+    // The lanes went separate ways
+    for (int i = 0; i < n; i++) {
+        if (!ls->is_running[i]) continue;
+        ls->lane_steps++;
+        if (is_lockstep_op(ls->opcode[i])) {
+            execute_lanes(ls, ls->opcode[i], i, i + 1);
+            ls->cycles[i] += 2;
+            continue;
+        }
+        // Decode and execute like the fetch happened on the machine
+        get_lane_machine(ls, i)->clock = 1;
+        run_lane_cycles(ls, i, keys[i], 2);
+    }
+}
+
+void run_lockstep_frame(Lockstep *ls, const unsigned short *keys,
+                        long num_cycles, Flag *flags) {
+    int n = ls->num_lanes;
+    long cycles_left = num_cycles;
+
+    // Finish the instruction the last frame stopped in the middle of
+    long head = (3 - ls->clock) % 3;
+    if (head > cycles_left) head = cycles_left;
+    for (int i = 0; i < n && head > 0; i++) {
+        if (ls->is_running[i]) run_lane_cycles(ls, i, keys[i], head);
+    }
+    cycles_left -= head;
+
+    for (; cycles_left >= 3 && ls->num_running > 0; cycles_left -= 3) {
+        step_lanes(ls, keys);
+    }
+    for (int i = 0; i < n && cycles_left > 0; i++) {
+        if (ls->is_running[i]) run_lane_cycles(ls, i, keys[i], cycles_left);
+    }
+    ls->clock = (ls->clock + num_cycles) % 3;
+
+    for (int i = 0; i < n; i++) {
+        bool is_running = ls->is_running[i];
+        ls->dt[i] -= (is_running && ls->dt[i] != 0) ? 1 : 0;
+        ls->st[i] -= (is_running && ls->st[i] != 0) ? 1 : 0;
+        if (!is_running)
+            flags[i] = EXIT;
+        else
+            flags[i] = (ls->st[i] != 0) ? SOUND : IDLE;
+    }
+}
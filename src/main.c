@@ -1,6 +1,7 @@
 /* TODO: 1. Fix timing
  */
 #include <config.h>
+#include <errno.h>
 #include <ncurses.h>
 #include <signal.h>
 #include <stdio.h>
@@ -10,11 +11,32 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "breakpoints.h"
 #include "chip8.h"
+#include "dasm.h"
 #include "debugger.h"
 #include "graphics.h"
+#include "histogram.h"
+#include "history.h"
+#include "inst_trace.h"
+#include "keypad.h"
+#include "movie.h"
+#include "probes.h"
+#include "profile.h"
+#include "renderer.h"
+#include "rewind.h"
+#include "shared_frame.h"
+#include "trace.h"
+#include "write_counter.h"
 
-#define DEFAULT_TICK_SPEED 900
+#define MAX_PATH_SIZE 4096
+
+// Run-ahead gets turned off when it takes longer than this for too long
+#define RUNAHEAD_MAX_TIME (FRAME_TIME / 2)
+#define RUNAHEAD_MAX_SLOW_FRAMES 30
+
+// The performance overlay gets updated at most this often (in microseconds)
+#define OVERLAY_INTERVAL 250000
 
 unsigned long get_time() {
     struct timeval tv;
@@ -22,86 +44,120 @@ unsigned long get_time() {
     return tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
-unsigned char translate(char key) {
-    static const unsigned char lookup_table[256] = {
-        ['1'] = 0x1, ['2'] = 0x2, ['3'] = 0x3, ['4'] = 0xc,
-        ['q'] = 0x4, ['w'] = 0x5, ['e'] = 0x6, ['r'] = 0xd,
-        ['a'] = 0x7, ['s'] = 0x8, ['d'] = 0x9, ['f'] = 0xe,
-        ['z'] = 0xa, ['x'] = 0x0, ['c'] = 0xb, ['v'] = 0xf};
-    if (key == 'x') return 0;
-    if (key == ERR) return KEYBOARD_UNSET;
-    return lookup_table[(unsigned char)key] ? lookup_table[(unsigned char)key]
-                                            : KEYBOARD_UNSET;
+// Finer than get_time(), for the pacing histograms
+unsigned long get_pacing_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-unsigned char get_key(bool *is_key_pressed, Flag flag) {
-    if (flag == KEYBOARD_NONBLOCKING) {
-        for (int i = 0; i < 16; i++) {
-            if (is_key_pressed[i]) return i;
-        }
-        return KEYBOARD_UNSET;
-    }
-    // KEYBOARD_BLOCKING
-    unsigned char key = KEYBOARD_UNSET;
-    while (key == KEYBOARD_UNSET) {
-        key = translate(getch());
-    }
-    return key;
+// How evenly the main loop runs, in nanoseconds, written on exit with -j
+enum {
+    PACING_FRAME,
+    PACING_TIMERS,
+    PACING_CYCLES,
+    PACING_IO,
+    PACING_RENDER,
+    PACING_OVERSHOOT,
+    NUM_PACING
+};
+const char *pacing_names[NUM_PACING] = {
+    "frame interval", "timer interval", "next_cycle",
+    "update_io",      "render",         "sleep overshoot"};
+Histogram pacing[NUM_PACING];
+const char *pacing_path = NULL;
+unsigned long last_frame_start = 0, last_timers = 0, last_render_time = 0;
+
+// Records the time since the last call with the same `last`. Like the other
+// pacing records, it does nothing without -j.
+void record_interval(int histogram, unsigned long *last) {
+    if (pacing_path == NULL) return;
+    unsigned long now = get_pacing_time();
+    if (*last != 0) record_value(&pacing[histogram], now - *last);
+    *last = now;
 }
 
-void update_keys(bool *keys) {
-    static unsigned long last_pressed;
-    unsigned long now = get_time();
-    char key = getch();
-    if (key == ERR && now - last_pressed < 50000) return;
-    for (int i = 0; i < 16; i++) {
-        keys[i] = translate(key) == i;
+FILE *record_file = NULL;
+
+void record(bool is_flashing) {
+    Frame frame;
+    memcpy(frame.video_mem, get_video_mem(), SIZE_VIDEO_MEM);
+    frame.hi_res = get_hi_res();
+    frame.is_flashing = is_flashing;
+    if (write_frame(record_file, &frame) == 1) {
+        fclose(record_file);
+        record_file = NULL;
     }
-    last_pressed = now;
 }
 
-void update_timers(bool *keys) {
-    unsigned static long cpu_timers;
-    unsigned static long keyboard_timer;
-    unsigned long now = get_time();
-    if (now - keyboard_timer >= 1000000 / 60) {
-        update_keys(keys);
-        keyboard_timer = now;
-    }
+// Called once per emulated frame (1/60 s)
+void update_timers() {
+    Flag timer_flag = decrement_timers();
+    record_interval(PACING_TIMERS, &last_timers);
+    publish_frame(get_video_mem(), get_hi_res(), timer_flag == SOUND);
+    if (record_file != NULL) record(timer_flag == SOUND);
+}
 
-    if (now - cpu_timers >= 1000000 / 60) {
-        Flag timer_flag = decrement_timers();
-        st_flash(timer_flag == SOUND);
-        cpu_timers = now;
-    }
+// Keys drained at the start of the frame, the whole frame sees them
+unsigned short frame_keys;
+
+void read_keys() {
+    unsigned long span = begin_span();
+    poll_inline_keys();
+    frame_keys = drain_keypad();
+    CHIP8_PROBE1(key_read, frame_keys);
+    end_span("input", span);
+}
+
+// Times drawing inline, for -p, the overlay and the trace
+unsigned long render_start, render_span;
+
+void begin_render() {
+    render_start = get_time();
+    render_span = begin_span();
+}
+
+void end_render() {
+    add_render_time(get_time() - render_start);
+    end_span("render", render_span);
 }
 
-void update_io(unsigned int sig, bool *keys) {
+void update_io(unsigned int sig) {
     Flag flag = (Flag)(sig & 0xf);
-    unsigned char key;
 
     switch (flag) {
         case DRAW:
         case DRAW_HI_RES:
+            trace_instant("DRW");
+            // The render thread draws whole frames on its own
+            if (is_renderer_threaded()) break;
+            begin_render();
             draw(get_video_mem(), sig, flag == DRAW_HI_RES);
+            end_render();
             break;
 
         case CLEAR:
+            trace_instant("CLS");
+            if (is_renderer_threaded()) break;
+            begin_render();
             clear_screen();
+            end_render();
             break;
 
         case SCROLL:
+            trace_instant("SCROLL");
+            if (is_renderer_threaded()) break;
+            begin_render();
             draw_all(get_video_mem(), get_hi_res());
+            end_render();
             break;
 
         case KEYBOARD_BLOCKING:
-            key = get_key(keys, KEYBOARD_BLOCKING);
-            load_key(KEYBOARD_UNSET, key);
+            load_key(KEYBOARD_UNSET, frame_keys);
             break;
 
         case KEYBOARD_NONBLOCKING:
-            key = get_key(keys, KEYBOARD_NONBLOCKING);
-            skip_key(KEYBOARD_UNSET, KEYBOARD_UNSET, key);
+            skip_key(KEYBOARD_UNSET, false, frame_keys);
             break;
 
         default:
@@ -110,26 +166,528 @@ void update_io(unsigned int sig, bool *keys) {
 }
 
 void print_help() {
-    printf("Usage: ./chip8_emu [-dsh] [-t <tick_speed>] <program_path>\n\n");
+    printf(
+        "Usage: ./chip8_emu [-dsiph] [-t <tick_speed>] [-R <record_file>] "
+        "[-l <state_file>] [-m <rewind_size>] [-a <frames>] [-S <seed>] "
+        "[-M <movie_file>] [-P <movie_file>] [-x <shm_name>] "
+        "[-O <profile_file>] [-j <pacing_file>] [-T <trace_file>] "
+        "[-B <dump_file>] [-b <breakpoint>] [-w <addr>[-<end>]] [-e] "
+        "<program_path>\n\n");
     printf("Options:\n");
     printf(" -d                Enter debugging mode\n");
     printf(" -s                Enable super-chip8 quirks\n");
+    printf(" -i                Render inline (without the render thread)\n");
+    printf(" -p                Print performance counters on exit\n");
+    printf(" -R <record_file>  Record every frame (for chip8_bench)\n");
+    printf(" -l <state_file>   Start from a saved state\n");
+    printf(" -m <rewind_size>  Set rewind buffer size in MB (default 16, 0 "
+           "disables)\n");
     printf(" -t <tick_speed>   Set tick speed (default 900)\n");
+    printf(" -a <frames>       Run ahead to hide input lag (default 0)\n");
+    printf(" -S <seed>         Seed the random number generator\n");
+    printf(" -M <movie_file>   Record the keys of every frame to a movie\n");
+    printf(" -P <movie_file>   Replay a movie without a terminal, timing it\n");
+    printf(" -x <shm_name>     Publish every frame to shared memory (e.g. "
+           "/chip8)\n");
+    printf(" -O <profile_file> Count every instruction and write a profile "
+           "on exit\n");
+    printf(" -j <pacing_file>  Write frame pacing histograms on exit (- "
+           "prints them)\n");
+    printf(" -T <trace_file>   Write a timeline of every frame for Perfetto "
+           "(Chrome trace JSON)\n");
+    printf(" -B <dump_file>    Dump the last instructions on a crash or "
+           "SIGUSR1 (default\n                   <program_path>.trace)\n");
+    printf(" -b <breakpoint>   Pause before an instruction, at a hex pc or "
+           "when conditions\n                   hold (e.g. 2a4,V3==5 or "
+           "I>=0xea0)\n");
+    printf(" -w <addr>[-<end>] Pause after a write to memory (hex "
+           "addresses)\n");
+    printf(" -e                Pause before an illegal opcode or a stack "
+           "overflow\n");
+    printf("                   (F8 continues, F10 steps one instruction, "
+           "with Shift they go\n                   back in time)\n");
     printf(" -h                Displays this message and version number\n");
 }
 
+bool should_print_perf = false;
+const char *shared_name = NULL;
+SharedFrames *shared_frames = NULL;
+const char *profile_path = NULL;
+// Only touched with -O, so it costs nothing otherwise
+Profile profile;
+
+void print_perf() {
+    RenderStats stats;
+    get_render_stats(&stats);
+    printf("Frames: produced %lu, presented %lu, dropped %lu\n",
+           stats.produced, stats.presented, stats.dropped);
+    if (!is_rewind_enabled()) return;
+    RewindStats rewind_stats;
+    get_rewind_stats(&rewind_stats);
+    printf("Rewind: %lu snapshots (%lu keyframes) in %zu of %zu bytes\n",
+           rewind_stats.snapshots, rewind_stats.keyframes, rewind_stats.bytes,
+           rewind_stats.size);
+}
+
+// Shows the whole video buffer, not just what the last instruction drew
+void present_machine(bool is_flashing) {
+    if (!is_renderer_threaded()) {
+        begin_render();
+        draw_all(get_video_mem(), get_hi_res());
+        refresh();
+        end_render();
+    }
+    publish_frame(get_video_mem(), get_hi_res(), is_flashing);
+}
+
+char state_path[MAX_PATH_SIZE];
+
+// The last instructions that ran, written on a crash or SIGUSR1
+InstTrace recent_instructions;
+char inst_trace_path[MAX_PATH_SIZE];
+
+int dump_inst_trace() {
+    return write_inst_trace(&recent_instructions, inst_trace_path,
+                            get_machine()->has_superchip8_quirks);
+}
+
+// Tells where the trace went when the rom crashed
+void dump_crash_trace() {
+    if (get_error() == NULL) return;
+    if (dump_inst_trace() == 1) {
+        printf("Error writing the instruction trace to %s.\n",
+               inst_trace_path);
+        return;
+    }
+    printf("The last instructions are in %s (see chip8_itrace).\n",
+           inst_trace_path);
+}
+
+// Set by SIGTERM, the main loop quits on the next frame. Tearing down in the
+// handler isn't safe, it could interrupt the loop anywhere.
+volatile sig_atomic_t should_quit = 0;
+
+void handle_quit_signal(int sig) { should_quit = 1; }
+
+void handle_dump_signal(int sig) {
+    dump_inst_trace();
+    if (sig == SIGUSR1) return;
+    // Crash the way it would have
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+Movie movie;
+unsigned char state_buffer[STATE_SIZE];
+
+unsigned int get_state_hash() {
+    export_state(state_buffer);
+    return hash_bytes(state_buffer, STATE_SIZE);
+}
+
+void push_state() {
+    if (!is_rewind_enabled()) return;
+    export_state(state_buffer);
+    push_snapshot(state_buffer);
+}
+
+// F5 saves the state next to the program, F9 loads it back
+void handle_state_hotkeys() {
+    if (was_hotkey_pressed(HOTKEY_SAVE_STATE)) save_state(state_path);
+    // A recorded movie only replays if the machine never jumps in time
+    if (was_hotkey_pressed(HOTKEY_LOAD_STATE) && movie.file == NULL &&
+        load_state(state_path) == 0) {
+        reset_history();
+        present_machine(false);
+    }
+}
+
+// Goes one frame back in time, called every frame the rewind key is held
+unsigned int rewind_frame() {
+    const void *state = pop_snapshot();
+    if (state == NULL) return IDLE;
+    if (restore_state(state) == 1) {
+        set_error("Out of memory");
+        return EXIT;
+    }
+    reset_history();
+    present_machine(false);
+    return IDLE;
+}
+
+bool is_overlay_shown = false;
+// Counted by the main loop since the overlay was last updated
+unsigned long overlay_start, overlay_cycles, overlay_frames, overlay_sleep;
+bool was_behind;
+RenderStats overlay_render_stats;
+WriteCounts overlay_write_counts;
+
+void reset_overlay() {
+    overlay_start = get_time();
+    overlay_cycles = get_machine()->cycles;
+    overlay_frames = 0;
+    overlay_sleep = 0;
+    was_behind = false;
+    get_render_stats(&overlay_render_stats);
+    get_write_counts(&overlay_write_counts);
+}
+
+// F7 toggles a status line with the speed of the emulation and the renderer
+void update_overlay(int tick_speed) {
+    if (was_hotkey_pressed(HOTKEY_OVERLAY)) {
+        is_overlay_shown = !is_overlay_shown;
+        show_status_line((is_overlay_shown) ? "..." : NULL);
+        reset_overlay();
+    }
+    unsigned long elapsed = get_time() - overlay_start;
+    if (!is_overlay_shown || elapsed < OVERLAY_INTERVAL) return;
+
+    double seconds = elapsed / 1000000.0;
+    // Rewinding and loading states take cycles back
+    unsigned long cycles = get_machine()->cycles;
+    unsigned long instructions =
+        (cycles > overlay_cycles) ? (cycles - overlay_cycles) / 3 : 0;
+    RenderStats render_stats;
+    WriteCounts write_counts;
+    get_render_stats(&render_stats);
+    get_write_counts(&write_counts);
+    unsigned long presented =
+        render_stats.presented - overlay_render_stats.presented;
+    unsigned long render_time =
+        render_stats.render_time - overlay_render_stats.render_time;
+
+    char state[32];
+    if (was_behind)
+        snprintf(state, sizeof(state), "behind");
+    else
+        snprintf(state, sizeof(state), "idle %.0f%%",
+                 100.0 * overlay_sleep / elapsed);
+    char text[256];
+    snprintf(text, sizeof(text),
+             "%.0f/%.0f ips | %.1f fps | render %.2f ms/frame | "
+             "%.1f KB/s out | %lu dropped | %s",
+             instructions / seconds, 1000000.0 / tick_speed,
+             overlay_frames / seconds,
+             (presented > 0) ? render_time / 1000.0 / presented : 0,
+             (write_counts.bytes - overlay_write_counts.bytes) / seconds /
+                 1024,
+             render_stats.dropped, state);
+    show_status_line(text);
+    reset_overlay();
+}
+
+int runahead_frames = 0;
+int num_slow_frames = 0;
+bool was_runahead_stopped = false;
+
+// Turns run-ahead off when it keeps taking most of the frame
+void check_runahead_time(unsigned long time) {
+    num_slow_frames = (time > RUNAHEAD_MAX_TIME) ? num_slow_frames + 1 : 0;
+    if (num_slow_frames < RUNAHEAD_MAX_SLOW_FRAMES) return;
+    runahead_frames = 0;
+    was_runahead_stopped = true;
+}
+
+// Shows the frame `runahead_frames` later as if the keys stayed the same, so
+// games that react to keys a frame or more late seem to react right away. The
+// machine that ran ahead gets thrown away.
+void run_ahead(unsigned short keys, int tick_speed, long cycle_budget,
+               Flag flag) {
+    // Kept between frames, so its pages don't get allocated every time
+    static Chip8 ahead;
+    unsigned long start = get_time();
+    Chip8 *machine = get_machine();
+    if (copy_machine(&ahead, machine) == 1) {
+        // Not enough memory to run ahead, show the frame as it is
+        present_machine(flag == SOUND);
+        return;
+    }
+    set_machine(&ahead);
+    // What runs ahead gets thrown away, it doesn't belong in the trace
+    set_inst_trace(NULL);
+    for (int i = 0; i < runahead_frames && flag != EXIT; i++) {
+        flag = run_frame(keys, next_frame_cycles(tick_speed, &cycle_budget));
+    }
+    present_machine(flag == SOUND);
+    set_machine(machine);
+    set_inst_trace(&recent_instructions);
+    check_runahead_time(get_time() - start);
+}
+
+// Runs a frame like `run_frame()`, counting its instructions with -O
+Flag run_counted_frame(unsigned short keys, long num_cycles) {
+    if (profile_path != NULL) {
+        return run_profiled_frame(&profile, keys, num_cycles);
+    }
+    return run_frame(keys, num_cycles);
+}
+
+// Runs the frame headless with the keys read at its start, so that the same
+// keys on the same frames always give the same run
+unsigned int run_sampled_frame(unsigned long frame, int tick_speed,
+                               long *cycle_budget) {
+    unsigned short keys = frame_keys;
+    record_keys(&movie, frame, keys);
+    unsigned long start = (pacing_path != NULL) ? get_pacing_time() : 0;
+    Flag flag =
+        run_counted_frame(keys, next_frame_cycles(tick_speed, cycle_budget));
+    if (pacing_path != NULL)
+        record_value(&pacing[PACING_CYCLES], get_pacing_time() - start);
+    record_interval(PACING_TIMERS, &last_timers);
+    if (record_file != NULL) record(flag == SOUND);
+    if (flag == EXIT) return EXIT;
+    if (runahead_frames > 0)
+        run_ahead(keys, tick_speed, *cycle_budget, flag);
+    else
+        present_machine(flag == SOUND);
+    return flag;
+}
+
+// Replays a movie without a terminal, as fast as possible
+int replay(Movie *replayed) {
+    long cycle_budget = 0;
+    unsigned long frame;
+    Flag flag = IDLE;
+    unsigned long start_cycles = get_machine()->cycles;
+    unsigned long start = get_time();
+    for (frame = 0;
+         !is_movie_over(replayed, frame) && flag != EXIT && !should_quit;
+         frame++) {
+        long num_cycles =
+            next_frame_cycles(replayed->header.tick_speed, &cycle_budget);
+        flag = run_counted_frame(replay_keys(replayed, frame), num_cycles);
+    }
+    unsigned long num_cycles = get_machine()->cycles - start_cycles;
+    double seconds = (get_time() - start) / 1000000.0;
+    if (seconds <= 0) seconds = 1e-6;
+
+    print_error();
+    dump_crash_trace();
+    printf("Replayed %lu frames (%lu instructions) in %.3f s, "
+           "%.0f instructions/s\n",
+           frame, num_cycles / 3, seconds, num_cycles / 3 / seconds);
+    printf("State hash: %08x\n", get_state_hash());
+    if (profile_path != NULL &&
+        write_profile(&profile, profile_path,
+                      get_machine()->has_superchip8_quirks) == 1) {
+        printf("Error writing the profile to %s.\n", profile_path);
+        return 1;
+    }
+    return 0;
+}
+
+// Runs the frame's cycles, timing next_cycle and update_io apart with -j
+unsigned int run_timed_cycles(long num_cycles) {
+    unsigned int flag = IDLE;
+    if (pacing_path == NULL) {
+        for (long i = 0; i < num_cycles && flag != EXIT; i++) {
+            flag = next_cycle();
+            if ((flag & 0xf) != IDLE) update_io(flag);
+        }
+        return flag;
+    }
+    unsigned long start = get_pacing_time();
+    unsigned long io_time = 0;
+    for (long i = 0; i < num_cycles && flag != EXIT; i++) {
+        flag = next_cycle();
+        // Most cycles have nothing to do, don't time those
+        if ((flag & 0xf) == IDLE) continue;
+        unsigned long io_start = get_pacing_time();
+        update_io(flag);
+        io_time += get_pacing_time() - io_start;
+    }
+    record_value(&pacing[PACING_CYCLES],
+                 get_pacing_time() - start - io_time);
+    record_value(&pacing[PACING_IO], io_time);
+    return flag;
+}
+
+bool is_paused = false;
+
+// Shows where the machine stopped and its registers in the status line
+void show_break(const char *reason) {
+    const Chip8 *machine = get_machine();
+    AsmStatement statement = {0};
+    decode_dasm(&statement, machine->opcode, machine->has_superchip8_quirks);
+    char text[256];
+    int length = snprintf(text, sizeof(text), "%s | %03x %s",
+                          reason, machine->pc - 2,
+                          statement.name);
+    for (int i = 0; i < statement.num_args; i++) {
+        length += snprintf(text + length, sizeof(text) - length, "%s %s",
+                           (i == 0) ? "" : ",", statement.args[i]);
+    }
+    length += snprintf(text + length, sizeof(text) - length, " | I %03x |",
+                       machine->I);
+    for (int i = 0; i < 16; i++) {
+        length += snprintf(text + length, sizeof(text) - length, " %02x",
+                           machine->V[i]);
+    }
+    show_status_line(text);
+}
+
+// Runs the frame's cycles checking the breakpoints before and the
+// watchpoints after every instruction, only used when there are any. The
+// keys are read once, so the history can run it again the same way.
+unsigned int run_checked_cycles(unsigned short keys, long num_cycles) {
+    unsigned int flag = IDLE;
+    const Chip8 *machine = get_machine();
+    log_keys(keys);
+    for (long i = 0; i < num_cycles && flag != EXIT; i++) {
+        bool is_executing = machine->clock == 2;
+        if (is_executing) update_history();
+        if (is_executing && should_break_before()) {
+            is_paused = true;
+            break;
+        }
+        flag = next_cycle();
+        if ((flag & 0xf) == KEYBOARD_BLOCKING)
+            load_key(KEYBOARD_UNSET, keys);
+        else if ((flag & 0xf) == KEYBOARD_NONBLOCKING)
+            skip_key(KEYBOARD_UNSET, false, keys);
+        else if ((flag & 0xf) != IDLE)
+            update_io(flag);
+        if (is_executing && should_break_after()) {
+            // Stop before the next instruction, like the breakpoints
+            next_cycle();
+            next_cycle();
+            is_paused = true;
+            break;
+        }
+    }
+    if (is_paused) show_break(get_break_reason());
+    return flag;
+}
+
+// Goes back in the history to the instruction before, or to the last
+// breakpoint
+unsigned int travel_back(bool is_continuing) {
+    // What gets run again is already in the trace
+    set_inst_trace(NULL);
+    int status = (is_continuing) ? reverse_continue() : reverse_step();
+    set_inst_trace(&recent_instructions);
+    // A checkpoint that couldn't be restored left the machine half-way
+    if (get_error() != NULL) return EXIT;
+    present_machine(false);
+    show_break((status == 0) ? get_history_reason() : "no history before");
+    return IDLE;
+}
+
+// F8 continues from a breakpoint, F10 runs the instruction it stopped at,
+// with Shift they go back in time
+unsigned int run_paused_frame() {
+    unsigned int flag = IDLE;
+    if (was_hotkey_pressed(HOTKEY_CONTINUE)) {
+        is_paused = false;
+        skip_breakpoints_once();
+        show_status_line(NULL);
+    } else if (was_hotkey_pressed(HOTKEY_STEP)) {
+        is_paused = false;
+        skip_breakpoints_once();
+        // Execute, then fetch and decode the next one
+        flag = run_checked_cycles(frame_keys, 3);
+        if (!is_paused && flag != EXIT) {
+            is_paused = true;
+            show_break("step");
+        }
+    } else if (was_hotkey_pressed(HOTKEY_REVERSE_STEP)) {
+        flag = travel_back(false);
+    } else if (was_hotkey_pressed(HOTKEY_REVERSE_CONTINUE)) {
+        flag = travel_back(true);
+    }
+    return flag;
+}
+
+// Records the drawing done since the last frame, on any thread
+void record_render_time() {
+    if (pacing_path == NULL) return;
+    RenderStats stats;
+    get_render_stats(&stats);
+    record_value(&pacing[PACING_RENDER],
+                 (stats.render_time - last_render_time) * 1000);
+    last_render_time = stats.render_time;
+}
+
+// Sleeps until the next frame, recording how much longer it took
+void sleep_frame(long delta) {
+    unsigned long span = begin_span();
+    unsigned long start = (pacing_path != NULL) ? get_pacing_time() : 0;
+    usleep(delta);
+    end_span("sleep", span);
+    overlay_sleep += delta;
+    if (pacing_path == NULL) return;
+    unsigned long slept = get_pacing_time() - start;
+    unsigned long requested = (unsigned long)delta * 1000;
+    record_value(&pacing[PACING_OVERSHOOT],
+                 (slept > requested) ? slept - requested : 0);
+}
+
+int write_pacing(const char *path) {
+    bool is_stdout = strcmp(path, "-") == 0;
+    FILE *file = (is_stdout) ? stdout : fopen(path, "w");
+    if (file == NULL) return 1;
+    print_histogram_header(file, "us");
+    for (int i = 0; i < NUM_PACING; i++) {
+        print_histogram(file, pacing_names[i], &pacing[i], 1000);
+    }
+    if (is_stdout) return 0;
+    return (fclose(file) == 0) ? 0 : 1;
+}
+
 void program_exit() {
-    endwin();
+    stop_renderer();
     print_error();
+    dump_crash_trace();
+    if (should_print_perf) print_perf();
+    if (was_runahead_stopped) {
+        printf("Run-ahead was turned off, it was too slow.\n");
+        was_runahead_stopped = false;
+    }
+    stop_rewind();
+    stop_history();
+    if (shared_frames != NULL) {
+        remove_shared_frames(shared_frames, shared_name);
+        shared_frames = NULL;
+    }
+    close_movie(&movie);
+    if (record_file != NULL) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+    if (profile_path != NULL) {
+        if (write_profile(&profile, profile_path,
+                          get_machine()->has_superchip8_quirks) == 1) {
+            printf("Error writing the profile to %s.\n", profile_path);
+        }
+        profile_path = NULL;
+    }
+    if (pacing_path != NULL) {
+        if (write_pacing(pacing_path) == 1) {
+            printf("Error writing the pacing histograms to %s.\n",
+                   pacing_path);
+        }
+        pacing_path = NULL;
+    }
+    if (stop_trace() == 1) printf("Error writing the trace.\n");
 }
 
 int main(int argc, char *argv[]) {
     int status;
     int tick_speed = DEFAULT_TICK_SPEED;
-    signal(SIGTERM, program_exit);
+    bool should_render_inline = false;
+    const char *load_path = NULL;
+    int rewind_size = DEFAULT_REWIND_SIZE;
+    unsigned long long seed = time(NULL);
+    const char *movie_path = NULL;
+    const char *replay_path = NULL;
+    const char *trace_path = NULL;
+    signal(SIGTERM, handle_quit_signal);
+
+    // Before the options, so the quirks don't get reset
+    init_chip8();
 
     char c;
-    while ((c = getopt(argc, argv, "dst:h")) != -1) {
+    while ((c = getopt(argc, argv,
+                       "dsipt:R:l:m:a:S:M:P:x:O:j:T:B:b:w:eh")) != -1) {
         switch (c) {
             case 'd':
                 set_debug();
@@ -137,6 +695,67 @@ int main(int argc, char *argv[]) {
             case 's':
                 set_superchip8_quirks();
                 break;
+            case 'i':
+                should_render_inline = true;
+                break;
+            case 'p':
+                should_print_perf = true;
+                break;
+            case 'R':
+                record_file = fopen(optarg, "w");
+                if (record_file == NULL) {
+                    printf("Error opening %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                load_path = optarg;
+                break;
+            case 'a':
+                runahead_frames = atoi(optarg);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'M':
+                movie_path = optarg;
+                break;
+            case 'P':
+                replay_path = optarg;
+                break;
+            case 'x':
+                shared_name = optarg;
+                break;
+            case 'O':
+                profile_path = optarg;
+                break;
+            case 'j':
+                pacing_path = optarg;
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'B':
+                snprintf(inst_trace_path, MAX_PATH_SIZE, "%s", optarg);
+                break;
+            case 'b':
+                if (add_breakpoint(optarg) == 1) {
+                    printf("Error: can't set breakpoint %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w':
+                if (add_watchpoint(optarg) == 1) {
+                    printf("Error: can't set watchpoint %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'e':
+                set_break_on_errors();
+                break;
+            case 'm':
+                rewind_size = atoi(optarg);
+                break;
             case 't':
                 tick_speed = atoi(optarg);
                 if (tick_speed == 0) tick_speed = DEFAULT_TICK_SPEED;
@@ -157,6 +776,13 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Those run their cycles elsewhere, without the checks
+    if (has_breakpoints() && (runahead_frames > 0 || movie_path != NULL ||
+                              profile_path != NULL || replay_path != NULL)) {
+        printf("Error: breakpoints don't work with -a, -M, -O or -P.\n");
+        return 1;
+    }
+
     // Get the first non-option argument
     const char *program_path = argv[optind];
     if (program_path == NULL) {
@@ -164,17 +790,89 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    Movie replayed;
+    if (replay_path != NULL) {
+        if (open_movie(&replayed, replay_path) == 1) {
+            printf("Error opening movie %s.\n", replay_path);
+            return 1;
+        }
+        if (replayed.header.superchip8_quirks) set_superchip8_quirks();
+        seed = replayed.header.seed;
+    }
     // For RND instruction
-    srand(time(NULL));
+    seed_random(seed);
 
-    init_chip8();
     status = load_program(program_path);
     if (status == 1) {
         printf("Exiting...\n");
         return 1;
     }
+    if (load_path != NULL && load_state(load_path) == 1) {
+        printf("Error loading state %s.\n", load_path);
+        return 1;
+    }
+    snprintf(state_path, MAX_PATH_SIZE, "%s.state", program_path);
+    if (inst_trace_path[0] == '\0') {
+        snprintf(inst_trace_path, MAX_PATH_SIZE, "%s.trace", program_path);
+    }
+    set_inst_trace(&recent_instructions);
+    signal(SIGUSR1, handle_dump_signal);
+    signal(SIGSEGV, handle_dump_signal);
+    signal(SIGBUS, handle_dump_signal);
+    signal(SIGFPE, handle_dump_signal);
+    signal(SIGABRT, handle_dump_signal);
 
-    while (should_debug()) {
+    unsigned int state_hash = get_state_hash();
+    if (replay_path != NULL) {
+        if (state_hash != replayed.header.state_hash) {
+            printf("The movie starts from a different program or state.\n");
+            close_movie(&replayed);
+            return 1;
+        }
+        status = replay(&replayed);
+        close_movie(&replayed);
+        return status;
+    }
+    if (movie_path != NULL) {
+        MovieHeader header = {.seed = seed,
+                              .tick_speed = tick_speed,
+                              .superchip8_quirks =
+                                  get_machine()->has_superchip8_quirks,
+                              .state_hash = state_hash};
+        if (create_movie(&movie, movie_path, &header) == 1) {
+            printf("Error opening %s.\n", movie_path);
+            return 1;
+        }
+        // Rewinding would make the movie useless
+        rewind_size = 0;
+    }
+    if (rewind_size > 0 && init_rewind((size_t)rewind_size << 20) == 1) {
+        printf("Error allocating the rewind buffer.\n");
+        return 1;
+    }
+    if (has_breakpoints() && init_history() == 1) {
+        printf("Error allocating the history.\n");
+        return 1;
+    }
+
+    if (shared_name != NULL &&
+        (shared_frames = create_shared_frames(shared_name)) == NULL) {
+        if (errno == EEXIST) {
+            printf("Error: shared memory %s already exists, another emulator "
+                   "may be using it (if one crashed, remove /dev/shm%s).\n",
+                   shared_name, shared_name);
+        } else {
+            printf("Error creating shared memory %s.\n", shared_name);
+        }
+        return 1;
+    }
+    // Before the render thread starts, so it gets traced too
+    if (trace_path != NULL && start_trace(trace_path) == 1) {
+        printf("Error opening %s.\n", trace_path);
+        return 1;
+    }
+
+    while (should_debug() && !should_quit) {
         // clear screen
         printf("\e[1;1H\e[2J");
         next_cycle();
@@ -184,19 +882,62 @@ int main(int argc, char *argv[]) {
         fgetc(stdin);
     }
 
-    init_graphics();
-    bool is_key_pressed[16];
+    count_writes(fileno(stdout));
+    init_renderer(!should_render_inline);
     unsigned int flag = IDLE;
+    long cycle_budget = 0;
+    unsigned long frame = 0;
+    unsigned long next_frame = get_time();
     while (flag != EXIT) {
-        unsigned long start = get_time();
-        handle_win_size(get_video_mem(), get_hi_res());
-        handle_xset_message();
-        flag = next_cycle();
-        update_io(flag, is_key_pressed);
-        update_timers(is_key_pressed);
-        unsigned long delta = get_time() - start;
-        // divide by 3 because fetch-decode and then execute
-        if (delta < tick_speed / 3) usleep(tick_speed / 3 - delta);
+        record_interval(PACING_FRAME, &last_frame_start);
+        if (!is_renderer_threaded()) {
+            handle_win_size(get_video_mem(), get_hi_res());
+            if (get_keypad_mode() == KEYPAD_LEGACY) handle_xset_message();
+        }
+
+        // Run one frame worth of cycles, then sleep until the next frame
+        read_keys();
+        unsigned long span = begin_span();
+        if (is_hotkey_down(HOTKEY_REWIND) && is_rewind_enabled()) {
+            flag = rewind_frame();
+        } else if (runahead_frames > 0 || movie.file != NULL ||
+                   profile_path != NULL) {
+            flag = run_sampled_frame(frame++, tick_speed, &cycle_budget);
+            push_state();
+        } else if (is_paused) {
+            flag = run_paused_frame();
+        } else if (has_breakpoints()) {
+            long num_cycles = next_frame_cycles(tick_speed, &cycle_budget);
+            flag = run_checked_cycles(frame_keys, num_cycles);
+            update_timers();
+            log_timers();
+            push_state();
+        } else {
+            long num_cycles = next_frame_cycles(tick_speed, &cycle_budget);
+            flag = run_timed_cycles(num_cycles);
+            update_timers();
+            push_state();
+        }
+        end_span("emulate", span);
+        if (flag == EXIT) trace_instant("EXIT");
+        if (shared_frames != NULL) {
+            publish_shared_frame(shared_frames, get_machine()->st != 0);
+        }
+        if (was_hotkey_pressed(HOTKEY_QUIT) || should_quit) flag = EXIT;
+        handle_state_hotkeys();
+        overlay_frames++;
+        update_overlay(tick_speed);
+        record_render_time();
+
+        next_frame += FRAME_TIME;
+        long delta = (long)(next_frame - get_time());
+        if (delta > 0) {
+            sleep_frame(delta);
+        } else {
+            was_behind = true;
+            // Fell too far behind, don't catch up
+            if (-delta > FRAME_TIME) next_frame = get_time();
+        }
     }
     program_exit();
     return 0;
@@ -0,0 +1,128 @@
+#include "movie.h"
+
+#include "chip8.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MOVIE_MAGIC "C8MV"
+
+// Writes the header as fixed little-endian fields
+int write_header(FILE *file, const MovieHeader *header) {
+    unsigned char bytes[MOVIE_HEADER_SIZE];
+    unsigned char *p = bytes + sizeof(header->magic);
+    memcpy(bytes, header->magic, sizeof(header->magic));
+    put_le(&p, header->version, 4);
+    put_le(&p, header->seed, 8);
+    put_le(&p, header->tick_speed, 4);
+    put_le(&p, header->superchip8_quirks, 4);
+    put_le(&p, header->state_hash, 4);
+    put_le(&p, header->reserved, 4);
+    return fwrite(bytes, sizeof(bytes), 1, file) != 1;
+}
+
+// Reads the header written by `write_header()`
+int read_header(FILE *file, MovieHeader *header) {
+    unsigned char bytes[MOVIE_HEADER_SIZE];
+    if (fread(bytes, sizeof(bytes), 1, file) != 1) return 1;
+    const unsigned char *p = bytes + sizeof(header->magic);
+    memcpy(header->magic, bytes, sizeof(header->magic));
+    header->version = get_le(&p, 4);
+    header->seed = get_le(&p, 8);
+    header->tick_speed = get_le(&p, 4);
+    header->superchip8_quirks = get_le(&p, 4);
+    header->state_hash = get_le(&p, 4);
+    header->reserved = get_le(&p, 4);
+    return 0;
+}
+
+int create_movie(Movie *movie, const char *movie_path, MovieHeader *header) {
+    movie->file = fopen(movie_path, "w");
+    if (movie->file == NULL) return 1;
+    memcpy(header->magic, MOVIE_MAGIC, sizeof(header->magic));
+    header->version = MOVIE_VERSION;
+    header->reserved = 0;
+    movie->header = *header;
+    movie->is_recording = true;
+    movie->keys = 0;
+    movie->last_frame = 0;
+    if (write_header(movie->file, header) != 0) {
+        fclose(movie->file);
+        movie->file = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the next change, a missing end counts as the end
+void read_next_input(Movie *movie) {
+    unsigned char bytes[MOVIE_INPUT_SIZE];
+    const unsigned char *p = bytes;
+    if (fread(bytes, sizeof(bytes), 1, movie->file) == 1) {
+        movie->next.frame = get_le(&p, 4);
+        movie->next.keys = get_le(&p, 4);
+    } else {
+        movie->next.frame = movie->last_frame;
+        movie->next.keys = MOVIE_END;
+    }
+    movie->last_frame = movie->next.frame;
+}
+
+int open_movie(Movie *movie, const char *movie_path) {
+    movie->file = fopen(movie_path, "r");
+    if (movie->file == NULL) return 1;
+    MovieHeader *header = &movie->header;
+    if (read_header(movie->file, header) != 0 ||
+        memcmp(header->magic, MOVIE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MOVIE_VERSION) {
+        fclose(movie->file);
+        movie->file = NULL;
+        return 1;
+    }
+    movie->is_recording = false;
+    movie->keys = 0;
+    movie->last_frame = 0;
+    read_next_input(movie);
+    return 0;
+}
+
+void write_input(Movie *movie, unsigned long frame, unsigned int keys) {
+    unsigned char bytes[MOVIE_INPUT_SIZE];
+    unsigned char *p = bytes;
+    put_le(&p, frame, 4);
+    put_le(&p, keys, 4);
+    if (fwrite(bytes, sizeof(bytes), 1, movie->file) != 1) {
+        // Keep the movie that made it to the file
+        fclose(movie->file);
+        movie->file = NULL;
+    }
+}
+
+void record_keys(Movie *movie, unsigned long frame, unsigned short keys) {
+    if (movie->file == NULL) return;
+    movie->last_frame = frame;
+    if (keys == movie->keys) return;
+    movie->keys = keys;
+    write_input(movie, frame, keys);
+}
+
+unsigned short replay_keys(Movie *movie, unsigned long frame) {
+    while (movie->file != NULL && movie->next.keys != MOVIE_END &&
+           movie->next.frame <= frame) {
+        movie->keys = movie->next.keys;
+        read_next_input(movie);
+    }
+    return movie->keys;
+}
+
+bool is_movie_over(Movie *movie, unsigned long frame) {
+    return movie->next.keys == MOVIE_END && frame > movie->next.frame;
+}
+
+void close_movie(Movie *movie) {
+    if (movie->file == NULL) return;
+    if (movie->is_recording) write_input(movie, movie->last_frame, MOVIE_END);
+    if (movie->file != NULL) fclose(movie->file);
+    movie->file = NULL;
+}
@@ -0,0 +1,81 @@
+#include <config.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "shared_frame.h"
+
+void print_help() {
+    printf("Usage: ./chip8_peek [-h] [-n <frames>] <shm_name>\n\n");
+    printf("Prints the frames a chip8_emu started with -x <shm_name> "
+           "publishes.\n");
+    printf("Options:\n");
+    printf(" -n <frames>  Stop after this many frames (default: until the "
+           "emulator exits)\n");
+    printf(" -h           Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long max_frames = 0;
+
+    char c;
+    while ((c = getopt(argc, argv, "n:h")) != -1) {
+        switch (c) {
+            case 'n':
+                max_frames = strtoul(optarg, NULL, 10);
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+    if (argc - 1 != optind) {
+        print_help();
+        return 1;
+    }
+    const char *name = argv[optind];
+
+    const SharedFrames *shared = open_shared_frames(name);
+    if (shared == NULL) {
+        printf("Error opening shared memory %s.\n", name);
+        return 1;
+    }
+
+    unsigned long num_frames = 0, last_frame = 0, num_missed = 0;
+    bool has_frame = false;
+    while (max_frames == 0 || num_frames < max_frames) {
+        unsigned long sequence;
+        const SharedFrame *frame = begin_shared_read(shared, &sequence);
+        if (frame == NULL || (has_frame && frame->frame == last_frame)) {
+            // Readers keep the segment mapped after the emulator exits
+            if (!atomic_load((atomic_uint *)&shared->is_running)) break;
+            usleep(FRAME_TIME / 4);
+            continue;
+        }
+        // Everything gets read before checking that it's consistent
+        unsigned long number = frame->frame;
+        unsigned int hash = hash_bytes(frame->video_mem, SIZE_VIDEO_MEM);
+        unsigned short pc = frame->pc, I = frame->I;
+        unsigned long cycles = frame->cycles;
+        bool hi_res = frame->hi_res;
+        if (!end_shared_read(shared, frame, sequence)) continue;
+
+        if (has_frame) num_missed += number - last_frame - 1;
+        printf("frame %lu: %08x PC: %04x I: %04x cycles: %lu%s\n", number,
+               hash, pc, I, cycles, (hi_res) ? " hi-res" : "");
+        fflush(stdout);
+        last_frame = number;
+        has_frame = true;
+        num_frames++;
+    }
+    fprintf(stderr, "%lu frames, %lu missed\n", num_frames, num_missed);
+    close_shared_frames(shared);
+    return 0;
+}
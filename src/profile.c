@@ -0,0 +1,242 @@
+#include "profile.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "dasm.h"
+#include "ops.h"
+
+#define NUM_HOT_PCS 32
+#define NUM_HOT_LOOPS 16
+#define MAX_CLASSES 64
+#define MAX_CLASS_SIZE 32
+
+void init_profile(Profile *profile) { memset(profile, 0, sizeof(Profile)); }
+
+// Counts an instruction that ran at pc, after it ran
+void count_instruction(Profile *profile, unsigned short pc,
+                       unsigned short opcode) {
+    const Chip8 *machine = get_machine();
+    pc %= SIZE_MEMORY;
+    profile->instructions++;
+    profile->pc_counts[pc]++;
+    profile->pc_opcodes[pc] = opcode;
+    profile->opcode_counts[opcode]++;
+
+    bool is_key_wait = (opcode & 0xf0ff) == 0xf00a && machine->pc == pc;
+    if (is_key_wait) profile->key_waits++;
+    if (FOURTH(opcode) == 0xd) {
+        profile->draws++;
+        profile->rows_drawn += (FIRST(opcode) == 0) ? 16 : FIRST(opcode);
+        profile->collisions += machine->V[0xf];
+    }
+    if ((opcode & 0xfff0) == 0x00c0 || opcode == 0x00fb || opcode == 0x00fc) {
+        profile->scrolls++;
+    }
+    // Returns aren't loops, even if the call was before them
+    if (machine->pc <= pc && !is_key_wait && opcode != 0x00ee) {
+        profile->loop_counts[pc]++;
+        profile->loop_targets[pc] = machine->pc;
+    }
+}
+
+Flag run_profiled_frame(Profile *profile, unsigned short keys,
+                        long num_cycles) {
+    Chip8 *machine = get_machine();
+    for (long i = 0; i < num_cycles; i++) {
+        // The next cycle executes the opcode fetched from pc - 2
+        bool is_execute = machine->clock == 2;
+        unsigned short pc = machine->pc - 2;
+        Flag flag = run_cycle(keys);
+        if (is_execute) count_instruction(profile, pc, machine->opcode);
+        if (flag == EXIT) return EXIT;
+    }
+    return decrement_timers();
+}
+
+// Index of the largest count not taken yet, -1 if only zeros are left
+int take_largest(const unsigned long *counts, int num_counts,
+                 bool *is_taken) {
+    int largest = -1;
+    for (int i = 0; i < num_counts; i++) {
+        if (is_taken[i] || counts[i] == 0) continue;
+        if (largest == -1 || counts[i] > counts[largest]) largest = i;
+    }
+    if (largest != -1) is_taken[largest] = true;
+    return largest;
+}
+
+double percent(unsigned long count, unsigned long total) {
+    return (total == 0) ? 0 : 100.0 * count / total;
+}
+
+// Writes the statement like chip8_dasm does, to a string
+void format_statement(char *dest, size_t size, const AsmStatement *statement) {
+    int length = snprintf(dest, size, "%s", statement->name);
+    for (int i = 0; i < statement->num_args && length < size; i++) {
+        length += snprintf(dest + length, size - length, "%s %s",
+                           (i == 0) ? "" : ",", statement->args[i]);
+    }
+}
+
+// The kind of an instruction: its statement with registers, numbers and
+// addresses replaced, like "ADD Vx, n"
+void get_class(char *dest, unsigned short opcode, bool has_quirks) {
+    AsmStatement statement = {0};
+    decode_dasm(&statement, opcode, has_quirks);
+    if (strcmp(statement.name, "NIL") == 0) {
+        snprintf(dest, MAX_CLASS_SIZE, "illegal");
+        return;
+    }
+    int num_registers = 0;
+    for (int i = 0; i < statement.num_args; i++) {
+        char *arg = statement.args[i];
+        if (arg[0] == 'V' && isxdigit(arg[1]) && arg[2] == '\0') {
+            strcpy(arg, (num_registers++ == 0) ? "Vx" : "Vy");
+        } else if (arg[0] == 'L' && isxdigit(arg[1])) {
+            strcpy(arg, "addr");
+        } else if (isdigit(arg[0])) {
+            strcpy(arg, "n");
+        }
+    }
+    format_statement(dest, MAX_CLASS_SIZE, &statement);
+}
+
+void write_flat_profile(FILE *file, const Profile *profile, bool has_quirks) {
+    char names[MAX_CLASSES][MAX_CLASS_SIZE];
+    unsigned long counts[MAX_CLASSES] = {0};
+    bool is_taken[MAX_CLASSES] = {false};
+    int num_classes = 0;
+    for (int opcode = 0; opcode < 0x10000; opcode++) {
+        if (profile->opcode_counts[opcode] == 0) continue;
+        char name[MAX_CLASS_SIZE];
+        get_class(name, opcode, has_quirks);
+        int i = 0;
+        while (i < num_classes && strcmp(names[i], name) != 0) i++;
+        if (i == num_classes && num_classes < MAX_CLASSES - 1) {
+            strcpy(names[num_classes++], name);
+        } else if (i == num_classes) {
+            // The last class takes whatever doesn't fit
+            i = MAX_CLASSES - 1;
+            strcpy(names[i], "other");
+            num_classes = MAX_CLASSES;
+        }
+        counts[i] += profile->opcode_counts[opcode];
+    }
+
+    fprintf(file, "\nFlat profile\n");
+    fprintf(file, "%14s %7s  %s\n", "instructions", "%", "instruction");
+    int i;
+    while ((i = take_largest(counts, num_classes, is_taken)) != -1) {
+        fprintf(file, "%14lu %6.2f%%  %s\n", counts[i],
+                percent(counts[i], profile->instructions), names[i]);
+    }
+}
+
+// Jumped to or called by instructions that ran, labeled like chip8_dasm does
+void find_labels(const Profile *profile, bool *is_label, bool has_quirks) {
+    memset(is_label, false, SIZE_MEMORY * sizeof(bool));
+    for (int pc = 0; pc < SIZE_MEMORY; pc++) {
+        if (profile->pc_counts[pc] == 0) continue;
+        AsmStatement statement = {0};
+        decode_dasm(&statement, profile->pc_opcodes[pc], has_quirks);
+        if (strcmp(statement.name, "JP") != 0 &&
+            strcmp(statement.name, "CALL") != 0) {
+            continue;
+        }
+        for (int i = 0; i < statement.num_args; i++) {
+            if (statement.args[i][0] != 'L') continue;
+            unsigned long addr = strtoul(statement.args[i] + 1, NULL, 16);
+            if (addr < SIZE_MEMORY) is_label[addr] = true;
+        }
+    }
+}
+
+// Writes pc relative to the closest label before it, like "L2A4+6"
+void format_label(char *dest, size_t size, const bool *is_label,
+                  unsigned short pc) {
+    int label = pc;
+    while (label >= 0 && !is_label[label]) label--;
+    if (label < 0)
+        snprintf(dest, size, "-");
+    else if (label == pc)
+        snprintf(dest, size, "L%03X", label);
+    else
+        snprintf(dest, size, "L%03X+%d", label, pc - label);
+}
+
+void write_hot_pcs(FILE *file, const Profile *profile, const bool *is_label,
+                   bool has_quirks) {
+    bool is_taken[SIZE_MEMORY] = {false};
+    fprintf(file, "\nHot pcs\n");
+    fprintf(file, "%14s %7s  %-4s %-10s %-6s %s\n", "instructions", "%", "pc",
+            "label", "opcode", "disassembly");
+    for (int n = 0; n < NUM_HOT_PCS; n++) {
+        int pc = take_largest(profile->pc_counts, SIZE_MEMORY, is_taken);
+        if (pc == -1) break;
+        unsigned short opcode = profile->pc_opcodes[pc];
+        AsmStatement statement = {0};
+        decode_dasm(&statement, opcode, has_quirks);
+        char label[16], disassembly[32];
+        format_label(label, sizeof(label), is_label, pc);
+        format_statement(disassembly, sizeof(disassembly), &statement);
+        fprintf(file, "%14lu %6.2f%%  %03x  %-10s %04x   %s\n",
+                profile->pc_counts[pc],
+                percent(profile->pc_counts[pc], profile->instructions), pc,
+                label, opcode, disassembly);
+    }
+}
+
+// A loop is the code between a jump back and where it jumps to
+void write_hot_loops(FILE *file, const Profile *profile,
+                     const bool *is_label) {
+    bool is_taken[SIZE_MEMORY] = {false};
+    fprintf(file, "\nHot loops\n");
+    fprintf(file, "%14s %14s %7s  %-21s %s\n", "iterations", "instructions",
+            "%", "loop", "instructions/iteration");
+    for (int n = 0; n < NUM_HOT_LOOPS; n++) {
+        int pc = take_largest(profile->loop_counts, SIZE_MEMORY, is_taken);
+        if (pc == -1) break;
+        unsigned short target = profile->loop_targets[pc];
+        unsigned long instructions = 0;
+        for (int i = target; i <= pc; i++) {
+            instructions += profile->pc_counts[i];
+        }
+        char start[16], end[16], loop[40];
+        format_label(start, sizeof(start), is_label, target);
+        format_label(end, sizeof(end), is_label, pc);
+        snprintf(loop, sizeof(loop), "%s..%s", start, end);
+        fprintf(file, "%14lu %14lu %6.2f%%  %-21s %.1f\n",
+                profile->loop_counts[pc], instructions,
+                percent(instructions, profile->instructions), loop,
+                (double)instructions / profile->loop_counts[pc]);
+    }
+}
+
+int write_profile(const Profile *profile, const char *path, bool has_quirks) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return 1;
+    bool *is_label = malloc(SIZE_MEMORY * sizeof(bool));
+    if (is_label == NULL) {
+        fclose(file);
+        return 1;
+    }
+    find_labels(profile, is_label, has_quirks);
+
+    fprintf(file, "Profile of %lu instructions\n", profile->instructions);
+    fprintf(file, "draws: %lu (%lu rows, %lu with a collision)\n",
+            profile->draws, profile->rows_drawn, profile->collisions);
+    fprintf(file, "scrolls: %lu\n", profile->scrolls);
+    fprintf(file, "key waits: %lu (LD Vx, K run again without a key)\n",
+            profile->key_waits);
+    write_flat_profile(file, profile, has_quirks);
+    write_hot_pcs(file, profile, is_label, has_quirks);
+    write_hot_loops(file, profile, is_label);
+
+    free(is_label);
+    return (fclose(file) == 0) ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+#include "renderer.h"
+
+#include <ncurses.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "graphics.h"
+#include "keypad.h"
+#include "probes.h"
+#include "trace.h"
+#include "write_counter.h"
+
+#define FRESH 0x4
+#define INDEX(middle) ((middle) & 0x3)
+
+// How often the render thread looks for new frames and keys (in microseconds)
+#define POLL_INTERVAL 1000
+
+#define MAX_STATUS_SIZE 256
+
+bool is_threaded;
+TripleBuffer render_buffer;
+pthread_t render_thread;
+atomic_bool is_running;
+
+atomic_ulong produced, presented, dropped, render_time;
+
+// Status line waiting for the render thread (under status_lock)
+char status_line[MAX_STATUS_SIZE];
+bool has_status_line;
+atomic_bool is_status_new;
+pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long get_draw_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void tb_init(TripleBuffer *tb) {
+    memset(tb->frames, 0, sizeof(tb->frames));
+    tb->back = 0;
+    atomic_init(&tb->middle, 1);
+    tb->front = 2;
+}
+
+Frame *tb_back(TripleBuffer *tb) { return &tb->frames[tb->back]; }
+
+bool tb_publish(TripleBuffer *tb) {
+    unsigned int prev = atomic_exchange_explicit(
+        &tb->middle, tb->back | FRESH, memory_order_acq_rel);
+    tb->back = INDEX(prev);
+    return (prev & FRESH) != 0;
+}
+
+Frame *tb_acquire(TripleBuffer *tb) {
+    if ((atomic_load_explicit(&tb->middle, memory_order_relaxed) & FRESH) == 0)
+        return NULL;
+    unsigned int prev = atomic_exchange_explicit(&tb->middle, tb->front,
+                                                 memory_order_acq_rel);
+    tb->front = INDEX(prev);
+    return &tb->frames[tb->front];
+}
+
+// For the frame_present probe
+unsigned long get_presented() {
+    return atomic_load_explicit(&presented, memory_order_relaxed);
+}
+
+unsigned long get_bytes_written() {
+    WriteCounts counts;
+    get_write_counts(&counts);
+    return counts.bytes;
+}
+
+void poll_keys() {
+    int key;
+    while ((key = getch()) != ERR) feed_keypad(key);
+}
+
+void present_frame(Frame *frame, Frame *shown, bool *has_shown) {
+    unsigned long span = begin_span();
+    unsigned long start = get_draw_time();
+    if (!*has_shown || frame->hi_res != shown->hi_res) {
+        draw_all(frame->video_mem, frame->hi_res);
+        refresh();
+        // Clearing the screen took the status line with it
+        pthread_mutex_lock(&status_lock);
+        if (has_status_line) atomic_store(&is_status_new, true);
+        pthread_mutex_unlock(&status_lock);
+    } else {
+        draw_diff(frame->video_mem, shown->video_mem, frame->hi_res);
+    }
+    st_flash(frame->is_flashing);
+    memcpy(shown, frame, sizeof(Frame));
+    *has_shown = true;
+    atomic_fetch_add_explicit(&presented, 1, memory_order_relaxed);
+    CHIP8_PROBE2(frame_present, get_presented(), get_bytes_written());
+    add_render_time(get_draw_time() - start);
+    end_span("render", span);
+}
+
+void draw_new_status_line() {
+    if (!atomic_exchange(&is_status_new, false)) return;
+    char text[MAX_STATUS_SIZE];
+    pthread_mutex_lock(&status_lock);
+    bool is_shown = has_status_line;
+    memcpy(text, status_line, MAX_STATUS_SIZE);
+    pthread_mutex_unlock(&status_lock);
+    draw_status_line((is_shown) ? text : NULL);
+}
+
+int write_frame(FILE *file, Frame *frame) {
+    unsigned char hi_res = frame->hi_res;
+    if (fwrite(&hi_res, 1, 1, file) != 1) return 1;
+    if (fwrite(frame->video_mem, 1, SIZE_VIDEO_MEM, file) != SIZE_VIDEO_MEM)
+        return 1;
+    return 0;
+}
+
+int read_frame(FILE *file, Frame *frame) {
+    unsigned char hi_res;
+    if (fread(&hi_res, 1, 1, file) != 1) return 1;
+    if (fread(frame->video_mem, 1, SIZE_VIDEO_MEM, file) != SIZE_VIDEO_MEM)
+        return 1;
+    frame->hi_res = hi_res;
+    frame->is_flashing = false;
+    return 0;
+}
+
+void *render_loop(void *arg) {
+    static Frame shown;
+    bool has_shown = false;
+    register_trace_thread("render");
+    while (atomic_load_explicit(&is_running, memory_order_relaxed)) {
+        handle_win_size(shown.video_mem, shown.hi_res);
+        if (get_keypad_mode() == KEYPAD_LEGACY) handle_xset_message();
+
+        // ncurses isn't thread safe, so only this thread may call getch()
+        unsigned long span = begin_span();
+        poll_keys();
+        end_span("input", span);
+
+        Frame *frame = tb_acquire(&render_buffer);
+        if (frame != NULL) present_frame(frame, &shown, &has_shown);
+        draw_new_status_line();
+        usleep(POLL_INTERVAL);
+    }
+    return NULL;
+}
+
+void init_renderer(bool threaded) {
+    is_threaded = threaded;
+    init_graphics();
+    enable_key_events();
+    if (!is_threaded) return;
+    tb_init(&render_buffer);
+    atomic_store(&is_running, true);
+    if (pthread_create(&render_thread, NULL, render_loop, NULL) != 0) {
+        // Fall back to drawing inline
+        is_threaded = false;
+    }
+}
+
+void stop_renderer() {
+    if (is_threaded && atomic_exchange(&is_running, false)) {
+        pthread_join(render_thread, NULL);
+    }
+    endwin();
+    disable_key_events();
+}
+
+bool is_renderer_threaded() { return is_threaded; }
+
+void poll_inline_keys() {
+    if (!is_threaded) poll_keys();
+}
+
+void publish_frame(unsigned char *video_mem, bool hi_res, bool is_flashing) {
+    unsigned long span = begin_span();
+    atomic_fetch_add_explicit(&produced, 1, memory_order_relaxed);
+    if (!is_threaded) {
+        // Inline rendering already drew the frame instruction by instruction
+        st_flash(is_flashing);
+        atomic_fetch_add_explicit(&presented, 1, memory_order_relaxed);
+        CHIP8_PROBE2(frame_present, get_presented(), get_bytes_written());
+        end_span("present", span);
+        return;
+    }
+
+    Frame *frame = tb_back(&render_buffer);
+    memcpy(frame->video_mem, video_mem, SIZE_VIDEO_MEM);
+    frame->hi_res = hi_res;
+    frame->is_flashing = is_flashing;
+    frame->number = atomic_load_explicit(&produced, memory_order_relaxed);
+    if (tb_publish(&render_buffer)) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    }
+    end_span("present", span);
+}
+
+void add_render_time(unsigned long time) {
+    atomic_fetch_add_explicit(&render_time, time, memory_order_relaxed);
+}
+
+void show_status_line(const char *text) {
+    if (!is_threaded) {
+        draw_status_line(text);
+        return;
+    }
+    pthread_mutex_lock(&status_lock);
+    has_status_line = text != NULL;
+    if (text != NULL) {
+        strncpy(status_line, text, MAX_STATUS_SIZE - 1);
+        status_line[MAX_STATUS_SIZE - 1] = '\0';
+    }
+    pthread_mutex_unlock(&status_lock);
+    atomic_store(&is_status_new, true);
+}
+
+void get_render_stats(RenderStats *stats) {
+    stats->produced = atomic_load_explicit(&produced, memory_order_relaxed);
+    stats->presented = atomic_load_explicit(&presented, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+    stats->render_time =
+        atomic_load_explicit(&render_time, memory_order_relaxed);
+}
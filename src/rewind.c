@@ -0,0 +1,232 @@
+#include "rewind.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+// Equal bytes needed to end a literal run (shorter runs are cheaper inline)
+#define MIN_ZERO_RUN 4
+// Worst case of encode_delta(), every chunk covers at least 5 bytes
+#define MAX_ENCODED_SIZE (2 * STATE_SIZE + 4)
+// One snapshot per frame, at most this many per byte of the buffer
+#define BYTES_PER_SNAPSHOT 256
+
+_Static_assert(STATE_SIZE <= 0xffff, "runs are stored in 16 bits");
+
+typedef struct {
+    size_t offset;     /**< Where the encoded data starts in the buffer */
+    unsigned int size; /**< Size of the encoded data */
+    bool is_keyframe;  /**< Is it encoded against zeros (whole state) */
+} Snapshot;
+
+unsigned char *rewind_buffer = NULL;
+size_t rewind_size;
+size_t write_offset;
+
+// Ring of snapshots, from the oldest to the newest
+Snapshot *snapshots;
+unsigned long max_snapshots;
+unsigned long first_snapshot;
+unsigned long num_snapshots;
+
+unsigned long num_keyframes;
+unsigned long since_keyframe;
+size_t used_bytes;
+
+unsigned char *top;        // State of the newest snapshot
+unsigned char *zero_state; // What keyframes are encoded against
+unsigned char *scratch;
+
+void write_u16(unsigned char *out, unsigned short value) {
+    memcpy(out, &value, sizeof(value));
+}
+
+unsigned short read_u16(const unsigned char *in) {
+    unsigned short value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+/* Run-length encodes a XOR b as chunks of
+ *      equal bytes count (16 bits), different bytes count (16 bits),
+ *      different bytes XORed
+ * Equal bytes at the end aren't stored
+ */
+size_t encode_delta(const unsigned char *a, const unsigned char *b,
+                    unsigned char *out) {
+    size_t i = 0, len = 0;
+    while (i < STATE_SIZE) {
+        size_t zeros_start = i;
+        while (i + 8 <= STATE_SIZE && memcmp(a + i, b + i, 8) == 0) i += 8;
+        while (i < STATE_SIZE && a[i] == b[i]) i++;
+        if (i == STATE_SIZE) break;
+
+        size_t literal_start = i, literal_end = i;
+        while (i < STATE_SIZE) {
+            if (a[i] != b[i])
+                literal_end = i + 1;
+            else if (i + 1 - literal_end >= MIN_ZERO_RUN)
+                break;
+            i++;
+        }
+        i = literal_end;
+
+        write_u16(out + len, literal_start - zeros_start);
+        write_u16(out + len + 2, literal_end - literal_start);
+        len += 4;
+        for (size_t j = literal_start; j < literal_end; j++) {
+            out[len++] = a[j] ^ b[j];
+        }
+    }
+    return len;
+}
+
+void apply_delta(unsigned char *state, const unsigned char *delta,
+                 size_t size) {
+    size_t pos = 0;
+    const unsigned char *end = delta + size;
+    while (delta < end) {
+        pos += read_u16(delta);
+        unsigned short literals = read_u16(delta + 2);
+        delta += 4;
+        for (int j = 0; j < literals; j++) state[pos++] ^= *delta++;
+    }
+}
+
+Snapshot *get_snapshot(unsigned long i) {
+    return &snapshots[(first_snapshot + i) % max_snapshots];
+}
+
+void drop_oldest() {
+    Snapshot *oldest = get_snapshot(0);
+    used_bytes -= oldest->size;
+    if (oldest->is_keyframe) num_keyframes--;
+    first_snapshot = (first_snapshot + 1) % max_snapshots;
+    num_snapshots--;
+}
+
+// Drops the oldest snapshots until `size` bytes fit at the write offset
+void make_room(size_t size) {
+    if (write_offset + size > rewind_size) {
+        // Wrap around, the snapshots at the end of the buffer are the oldest
+        while (num_snapshots > 0 && get_snapshot(0)->offset >= write_offset) {
+            drop_oldest();
+        }
+        write_offset = 0;
+    }
+    while (num_snapshots > 0) {
+        Snapshot *oldest = get_snapshot(0);
+        bool overlaps = oldest->offset < write_offset + size &&
+                        oldest->offset + oldest->size > write_offset;
+        if (!overlaps && num_snapshots < max_snapshots) break;
+        drop_oldest();
+    }
+    // Deltas without the keyframe before them are useless
+    while (num_snapshots > 0 && !get_snapshot(0)->is_keyframe) drop_oldest();
+}
+
+int init_rewind(size_t size) {
+    if (size < 4 * MAX_ENCODED_SIZE) return 1;
+    rewind_buffer = malloc(size);
+    max_snapshots = size / BYTES_PER_SNAPSHOT;
+    snapshots = malloc(max_snapshots * sizeof(Snapshot));
+    top = malloc(STATE_SIZE);
+    zero_state = calloc(1, STATE_SIZE);
+    scratch = malloc(MAX_ENCODED_SIZE);
+    if (rewind_buffer == NULL || snapshots == NULL || top == NULL ||
+        zero_state == NULL || scratch == NULL) {
+        stop_rewind();
+        return 1;
+    }
+    rewind_size = size;
+    write_offset = 0;
+    first_snapshot = 0;
+    num_snapshots = 0;
+    num_keyframes = 0;
+    since_keyframe = 0;
+    used_bytes = 0;
+    return 0;
+}
+
+void stop_rewind() {
+    free(rewind_buffer);
+    free(snapshots);
+    free(top);
+    free(zero_state);
+    free(scratch);
+    rewind_buffer = NULL;
+    snapshots = NULL;
+    top = zero_state = scratch = NULL;
+}
+
+bool is_rewind_enabled() { return rewind_buffer != NULL; }
+
+void push_snapshot(const void *state) {
+    if (rewind_buffer == NULL) return;
+    bool is_keyframe =
+        num_snapshots == 0 || since_keyframe + 1 >= KEYFRAME_INTERVAL;
+    size_t size =
+        encode_delta(state, (is_keyframe) ? zero_state : top, scratch);
+    make_room(size);
+    if (num_snapshots == 0 && !is_keyframe) {
+        // Everything got dropped, there's nothing for the delta to apply to
+        is_keyframe = true;
+        size = encode_delta(state, zero_state, scratch);
+        make_room(size);
+    }
+
+    memcpy(rewind_buffer + write_offset, scratch, size);
+    Snapshot *snapshot = get_snapshot(num_snapshots);
+    snapshot->offset = write_offset;
+    snapshot->size = size;
+    snapshot->is_keyframe = is_keyframe;
+    num_snapshots++;
+    write_offset += size;
+    used_bytes += size;
+    if (is_keyframe) {
+        num_keyframes++;
+        since_keyframe = 0;
+    } else {
+        since_keyframe++;
+    }
+    memcpy(top, state, STATE_SIZE);
+}
+
+// Decodes the newest snapshot, starting from the keyframe before it
+void rebuild_top() {
+    unsigned long i = num_snapshots - 1;
+    while (!get_snapshot(i)->is_keyframe) i--;
+    since_keyframe = num_snapshots - 1 - i;
+    memset(top, 0, STATE_SIZE);
+    for (; i < num_snapshots; i++) {
+        Snapshot *snapshot = get_snapshot(i);
+        apply_delta(top, rewind_buffer + snapshot->offset, snapshot->size);
+    }
+}
+
+const void *pop_snapshot() {
+    if (rewind_buffer == NULL || num_snapshots < 2) return NULL;
+    Snapshot newest = *get_snapshot(num_snapshots - 1);
+    num_snapshots--;
+    used_bytes -= newest.size;
+    write_offset = newest.offset;
+
+    if (newest.is_keyframe) {
+        num_keyframes--;
+        rebuild_top();
+    } else {
+        // XOR works both ways, so the delta also takes the state back
+        apply_delta(top, rewind_buffer + newest.offset, newest.size);
+        since_keyframe--;
+    }
+    return top;
+}
+
+void get_rewind_stats(RewindStats *stats) {
+    stats->snapshots = num_snapshots;
+    stats->keyframes = num_keyframes;
+    stats->bytes = used_bytes;
+    stats->size = rewind_size;
+}
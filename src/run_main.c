@@ -0,0 +1,330 @@
+#include <config.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "debugger.h"
+#include "lockstep.h"
+#include "movie.h"
+#include "profile.h"
+
+#define DEFAULT_NUM_FRAMES 600
+#define MAX_HASH_FRAMES 256
+
+unsigned long get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Only touched with -O, so it costs nothing otherwise
+Profile profile;
+
+unsigned long hash_frames[MAX_HASH_FRAMES];
+int num_hash_frames = 0;
+
+int compare_frames(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+// Parses a comma separated list of frame numbers
+int parse_hash_frames(char *list) {
+    for (char *item = strtok(list, ","); item != NULL;
+         item = strtok(NULL, ",")) {
+        char *end;
+        unsigned long frame = strtoul(item, &end, 10);
+        if (*end != '\0' || num_hash_frames == MAX_HASH_FRAMES) return 1;
+        hash_frames[num_hash_frames++] = frame;
+    }
+    qsort(hash_frames, num_hash_frames, sizeof(unsigned long), compare_frames);
+    return 0;
+}
+
+unsigned int hash_frame() {
+    return hash_bytes(get_video_mem(), SIZE_VIDEO_MEM);
+}
+
+void print_registers_line() {
+    Chip8 *machine = get_machine();
+    printf("V:");
+    for (int i = 0; i < 16; i++) printf(" %02x", machine->V[i]);
+    printf("\n");
+    printf("I: %04x PC: %04x SP: %02x DT: %02x ST: %02x\n", machine->I,
+           machine->pc, machine->sp, machine->dt, machine->st);
+}
+
+// Runs copies of the program with seeds seed, seed + 1, ... in lockstep
+int run_lanes(int num_lanes, const char *program_path, bool has_quirks,
+              unsigned long long seed, int tick_speed, unsigned long max_frames,
+              unsigned long max_instructions, Movie *movie) {
+    unsigned long long *seeds = malloc(num_lanes * sizeof(*seeds));
+    unsigned short *keys = calloc(num_lanes, sizeof(*keys));
+    Flag *flags = malloc(num_lanes * sizeof(*flags));
+    Lockstep lanes;
+    if (seeds == NULL || keys == NULL || flags == NULL) {
+        printf("Error allocating %d lanes.\n", num_lanes);
+        return 1;
+    }
+    for (int i = 0; i < num_lanes; i++) seeds[i] = seed + i;
+    if (init_lockstep(&lanes, num_lanes, program_path, has_quirks, seeds) ==
+        1) {
+        printf("Error starting %d lanes.\n", num_lanes);
+        return 1;
+    }
+
+    unsigned long max_cycles = max_instructions * 3;
+    unsigned long cycles = 0;
+    long cycle_budget = 0;
+    unsigned long frame = 0;
+    int next_hash = 0;
+    unsigned long start = get_time();
+    while (lanes.num_running > 0) {
+        if (max_frames != 0 && frame >= max_frames) break;
+        if (max_frames == 0 && movie->file != NULL &&
+            is_movie_over(movie, frame))
+            break;
+        if (max_cycles != 0 && cycles >= max_cycles) break;
+
+        long num_cycles = next_frame_cycles(tick_speed, &cycle_budget);
+        if (max_cycles != 0 && cycles + num_cycles > max_cycles) {
+            num_cycles = max_cycles - cycles;
+        }
+        unsigned short frame_keys =
+            (movie->file != NULL) ? replay_keys(movie, frame) : 0;
+        for (int i = 0; i < num_lanes; i++) keys[i] = frame_keys;
+        run_lockstep_frame(&lanes, keys, num_cycles, flags);
+        cycles += num_cycles;
+        frame++;
+
+        for (; next_hash < num_hash_frames &&
+               hash_frames[next_hash] <= frame;
+             next_hash++) {
+            if (hash_frames[next_hash] != frame) continue;
+            for (int i = 0; i < num_lanes; i++) {
+                if (flags[i] == EXIT) continue;
+                printf("frame %lu lane %d: %08x\n", frame, i,
+                       hash_bytes(get_lane_machine(&lanes, i)->video_mem,
+                                  SIZE_VIDEO_MEM));
+            }
+        }
+    }
+    double seconds = (get_time() - start) / 1000000.0;
+    if (seconds <= 0) seconds = 1e-6;
+
+    unsigned long instructions = 0;
+    printf("frames: %lu\n", frame);
+    for (int i = 0; i < num_lanes; i++) {
+        Chip8 *machine = get_lane_machine(&lanes, i);
+        instructions += machine->cycles / 3;
+        printf("lane %d: %08x %lu instructions%s\n", i,
+               hash_bytes(machine->video_mem, SIZE_VIDEO_MEM),
+               machine->cycles / 3, (lanes.is_running[i]) ? "" : " exited");
+    }
+    printf("lockstep: %lu instructions on all lanes, %lu lane by lane\n",
+           lanes.vector_steps, lanes.lane_steps);
+    fprintf(stderr, "%.3f s, %.0f instructions/s\n", seconds,
+            instructions / seconds);
+    free_lockstep(&lanes);
+    free(seeds);
+    free(keys);
+    free(flags);
+    return 0;
+}
+
+void print_help() {
+    printf(
+        "Usage: ./chip8_run [-h] [-q <quirks>] [-t <tick_speed>] "
+        "[-f <frames>] [-n <instructions>] [-S <seed>] [-M <movie_file>] "
+        "[-H <frames>] [-L <lanes>] [-O <profile_file>] "
+        "<program_path>\n\n");
+    printf("Runs a program without a terminal, as fast as possible.\n");
+    printf("Options:\n");
+    printf(" -q <quirks>        Quirk profile: chip8 (default) or schip\n");
+    printf(" -t <tick_speed>    Set tick speed (default 900)\n");
+    printf(" -f <frames>        Stop after this many frames (default 600, or "
+           "the whole movie)\n");
+    printf(" -n <instructions>  Stop after this many instructions\n");
+    printf(" -S <seed>          Seed the random number generator "
+           "(default 0)\n");
+    printf(" -M <movie_file>    Take the keys from a movie (chip8_emu -M), "
+           "with its\n"
+           "                    quirks, tick speed and seed\n");
+    printf(" -H <frames>        Print the framebuffer hash after these frames "
+           "(e.g. 1,60,600)\n");
+    printf(" -L <lanes>         Run this many copies in lockstep, with seeds "
+           "<seed>,\n"
+           "                    <seed> + 1, ... and print the hash of each\n");
+    printf(" -O <profile_file>  Count every instruction and write a profile "
+           "with the\n"
+           "                    hottest instructions and loops\n");
+    printf(" -h                 Displays this message and version number\n");
+}
+
+int main(int argc, char *argv[]) {
+    int tick_speed = DEFAULT_TICK_SPEED;
+    unsigned long max_frames = 0;
+    unsigned long max_instructions = 0;
+    unsigned long long seed = 0;
+    bool has_quirks = false;
+    const char *movie_path = NULL;
+    int num_lanes = 0;
+    const char *profile_path = NULL;
+
+    char c;
+    while ((c = getopt(argc, argv, "q:t:f:n:S:M:H:L:O:h")) != -1) {
+        switch (c) {
+            case 'q':
+                if (strcmp(optarg, "schip") == 0) {
+                    has_quirks = true;
+                } else if (strcmp(optarg, "chip8") != 0) {
+                    printf("Unknown quirk profile %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                tick_speed = atoi(optarg);
+                if (tick_speed == 0) tick_speed = DEFAULT_TICK_SPEED;
+                break;
+            case 'f':
+                max_frames = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                max_instructions = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'M':
+                movie_path = optarg;
+                break;
+            case 'H':
+                if (parse_hash_frames(optarg) == 1) {
+                    printf("Bad list of frames %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'L':
+                num_lanes = atoi(optarg);
+                if (num_lanes < 1) {
+                    printf("Bad number of lanes %s.\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'O':
+                profile_path = optarg;
+                break;
+            case 'h':
+                printf("%s\n", PACKAGE_STRING);
+                print_help();
+                return 0;
+            default:
+                print_help();
+                return 1;
+        }
+    }
+
+    if (argc - 1 != optind) {
+        // There are more than one non-option arguments
+        print_help();
+        return 1;
+    }
+    const char *program_path = argv[optind];
+
+    init_chip8();
+    Movie movie = {0};
+    if (movie_path != NULL) {
+        if (open_movie(&movie, movie_path) == 1) {
+            printf("Error opening movie %s.\n", movie_path);
+            return 1;
+        }
+        has_quirks = movie.header.superchip8_quirks;
+        tick_speed = movie.header.tick_speed;
+        seed = movie.header.seed;
+    }
+    if (has_quirks) set_superchip8_quirks();
+    seed_random(seed);
+    if (load_program(program_path) == 1) return 1;
+
+    unsigned char state[STATE_SIZE];
+    export_state(state);
+    if (movie.file != NULL &&
+        hash_bytes(state, STATE_SIZE) != movie.header.state_hash) {
+        printf("The movie starts from a different program or state.\n");
+        close_movie(&movie);
+        return 1;
+    }
+    if (max_frames == 0 && max_instructions == 0 && movie.file == NULL) {
+        max_frames = DEFAULT_NUM_FRAMES;
+    }
+    if (num_lanes > 0 && profile_path != NULL) {
+        printf("Lanes can't be profiled.\n");
+        close_movie(&movie);
+        return 1;
+    }
+    if (num_lanes > 0) {
+        int ret = run_lanes(num_lanes, program_path, has_quirks, seed,
+                            tick_speed, max_frames, max_instructions, &movie);
+        close_movie(&movie);
+        return ret;
+    }
+
+    unsigned long max_cycles = max_instructions * 3;
+    long cycle_budget = 0;
+    unsigned long frame = 0;
+    int next_hash = 0;
+    Flag flag = IDLE;
+    Chip8 *machine = get_machine();
+    unsigned long start = get_time();
+    while (flag != EXIT) {
+        if (max_frames != 0 && frame >= max_frames) break;
+        if (max_frames == 0 && movie.file != NULL &&
+            is_movie_over(&movie, frame))
+            break;
+        if (max_cycles != 0 && machine->cycles >= max_cycles) break;
+
+        long num_cycles = next_frame_cycles(tick_speed, &cycle_budget);
+        if (max_cycles != 0 && machine->cycles + num_cycles > max_cycles) {
+            num_cycles = max_cycles - machine->cycles;
+        }
+        unsigned short keys =
+            (movie.file != NULL) ? replay_keys(&movie, frame) : 0;
+        if (profile_path != NULL)
+            flag = run_profiled_frame(&profile, keys, num_cycles);
+        else
+            flag = run_frame(keys, num_cycles);
+        frame++;
+
+        for (; next_hash < num_hash_frames &&
+               hash_frames[next_hash] <= frame;
+             next_hash++) {
+            if (hash_frames[next_hash] != frame) continue;
+            printf("frame %lu: %08x\n", frame, hash_frame());
+        }
+    }
+    double seconds = (get_time() - start) / 1000000.0;
+    if (seconds <= 0) seconds = 1e-6;
+    close_movie(&movie);
+
+    // Everything on stdout is the same on every run, timing goes to stderr
+    print_error();
+    printf("frames: %lu\n", frame);
+    printf("instructions: %lu\n", machine->cycles / 3);
+    printf("final: %08x%s\n", hash_frame(), (get_hi_res()) ? " hi-res" : "");
+    print_registers_line();
+    fprintf(stderr, "%.3f s, %.0f instructions/s\n", seconds,
+            machine->cycles / 3 / seconds);
+    if (profile_path != NULL &&
+        write_profile(&profile, profile_path, has_quirks) == 1) {
+        printf("Error writing the profile to %s.\n", profile_path);
+        free_machine(machine);
+        return 1;
+    }
+    free_machine(machine);
+    return 0;
+}
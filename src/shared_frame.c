@@ -0,0 +1,130 @@
+#include "shared_frame.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+#define SHARED_FRAME_MAGIC "C8FB"
+
+SharedFrames *create_shared_frames(const char *name) {
+    // Never take over a segment someone else may be writing to
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) return NULL;
+    if (ftruncate(fd, sizeof(SharedFrames)) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    SharedFrames *shared = mmap(NULL, sizeof(SharedFrames),
+                                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    memset(shared, 0, sizeof(SharedFrames));
+    shared->version = SHARED_FRAME_VERSION;
+    shared->header_size = offsetof(SharedFrames, slots);
+    shared->slot_size = sizeof(SharedSlot);
+    atomic_store(&shared->is_running, 1);
+    // Readers check the magic first, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    memcpy(shared->magic, SHARED_FRAME_MAGIC, sizeof(shared->magic));
+    return shared;
+}
+
+void publish_shared_frame(SharedFrames *shared, bool is_flashing) {
+    unsigned long latest =
+        atomic_load_explicit(&shared->latest, memory_order_relaxed);
+    SharedSlot *slot = &shared->slots[latest % NUM_SHARED_FRAMES];
+    unsigned long sequence =
+        atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    const Chip8 *machine = get_machine();
+    SharedFrame *frame = &slot->frame;
+    frame->frame = latest;
+    frame->cycles = machine->cycles;
+    memcpy(frame->video_mem, machine->video_mem, SIZE_VIDEO_MEM);
+    frame->hi_res = machine->hi_res;
+    frame->is_flashing = is_flashing;
+    memcpy(frame->V, machine->V, sizeof(frame->V));
+    frame->pc = machine->pc;
+    frame->I = machine->I;
+    frame->sp = machine->sp;
+    frame->dt = machine->dt;
+    frame->st = machine->st;
+
+    atomic_store_explicit(&slot->sequence, sequence + 2,
+                          memory_order_release);
+    atomic_store_explicit(&shared->latest, latest + 1, memory_order_release);
+}
+
+void remove_shared_frames(SharedFrames *shared, const char *name) {
+    atomic_store(&shared->is_running, 0);
+    munmap(shared, sizeof(SharedFrames));
+    shm_unlink(name);
+}
+
+const SharedFrames *open_shared_frames(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(SharedFrames)) {
+        close(fd);
+        return NULL;
+    }
+    const SharedFrames *shared =
+        mmap(NULL, sizeof(SharedFrames), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) return NULL;
+    if (memcmp(shared->magic, SHARED_FRAME_MAGIC, sizeof(shared->magic)) !=
+            0 ||
+        shared->version != SHARED_FRAME_VERSION ||
+        shared->header_size != offsetof(SharedFrames, slots) ||
+        shared->slot_size != sizeof(SharedSlot)) {
+        close_shared_frames(shared);
+        return NULL;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    return shared;
+}
+
+const SharedFrame *begin_shared_read(const SharedFrames *shared,
+                                     unsigned long *sequence) {
+    while (true) {
+        // Casts only drop the const, atomic loads don't write
+        unsigned long latest = atomic_load_explicit(
+            (atomic_ulong *)&shared->latest, memory_order_acquire);
+        if (latest == 0) return NULL;
+        const SharedSlot *slot =
+            &shared->slots[(latest - 1) % NUM_SHARED_FRAMES];
+        *sequence = atomic_load_explicit((atomic_ulong *)&slot->sequence,
+                                         memory_order_acquire);
+        // Odd while the emulator is already writing the slot again
+        if (*sequence % 2 == 0) return &slot->frame;
+    }
+}
+
+bool end_shared_read(const SharedFrames *shared, const SharedFrame *frame,
+                     unsigned long sequence) {
+    const SharedSlot *slot = (const SharedSlot *)((const char *)frame -
+                                                  offsetof(SharedSlot, frame));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit((atomic_ulong *)&slot->sequence,
+                                memory_order_relaxed) == sequence;
+}
+
+void close_shared_frames(const SharedFrames *shared) {
+    munmap((void *)shared, sizeof(SharedFrames));
+}
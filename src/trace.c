@@ -0,0 +1,185 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Size of the stdio buffer of the trace file
+#define TRACE_BUFFER_SIZE (1 << 20)
+// Microseconds between two drains of the rings by the writer thread
+#define TRACE_FLUSH_INTERVAL 10000
+
+typedef struct {
+    const char *name;
+    unsigned long start;    /**< Nanoseconds */
+    unsigned long duration; /**< Nanoseconds, for spans */
+    char phase;             /**< 'X' for a span, 'i' for an instant */
+} TraceEvent;
+
+// Single producer (its thread), single consumer (the writer thread)
+typedef struct {
+    TraceEvent events[TRACE_RING_SIZE];
+    atomic_ulong head, tail;
+    atomic_ulong dropped;
+    const char *name;
+    int tid;
+} TraceRing;
+
+bool is_tracing = false;
+FILE *trace_file = NULL;
+char *trace_buffer = NULL;
+unsigned long trace_start;
+bool has_trace_events;
+
+TraceRing *trace_rings[MAX_TRACE_THREADS];
+atomic_int num_trace_rings;
+_Thread_local TraceRing *thread_ring = NULL;
+
+// Writes the events to the file, so the traced threads never do
+pthread_t writer_thread;
+atomic_bool is_writer_stopping;
+
+unsigned long get_trace_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void write_event(const TraceEvent *event, int tid) {
+    fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,",
+            (has_trace_events) ? "," : "", event->name, event->phase,
+            (event->start - trace_start) / 1000.0);
+    if (event->phase == 'X') {
+        fprintf(trace_file, "\"dur\":%.3f,", event->duration / 1000.0);
+    } else {
+        fprintf(trace_file, "\"s\":\"t\",");
+    }
+    fprintf(trace_file, "\"pid\":1,\"tid\":%d}", tid);
+    has_trace_events = true;
+}
+
+// Writes the events of every ring to the file (buffered), only the writer
+// thread and `stop_trace()` after it call it
+void flush_trace() {
+    int num_rings = atomic_load(&num_trace_rings);
+    for (int i = 0; i < num_rings; i++) {
+        TraceRing *ring = trace_rings[i];
+        unsigned long tail =
+            atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head =
+            atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            write_event(&ring->events[tail % TRACE_RING_SIZE], ring->tid);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+}
+
+void *run_trace_writer(void *arg) {
+    while (!atomic_load(&is_writer_stopping)) {
+        flush_trace();
+        usleep(TRACE_FLUSH_INTERVAL);
+    }
+    return NULL;
+}
+
+int start_trace(const char *path) {
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) return 1;
+    trace_buffer = malloc(TRACE_BUFFER_SIZE);
+    if (trace_buffer != NULL) {
+        setvbuf(trace_file, trace_buffer, _IOFBF, TRACE_BUFFER_SIZE);
+    }
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    trace_start = get_trace_time();
+    has_trace_events = false;
+    is_tracing = true;
+    register_trace_thread("main");
+    atomic_store(&is_writer_stopping, false);
+    if (pthread_create(&writer_thread, NULL, run_trace_writer, NULL) != 0) {
+        is_tracing = false;
+        fclose(trace_file);
+        trace_file = NULL;
+        free(trace_buffer);
+        trace_buffer = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+void register_trace_thread(const char *name) {
+    if (!is_tracing || thread_ring != NULL) return;
+    int index = atomic_load(&num_trace_rings);
+    if (index >= MAX_TRACE_THREADS) return;
+    TraceRing *ring = calloc(1, sizeof(TraceRing));
+    if (ring == NULL) return;
+    ring->name = name;
+    ring->tid = index + 1;
+    // Only the main thread and threads it started register, one at a time
+    trace_rings[index] = ring;
+    atomic_store(&num_trace_rings, index + 1);
+    thread_ring = ring;
+}
+
+void record_event(const char *name, unsigned long start,
+                  unsigned long duration, char phase) {
+    TraceRing *ring = thread_ring;
+    if (ring == NULL) return;
+    unsigned long head =
+        atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long tail =
+        atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    TraceEvent *event = &ring->events[head % TRACE_RING_SIZE];
+    event->name = name;
+    event->start = start;
+    event->duration = duration;
+    event->phase = phase;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+unsigned long begin_span() { return (is_tracing) ? get_trace_time() : 0; }
+
+void end_span(const char *name, unsigned long start) {
+    if (!is_tracing || start == 0) return;
+    record_event(name, start, get_trace_time() - start, 'X');
+}
+
+void trace_instant(const char *name) {
+    if (!is_tracing) return;
+    record_event(name, get_trace_time(), 0, 'i');
+}
+
+int stop_trace() {
+    if (!is_tracing) return 0;
+    atomic_store(&is_writer_stopping, true);
+    pthread_join(writer_thread, NULL);
+    flush_trace();
+    is_tracing = false;
+    unsigned long dropped = 0;
+    int num_rings = atomic_load(&num_trace_rings);
+    for (int i = 0; i < num_rings; i++) {
+        TraceRing *ring = trace_rings[i];
+        fprintf(trace_file,
+                "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                (has_trace_events) ? "," : "", ring->tid, ring->name);
+        has_trace_events = true;
+        dropped += atomic_load(&ring->dropped);
+    }
+    fprintf(trace_file, "\n],\"otherData\":{\"dropped_events\":\"%lu\"}}\n",
+            dropped);
+    int status = (fclose(trace_file) == 0) ? 0 : 1;
+    trace_file = NULL;
+    // The threads' rings stay, they may still point to them
+    free(trace_buffer);
+    trace_buffer = NULL;
+    return status;
+}
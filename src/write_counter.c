@@ -0,0 +1,35 @@
+#include "write_counter.h"
+
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+atomic_int counted_fd = -1;
+atomic_ulong bytes_written, write_calls;
+
+/* Interposes libc's write() for the whole program. ncurses flushes its output
+ * buffer with write() on the terminal's file descriptor, so every call made by
+ * it ends up here too.
+ */
+ssize_t write(int fd, const void *buf, size_t count) {
+    ssize_t written = syscall(SYS_write, fd, buf, count);
+    if (fd == atomic_load_explicit(&counted_fd, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&write_calls, 1, memory_order_relaxed);
+        if (written > 0) {
+            atomic_fetch_add_explicit(&bytes_written, written,
+                                      memory_order_relaxed);
+        }
+    }
+    return written;
+}
+
+void count_writes(int fd) {
+    atomic_store(&bytes_written, 0);
+    atomic_store(&write_calls, 0);
+    atomic_store(&counted_fd, fd);
+}
+
+void get_write_counts(WriteCounts *counts) {
+    counts->bytes = atomic_load_explicit(&bytes_written, memory_order_relaxed);
+    counts->calls = atomic_load_explicit(&write_calls, memory_order_relaxed);
+}